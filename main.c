@@ -21,13 +21,33 @@
 #include <evhtp.h>
 #include <wand/MagickWand.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/stat.h>
+#ifndef NO_SYS_UN
+#include <sys/un.h>
+#endif
+#include <event2/thread.h>
 #include "zcommon.h"
 #include "zhttpd.h"
 #include "zutil.h"
 #include "zlog.h"
 #include "zcache.h"
+#include "zwand.h"
+#include "zimg.h"
+#include "zupload.h"
+#include "zvolume.h"
+#include "zdir.h"
+#include "zvariant.h"
+#include "zaio.h"
+#include "zcommit.h"
+#include "ztier.h"
+#include "zdisk.h"
+#include "zcluster.h"
+#include "zorigin.h"
+#include "zshard.h"
+#include "zrender.h"
 
 struct setting settings;
 evbase_t *evbase;
@@ -36,6 +56,8 @@ static void settings_init(void);
 static void sighandler(int signal); 
 int main(int argc, char **argv);
 void kill_server(void);
+static void htp_setup(evhtp_t *htp);
+static evhtp_t *unix_listen(evbase_t *base);
 
 
 /**
@@ -52,11 +74,34 @@ static void settings_init(void)
     //int th_n = get_cpu_cores();
     //printf("CPU cores: %d\n", th_n); 
     settings.num_threads = get_cpu_cores();         /* N workers */
+    settings.upload_threads = get_cpu_cores();      /* N savers of batch uploads */
     settings.log = false;
     settings.cache_on = false;
     strcpy(settings.cache_ip, "127.0.0.1");
     settings.cache_port = 11211;
     settings.max_keepalives = 1;
+    settings.volume_on = false;
+    settings.volume_size = 1024;                    /* MB of a volume file */
+    settings.compact_ratio = 50;                    /* percent of dead space to compact a volume, 0 for never */
+    settings.compact_rate = 20;                     /* MB/s of compaction I/O, 0 for no limit */
+    settings.variant_budget = 0;                    /* MB of disk for resized images, 0 for no limit */
+    settings.aio = AIO_URING;                       /* async storage I/O, threads if io_uring is not supported */
+    settings.durable = 0;                           /* ms to group commit uploads, 0 for not durable */
+    settings.fast_path[0] = '\0';                  /* root of the fast tier, empty for none */
+    settings.fast_budget = 1024;                    /* MB of the fast tier */
+    settings.disk_paths[0] = '\0';                 /* disks to stripe images over, empty for img_path only */
+    settings.cluster_peers[0] = '\0';              /* host:port of the nodes of a cluster, empty for none */
+    settings.cluster_self[0] = '\0';               /* host:port of this node in the cluster */
+    settings.cluster_mode = CLUSTER_PROXY;          /* requests of other nodes are proxied or redirected */
+    settings.peer_fetch = 0;                        /* ms to wait for the node holding a variant, 0 for rendering it here */
+    settings.origin[0] = '\0';                     /* url of the server having the originals, empty for none */
+    settings.max_age = 31536000;                    /* seconds of Cache-Control of images, 0 for no Cache-Control */
+    settings.shards = 0;                            /* SO_REUSEPORT listeners each with its own thread, 0 for one listener */
+    settings.unix_path[0] = '\0';                  /* path of a Unix socket to listen on too, empty for none */
+    settings.unix_mode = 0666;                      /* permissions of the Unix socket, like TCP of any local user */
+    settings.render_limit = 0;                      /* renders at the same time by the render queue, 0 for rendering by workers */
+    settings.render_queue = 64;                     /* renders waiting at most, more are answered 503 */
+    settings.render_wait = 1000;                    /* ms a render may wait before it is answered 503, 0 for no limit */
 }
 
 /**
@@ -81,6 +126,16 @@ static void sighandler(int signal)
 int main(int argc, char **argv)
 {
     int c;
+
+#ifndef EVHTP_DISABLE_EVTHR
+    //before any event base exists, they are all made locked and can be
+    //woken from other threads, e.g. the shards by shard_stop()
+    if(evthread_use_pthreads() == -1)
+    {
+        fprintf(stderr, "Libevent Thread Support Failed!\n");
+        return -1;
+    }
+#endif
     _init_path = getcwd(NULL, 0);
     LOG_PRINT(LOG_INFO, "Get init-path: %s", _init_path);
 
@@ -108,6 +163,29 @@ int main(int argc, char **argv)
                     "b:"
                     "h"
                     "k:"
+                    "u:"
+                    "v"
+                    "s:"
+                    "C:"
+                    "R:"
+                    "B:"
+                    "a:"
+                    "D:"
+                    "F:"
+                    "T:"
+                    "J:"
+                    "P:"
+                    "S:"
+                    "X:"
+                    "G:"
+                    "O:"
+                    "A:"
+                    "N:"
+                    "U:"
+                    "W:"
+                    "L:"
+                    "Q:"
+                    "E:"
                     )))
     {
         switch(c)
@@ -153,8 +231,141 @@ int main(int argc, char **argv)
             case 'k':
                 settings.max_keepalives = atoll(optarg);
                 break;
+            case 'u':
+                settings.upload_threads = atoi(optarg);
+                if (settings.upload_threads <= 0) {
+                    fprintf(stderr, "Number of upload threads must be greater than 0\n");
+                    return 1;
+                }
+                break;
+            case 'v':
+                settings.volume_on = true;
+                break;
+            case 's':
+                settings.volume_size = atoll(optarg);
+                if (settings.volume_size <= 0) {
+                    fprintf(stderr, "Size of volumes must be greater than 0\n");
+                    return 1;
+                }
+                break;
+            case 'C':
+                settings.compact_ratio = atoi(optarg);
+                if (settings.compact_ratio < 0 || settings.compact_ratio > 100) {
+                    fprintf(stderr, "Compaction ratio must be in 0-100\n");
+                    return 1;
+                }
+                break;
+            case 'R':
+                settings.compact_rate = atoll(optarg);
+                break;
+            case 'B':
+                settings.variant_budget = atoll(optarg);
+                break;
+            case 'a':
+                if (strcmp(optarg, "uring") == 0)
+                    settings.aio = AIO_URING;
+                else if (strcmp(optarg, "threads") == 0)
+                    settings.aio = AIO_THREADS;
+                else if (strcmp(optarg, "off") == 0)
+                    settings.aio = AIO_OFF;
+                else {
+                    fprintf(stderr, "Async I/O must be uring, threads or off\n");
+                    return 1;
+                }
+                break;
+            case 'D':
+                settings.durable = atoi(optarg);
+                if (settings.durable < 0) {
+                    fprintf(stderr, "Commit interval must not be less than 0\n");
+                    return 1;
+                }
+                break;
+            case 'F':
+                snprintf(settings.fast_path, sizeof(settings.fast_path), "%s", optarg);
+                break;
+            case 'T':
+                settings.fast_budget = atoll(optarg);
+                if (settings.fast_budget <= 0) {
+                    fprintf(stderr, "Size of the fast tier must be greater than 0\n");
+                    return 1;
+                }
+                break;
+            case 'J':
+                snprintf(settings.disk_paths, sizeof(settings.disk_paths), "%s", optarg);
+                break;
+            case 'P':
+                snprintf(settings.cluster_peers, sizeof(settings.cluster_peers), "%s", optarg);
+                break;
+            case 'S':
+                snprintf(settings.cluster_self, sizeof(settings.cluster_self), "%s", optarg);
+                break;
+            case 'X':
+                if (strcmp(optarg, "proxy") == 0)
+                    settings.cluster_mode = CLUSTER_PROXY;
+                else if (strcmp(optarg, "redirect") == 0)
+                    settings.cluster_mode = CLUSTER_REDIRECT;
+                else {
+                    fprintf(stderr, "Cluster mode must be proxy or redirect\n");
+                    return 1;
+                }
+                break;
+            case 'G':
+                settings.peer_fetch = atoi(optarg);
+                if (settings.peer_fetch < 0) {
+                    fprintf(stderr, "Timeout of peer fetch must not be less than 0\n");
+                    return 1;
+                }
+                break;
+            case 'O':
+                snprintf(settings.origin, sizeof(settings.origin), "%s", optarg);
+                break;
+            case 'A':
+                settings.max_age = atoi(optarg);
+                if (settings.max_age < 0) {
+                    fprintf(stderr, "Max age must not be less than 0\n");
+                    return 1;
+                }
+                break;
+            case 'N':
+                settings.shards = atoi(optarg);
+                if (settings.shards < 0 || settings.shards > SHARD_MAX) {
+                    fprintf(stderr, "Shards must be 0 to %d\n", SHARD_MAX);
+                    return 1;
+                }
+                break;
+            case 'U':
+                snprintf(settings.unix_path, sizeof(settings.unix_path), "%s", optarg);
+                break;
+            case 'W':
+                settings.unix_mode = strtol(optarg, NULL, 8);
+                if (settings.unix_mode <= 0 || settings.unix_mode > 0777) {
+                    fprintf(stderr, "Mode of Unix socket must be octal 1 to 777\n");
+                    return 1;
+                }
+                break;
+            case 'L':
+                settings.render_limit = atoi(optarg);
+                if (settings.render_limit < 0) {
+                    fprintf(stderr, "Render limit must not be less than 0\n");
+                    return 1;
+                }
+                break;
+            case 'Q':
+                settings.render_queue = atoi(optarg);
+                if (settings.render_queue < 0) {
+                    fprintf(stderr, "Render queue must not be less than 0\n");
+                    return 1;
+                }
+                break;
+            case 'E':
+                settings.render_wait = atoi(optarg);
+                if (settings.render_wait < 0) {
+                    fprintf(stderr, "Render wait must not be less than 0\n");
+                    return 1;
+                }
+                break;
             case 'h':
-                printf("Usage: ./zimg -d[aemon] -p port -t thread_num -M memcached_ip -m memcached_port -l[og] -c[ache] -b backlog_num -k max_keepalives -h[elp]\n");
+                printf("Usage: ./zimg -d[aemon] -p port -t thread_num -M memcached_ip -m memcached_port -l[og] -c[ache] -b backlog_num -k max_keepalives -u upload_thread_num -v[olume] -s volume_size_MB -C compact_dead_percent -R compact_rate_MBps -B variant_budget_MB -a uring|threads|off -D durable_commit_ms -F fast_tier_path -T fast_tier_MB -J disk_path,disk_path... -P host:port,host:port... -S self_host:port -X proxy|redirect -G peer_fetch_ms -O origin_url -A max_age_seconds -N shard_num -U unix_socket_path -W unix_socket_mode -L render_limit -Q render_queue -E render_wait_ms -h[elp]\n");
                 exit(1);
             default:
                 fprintf(stderr, "Illegal argument \"%c\"\n", c);
@@ -205,8 +416,71 @@ int main(int argc, char **argv)
             return -1;
         }
     }
+    if(dir_cache_init(settings.img_path) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "img_path[%s] Open Failed!", settings.img_path);
+        return -1;
+    }
+    //stripe images over the disks
+    if(disk_init(settings.disk_paths) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Disks[%s] Init Failed!", settings.disk_paths);
+        return -1;
+    }
     LOG_PRINT(LOG_INFO,"Paths Init Finished.");
 
+    //acknowledge uploads only after they are synced to disk
+    if(commit_init(settings.img_path, settings.durable) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Durable Writes Init Failed!");
+        return -1;
+    }
+
+    //store images in volumes instead of a file for each
+    if(settings.volume_on)
+    {
+        char vol_path[600];
+        snprintf(vol_path, sizeof(vol_path), "%s/%s", settings.img_path, VOLUME_DIR);
+        if(vol_init(vol_path, settings.volume_size * 1024 * 1024) == ZIMG_ERR)
+        {
+            LOG_PRINT(LOG_ERROR, "Volumes[%s] Init Failed!", vol_path);
+            return -1;
+        }
+        if(settings.compact_ratio > 0 && vol_compact_start(settings.compact_ratio, settings.compact_rate * 1024 * 1024) == ZIMG_ERR)
+        {
+            LOG_PRINT(LOG_WARNING, "Volumes Will Not Be Compacted.");
+        }
+    }
+
+
+    //get the missing originals from an origin server, they are cached in the variant budget
+    if(origin_init(settings.origin) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Origin[%s] Init Failed!", settings.origin);
+        return -1;
+    }
+    if(origin_on() && settings.variant_budget == 0)
+        settings.variant_budget = ORIGIN_CACHE_SIZE;
+
+    //remove the least recently used resized images out of the budget
+    if(settings.variant_budget > 0 && variant_init(settings.variant_budget * 1024 * 1024) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_WARNING, "Variants Are Not Limited by the Budget.");
+    }
+
+    //keep copies of hot images on fast media
+    if(settings.fast_path[0] != '\0')
+    {
+        if(is_dir(settings.fast_path) != ZIMG_OK && mk_dir(settings.fast_path) != 1)
+        {
+            LOG_PRINT(LOG_ERROR, "fast_path[%s] Create Failed!", settings.fast_path);
+            return -1;
+        }
+        if(tier_init(settings.fast_path, settings.fast_budget * 1024 * 1024) == ZIMG_ERR)
+        {
+            LOG_PRINT(LOG_WARNING, "Fast Tier is Not Used.");
+        }
+    }
    
     //init memcached connection...
     if(settings.cache_on == true)
@@ -241,29 +515,95 @@ int main(int argc, char **argv)
         LOG_PRINT(LOG_INFO, "Don't use memcached as cache.");
     //init magickwand
     MagickWandGenesis();
+    if(phone_atlas_init() == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_WARNING, "Phone Image Service is Not Available.");
+    }
+
+    //start the threads saving batch uploads
+    if(upload_pool_init(settings.upload_threads) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_WARNING, "Upload Pool Init Failed, Batch Uploads Are Saved Serially.");
+    }
+
+    //render misses by a bounded queue, a burst of them is shed with 503
+    if(settings.render_limit > 0 && render_init(settings.render_limit, settings.render_queue, settings.render_wait) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_WARNING, "Render Queue Init Failed, Images Are Rendered by Workers.");
+    }
+
+    //read and write images without blocking the workers
+    if(aio_init(settings.aio, get_cpu_cores() * 2, disk_count() + 1) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_WARNING, "Async I/O Init Failed, Images Are Read and Written by Workers.");
+    }
+
+    //place images on the nodes of a cluster
+    if(cluster_init(settings.cluster_peers, settings.cluster_self, settings.cluster_mode) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Cluster[%s] Init Failed!", settings.cluster_peers);
+        return -1;
+    }
 
     //begin to start httpd...
     LOG_PRINT(LOG_INFO, "Begin to Start Httpd Server...");
+    if(settings.port <= 0 && settings.unix_path[0] == '\0')
+    {
+        LOG_PRINT(LOG_ERROR, "No Port or Unix Socket to Listen on!");
+        return -1;
+    }
     evbase = event_base_new();
-    evhtp_t  * htp    = evhtp_new(evbase, NULL);
+    evhtp_t  * htp    = NULL;
+    evhtp_t  * unix_htp = NULL;
 
-    evhtp_set_cb(htp, "/dump", dump_request_cb, NULL);
-    evhtp_set_cb(htp, "/upload", post_request_cb, NULL);
-    evhtp_set_cb(htp, "/phone", phone_request_cb, NULL);
-    //evhtp_set_gencb(htp, echo_cb, NULL);
-    //if no other callbacks are matched
-    evhtp_set_gencb(htp, send_document_cb, NULL);
+    //a proxy on this host reaches zimg without TCP, -p 0 for no TCP at all
+    if(settings.unix_path[0] != '\0' && (unix_htp = unix_listen(evbase)) == NULL)
+    {
+        LOG_PRINT(LOG_ERROR, "Unix Socket[%s] Listen Failed!", settings.unix_path);
+        return -1;
+    }
+    //every shard accepts and answers its connections in its own thread
+    if(settings.port > 0 && settings.shards > 0 && shard_start(evbase, settings.shards, settings.port, settings.backlog, htp_setup) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_WARNING, "Shards Start Failed, Use One Listener.");
+        settings.shards = 0;
+    }
+    if(settings.port > 0 && settings.shards == 0)
+    {
+        htp = evhtp_new(evbase, NULL);
+        htp_setup(htp);
 #ifndef EVHTP_DISABLE_EVTHR
-    evhtp_use_threads(htp, NULL, settings.num_threads, NULL);
+        evhtp_use_threads(htp, NULL, settings.num_threads, NULL);
 #endif
-    evhtp_set_max_keepalive_requests(htp, settings.max_keepalives);
-    evhtp_bind_socket(htp, "0.0.0.0", settings.port, settings.backlog);
+        evhtp_bind_socket(htp, "0.0.0.0", settings.port, settings.backlog);
+    }
 
     event_base_loop(evbase, 0);
 
-    evhtp_unbind_socket(htp);
-    evhtp_free(htp);
+    if(htp)
+    {
+        evhtp_unbind_socket(htp);
+        evhtp_free(htp);
+    }
+    if(unix_htp)
+    {
+        evhtp_unbind_socket(unix_htp);
+        evhtp_free(unix_htp);
+        unlink(settings.unix_path);
+    }
+    shard_stop();
     event_base_free(evbase);
+    upload_pool_destroy();
+    render_destroy();
+    origin_destroy();
+    commit_destroy();
+    aio_destroy();
+    variant_destroy();
+    tier_destroy();
+    if(settings.volume_on)
+        vol_close();
+    dir_cache_free();
+    wand_pool_destroy();
     MagickWandTerminus();
 
     LOG_PRINT(LOG_INFO, "\nByebye!\n");
@@ -271,6 +611,107 @@ int main(int argc, char **argv)
 }
 
 
+/**
+ * @brief htp_setup Set the callbacks and options of an evhtp.
+ *
+ * @param htp The evhtp.
+ */
+static void htp_setup(evhtp_t *htp)
+{
+    evhtp_set_cb(htp, "/dump", dump_request_cb, NULL);
+    evhtp_set_cb(htp, "/status", status_request_cb, NULL);
+    //hash uploads while they are received
+    evhtp_callback_t *upload_cb = evhtp_set_cb(htp, "/upload", post_request_cb, NULL);
+    evhtp_set_hook(&upload_cb->hooks, evhtp_hook_on_headers, (evhtp_hook)upload_headers_cb, NULL);
+    evhtp_callback_t *batch_cb = evhtp_set_cb(htp, "/batch", batch_request_cb, NULL);
+    evhtp_set_hook(&batch_cb->hooks, evhtp_hook_on_headers, (evhtp_hook)batch_headers_cb, NULL);
+    evhtp_set_cb(htp, "/phone", phone_request_cb, NULL);
+    //evhtp_set_gencb(htp, echo_cb, NULL);
+    //if no other callbacks are matched
+    evhtp_set_gencb(htp, send_document_cb, NULL);
+    evhtp_set_max_keepalive_requests(htp, settings.max_keepalives);
+}
+
+/**
+ * @brief unix_listen Listen on the Unix socket of settings.unix_path with
+ * the permissions of settings.unix_mode. It has its own evhtp and workers.
+ * The socket is bound in a private directory beside the path, given the
+ * mode and then renamed to the path, so it is never open to others with
+ * the default mode and the umask of the running threads is not touched.
+ *
+ * @param base The event_base of the listener.
+ *
+ * @return The evhtp or NULL for fail.
+ */
+static evhtp_t *unix_listen(evbase_t *base)
+{
+#ifndef NO_SYS_UN
+    char dir[sizeof(settings.unix_path) + 32];
+    char tmp[sizeof(dir) + 8];
+    char addr[sizeof(tmp) + 8];
+    char *p;
+    struct stat st;
+    evhtp_t *htp = NULL;
+
+    //a socket left by the last run is removed, but no other file
+    if(lstat(settings.unix_path, &st) == 0)
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            LOG_PRINT(LOG_ERROR, "Path[%s] is Not a Socket!", settings.unix_path);
+            return NULL;
+        }
+        unlink(settings.unix_path);
+    }
+    //the directory is on the same file system, so the rename is atomic
+    strcpy(dir, settings.unix_path);
+    p = strrchr(dir, '/');
+    if(p == NULL)
+        strcpy(dir, ".zimg_sock.XXXXXX");
+    else
+        strcpy(p + 1, ".zimg_sock.XXXXXX");
+    if(mkdtemp(dir) == NULL)
+    {
+        LOG_PRINT(LOG_ERROR, "Make Directory[%s] Failed: %s", dir, strerror(errno));
+        return NULL;
+    }
+    snprintf(tmp, sizeof(tmp), "%s/sock", dir);
+    snprintf(addr, sizeof(addr), "unix:%s", tmp);
+
+    if(strlen(tmp) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+    {
+        LOG_PRINT(LOG_ERROR, "Path[%s] is Too Long for a Socket!", tmp);
+        goto err;
+    }
+    if((htp = evhtp_new(base, NULL)) == NULL)
+        goto err;
+    htp_setup(htp);
+#ifndef EVHTP_DISABLE_EVTHR
+    evhtp_use_threads(htp, NULL, settings.num_threads, NULL);
+#endif
+    if(evhtp_bind_socket(htp, addr, 0, settings.backlog) != 0)
+        goto err;
+    if(chmod(tmp, settings.unix_mode) == -1 || rename(tmp, settings.unix_path) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "Socket[%s] Set Up Failed: %s", settings.unix_path, strerror(errno));
+        goto err;
+    }
+    rmdir(dir);
+    LOG_PRINT(LOG_INFO, "Listen on Unix Socket[%s], Mode: %03o.", settings.unix_path, settings.unix_mode);
+    return htp;
+
+err:
+    if(htp)
+        evhtp_free(htp);
+    unlink(tmp);
+    rmdir(dir);
+    return NULL;
+#else
+    LOG_PRINT(LOG_ERROR, "Unix Sockets Are Not Supported!");
+    return NULL;
+#endif
+}
+
 /**
  * @brief kill_server Kill threads and exit the event_base_loop.
  */
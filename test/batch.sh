@@ -0,0 +1,8 @@
+#!/bin/bash
+
+# upload many images in one request, the reply is a json array of their status
+curl -F "blob1=@testup.jpeg;type=image/jpeg" \
+    -F "blob2=@new.jpeg;type=image/jpeg" \
+    -F "blob3=@5f189.jpeg;type=image/jpeg" \
+    "http://127.0.0.1:4869/batch"
+echo
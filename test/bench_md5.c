@@ -0,0 +1,79 @@
+/*
+ * Benchmark of the MD5 implementations zimg can be built with: zmd5.c and
+ * the assembly optimized one of OpenSSL (cmake -DUSE_OPENSSL_MD5=ON).
+ * Build and run it in this directory:
+ *
+ *   gcc -O2 -DARCH_IS_BIG_ENDIAN=0 -I.. -o bench_md5 bench_md5.c ../zmd5.c -lcrypto
+ *   ./bench_md5
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <openssl/evp.h>
+#include "zmd5.h"
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizes[] = {100 * 1024, 500 * 1024, 1024 * 1024, 5 * 1024 * 1024, 20 * 1024 * 1024};
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    size_t max = sizes[nsizes - 1];
+    int i, j, n;
+    double t, tz, to;
+
+    unsigned char *buff = (unsigned char *)malloc(max);
+    if(buff == NULL)
+        return 1;
+    for(i = 0; i < max; i++)
+        buff[i] = rand();
+
+    printf("%10s %12s %12s %8s\n", "size", "zmd5 MB/s", "openssl MB/s", "speedup");
+    for(i = 0; i < nsizes; i++)
+    {
+        md5_state_t zctx;
+        md5_byte_t zdigest[16];
+        EVP_MD_CTX *octx = EVP_MD_CTX_new();
+        unsigned char odigest[16];
+
+        /* hash about 200MB for every size */
+        n = 200 * 1024 * 1024 / sizes[i];
+
+        t = now_us();
+        for(j = 0; j < n; j++)
+        {
+            md5_init(&zctx);
+            md5_append(&zctx, buff, sizes[i]);
+            md5_finish(&zctx, zdigest);
+        }
+        tz = now_us() - t;
+
+        t = now_us();
+        for(j = 0; j < n; j++)
+        {
+            EVP_DigestInit_ex(octx, EVP_md5(), NULL);
+            EVP_DigestUpdate(octx, buff, sizes[i]);
+            EVP_DigestFinal_ex(octx, odigest, NULL);
+        }
+        to = now_us() - t;
+        EVP_MD_CTX_free(octx);
+
+        if(memcmp(zdigest, odigest, 16) != 0)
+        {
+            printf("Digests of %lu bytes are different!\n", (unsigned long)sizes[i]);
+            return 1;
+        }
+        printf("%10lu %12.1f %12.1f %7.2fx\n", (unsigned long)sizes[i],
+                (double)sizes[i] * n / tz, (double)sizes[i] * n / to, tz / to);
+    }
+
+    free(buff);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Benchmark of searching the delimiter of multipart bodies: kmp() against
+ * finder_find() which the multipart parser uses. The bodies are forms of
+ * random binary files, read in 16KB chunks as libevent does.
+ * Build and run it in this directory, add -mavx2 to use AVX2:
+ *
+ *   gcc -O2 -fcommon -I.. -o bench_search bench_search.c ../zutil.c ../zlog.c ../zspinlock.c -lpthread
+ *   ./bench_search
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "zutil.h"
+
+#define CHUNK_SIZE (16 * 1024)
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/* build a form with one file of size bytes, return the length of body */
+static size_t make_body(char *body, const char *boundary, size_t size)
+{
+    size_t n = 0, i;
+    n += sprintf(body + n, "--%s\r\n", boundary);
+    n += sprintf(body + n, "Content-Disposition: form-data; name=\"userfile\"; filename=\"t.jpg\"\r\n");
+    n += sprintf(body + n, "Content-Type: image/jpeg\r\n\r\n");
+    for(i = 0; i < size; i++)
+        body[n + i] = rand();
+    n += size;
+    n += sprintf(body + n, "\r\n--%s--\r\n", boundary);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char *boundary = "----WebKitFormBoundaryhIgUVzoG5V655hmr";
+    size_t sizes[] = {10 * 1024, 100 * 1024, 1024 * 1024, 5 * 1024 * 1024};
+    int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    char delim[128];
+    size_t dlen, len, off;
+    int i, j, n;
+    long found;
+    double t, tk, tf;
+    zfinder_t f;
+
+    char *body = (char *)malloc(sizes[nsizes - 1] + 1024);
+    if(body == NULL)
+        return 1;
+    dlen = sprintf(delim, "\r\n--%s", boundary);
+    finder_init(&f, delim, dlen);
+
+    printf("%10s %12s %12s %8s\n", "size", "kmp MB/s", "finder MB/s", "speedup");
+    for(i = 0; i < nsizes; i++)
+    {
+        len = make_body(body, boundary, sizes[i]);
+        /* search about 500MB for every size */
+        n = 500 * 1024 * 1024 / len;
+
+        found = 0;
+        t = now_us();
+        for(j = 0; j < n; j++)
+        {
+            for(off = 0; off < len; off += CHUNK_SIZE)
+            {
+                size_t l = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+                found += kmp(body + off, l, delim, dlen) >= 0;
+            }
+        }
+        tk = now_us() - t;
+
+        t = now_us();
+        for(j = 0; j < n; j++)
+        {
+            for(off = 0; off < len; off += CHUNK_SIZE)
+            {
+                size_t l = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+                found -= finder_find(&f, body + off, l) >= 0;
+            }
+        }
+        tf = now_us() - t;
+
+        if(found != 0)
+            printf("results differ!\n");
+        printf("%10lu %12.1f %12.1f %7.2fx\n", (unsigned long)sizes[i],
+                (double)len * n / tk, (double)len * n / tf, tk / tf);
+    }
+
+    free(body);
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Microbenchmark of the per-thread wand pool.
+ *
+ * It runs the same read/resize/encode work as a zimg request, once with a
+ * new wand per request (NewMagickWand/DestroyMagickWand) and once with the
+ * wands of zwand.c (get_magick_wand/put_magick_wand), and prints the time
+ * of one request. Build and run it in this directory:
+ *
+ *   gcc -O2 -I.. -o bench_wand bench_wand.c ../zwand.c `MagickWand-config --cflags --libs` -lpthread
+ *   ./bench_wand ./5f189.jpeg 1000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <wand/MagickWand.h>
+#include "zwand.h"
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buff = (char *)malloc(*len);
+    if(buff != NULL && fread(buff, 1, *len, fp) != *len)
+    {
+        free(buff);
+        buff = NULL;
+    }
+    fclose(fp);
+    return buff;
+}
+
+/* the work of one zimg request, the same calls as the render path of get_img() */
+static void process(MagickWand *wand, const char *buff, size_t len)
+{
+    size_t size, quality;
+    char *format;
+
+    MagickReadImageBlob(wand, buff, len);
+    MagickResizeImage(wand, 100, 100, LanczosFilter, 1.0);
+    format = MagickGetImageFormat(wand);
+    if(strcmp(format, "JPEG") != 0)
+    {
+        MagickSetImageFormat(wand, "JPEG");
+        MagickSetImageCompression(wand, JPEGCompression);
+    }
+    MagickRelinquishMemory(format);
+    quality = MagickGetImageCompressionQuality(wand) * 0.75;
+    MagickSetImageCompressionQuality(wand, quality == 0 ? 75 : quality);
+    MagickStripImage(wand);
+    MagickRelinquishMemory(MagickGetImageBlob(wand, &size));
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "./5f189.jpeg";
+    int n = argc > 2 ? atoi(argv[2]) : 1000;
+    int i;
+    size_t len;
+    double t;
+
+    char *buff = read_file(path, &len);
+    if(buff == NULL)
+    {
+        printf("Read Image[%s] Failed!\n", path);
+        return 1;
+    }
+
+    MagickWandGenesis();
+
+    /* setup cost only */
+    t = now_us();
+    for(i = 0; i < n * 100; i++)
+    {
+        MagickWand *m = NewMagickWand();
+        PixelWand *p = NewPixelWand();
+        DrawingWand *d = NewDrawingWand();
+        DestroyDrawingWand(d);
+        DestroyPixelWand(p);
+        DestroyMagickWand(m);
+    }
+    printf("new/destroy wands:  %8.3f us/req\n", (now_us() - t) / (n * 100));
+
+    t = now_us();
+    for(i = 0; i < n * 100; i++)
+    {
+        MagickWand *m = get_magick_wand();
+        PixelWand *p = get_pixel_wand();
+        DrawingWand *d = get_drawing_wand();
+        put_drawing_wand(d);
+        put_pixel_wand(p);
+        put_magick_wand(m);
+    }
+    printf("pooled wands:       %8.3f us/req\n", (now_us() - t) / (n * 100));
+
+    /* whole request */
+    t = now_us();
+    for(i = 0; i < n; i++)
+    {
+        MagickWand *m = NewMagickWand();
+        process(m, buff, len);
+        DestroyMagickWand(m);
+    }
+    printf("new wand request:   %8.3f us/req\n", (now_us() - t) / n);
+
+    t = now_us();
+    for(i = 0; i < n; i++)
+    {
+        MagickWand *m = get_magick_wand();
+        process(m, buff, len);
+        put_magick_wand(m);
+    }
+    printf("pooled request:     %8.3f us/req\n", (now_us() - t) / n);
+
+    wand_pool_destroy();
+    MagickWandTerminus();
+    free(buff);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#!/bin/bash
+
+# HEAD of a stored image and of a variant, they are never rendered
+md5=$(md5sum testup.jpeg | cut -c1-32)
+curl -s -I "http://127.0.0.1:4869/$md5"
+curl -s -I "http://127.0.0.1:4869/$md5?w=100&h=100"
@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# serve the test images by their md5 as an origin, start zimg with
+#   ./zimg -O http://127.0.0.1:8000/
+# then get an original and a resized one, both are read through the origin
+dir=$(mktemp -d)
+for f in testup.jpeg new.jpeg 5f189.jpeg; do
+    cp "$f" "$dir/$(md5sum "$f" | cut -c1-32)"
+done
+(cd "$dir" && python3 -m http.server 8000 --bind 127.0.0.1 > /dev/null 2>&1) &
+pid=$!
+sleep 1
+
+md5=$(md5sum testup.jpeg | cut -c1-32)
+curl -s -o /dev/null -w "%{http_code} %{content_type} %{size_download}\n" "http://127.0.0.1:4869/$md5"
+curl -s -o /dev/null -w "%{http_code} %{content_type} %{size_download}\n" "http://127.0.0.1:4869/$md5?w=100&h=100"
+curl -s "http://127.0.0.1:4869/status"
+echo
+
+kill $pid
+rm -rf "$dir"
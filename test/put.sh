@@ -0,0 +1,7 @@
+#!/bin/bash
+
+# upload an image as the raw body, no multipart form is needed
+curl -X PUT -H "Content-Type: application/octet-stream" --data-binary "@testup.jpeg" "http://127.0.0.1:4869/upload"
+echo
+curl -H "Content-Type: application/octet-stream" --data-binary "@testup.jpeg" "http://127.0.0.1:4869/upload"
+echo
@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# get parts of a stored image, one range is a 206 of the bytes and many are
+# a multipart/byteranges body, a range past the end is a 416
+md5=$(md5sum testup.jpeg | cut -c1-32)
+curl -s -D - -o /dev/null -H "Range: bytes=0-99" "http://127.0.0.1:4869/$md5"
+curl -s -D - -H "Range: bytes=0-9,-10" "http://127.0.0.1:4869/$md5" | head -20
+curl -s -D - -o /dev/null -H "Range: bytes=100000000-" "http://127.0.0.1:4869/$md5"
+# resume a download, If-Range keeps it from mixing another version
+etag=$(curl -s -D - -o /dev/null "http://127.0.0.1:4869/$md5" | tr -d '\r' | sed -n 's/^ETag: //p')
+curl -s -o /dev/null -w "%{http_code} %{size_download}\n" -H "Range: bytes=100-" -H "If-Range: $etag" "http://127.0.0.1:4869/$md5"
@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# a burst of misses, each size is a new render; start zimg with a small queue
+#   ./zimg -L 2 -Q 8 -E 500
+# the renders which cannot start in time are answered 503 with Retry-After
+md5=$(md5sum testup.jpeg | cut -c1-32)
+for w in $(seq 100 140); do
+    curl -s -o /dev/null -w "%{http_code}\n" "http://127.0.0.1:4869/$md5?w=$w&h=$w&p=0" &
+done | sort | uniq -c
+wait
+curl -s "http://127.0.0.1:4869/status"
+echo
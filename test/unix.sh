@@ -0,0 +1,7 @@
+#!/bin/bash
+
+# start zimg on a Unix socket for a proxy on the same host, -p 0 for no TCP
+#   ./zimg -U /tmp/zimg.sock -W 660
+# nginx: upstream zimg { server unix:/tmp/zimg.sock; }
+md5=$(md5sum testup.jpeg | cut -c1-32)
+curl -s --unix-socket /tmp/zimg.sock -o /dev/null -w "%{http_code} %{content_type} %{size_download}\n" "http://localhost/$md5"
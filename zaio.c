@@ -0,0 +1,694 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zaio.c
+ * @brief Asynchronous file I/O. Reads and writes are queued to io_uring,
+ * which is used by raw system calls, and completed on a reaper thread. If
+ * io_uring is not supported, they are done by a thread pool. Either way the
+ * callback of an I/O runs on an I/O thread, and aio_loop_post() brings the
+ * result back to the thread of an event_base. Every disk has its own queue,
+ * a pool of threads or an io_uring with its own reaper, so the I/Os waiting
+ * for a slow disk do not hold the others.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#ifndef NO_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include <event2/event.h>
+#include "zaio.h"
+#include "zthread.h"
+#include "zutil.h"
+#include "zlog.h"
+
+typedef struct aio_job_s {
+    aio_op_t op;
+    size_t done;
+    struct iovec iov;
+} aio_job_t;
+
+#ifndef NO_IO_URING
+typedef struct uring_s {
+    int fd;
+    unsigned entries;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t sq_lock;
+    pthread_cond_t sq_cond;
+    unsigned inflight;                  /* jobs pushed and not reaped */
+    bool stop;
+    pthread_t reaper;
+} uring_t;
+#endif
+
+typedef struct loop_item_s {
+    aio_loop_cb cb;
+    void *arg;
+    struct loop_item_s *next;
+} loop_item_t;
+
+struct aio_loop_s {
+    int fds[2];
+    struct event *ev;
+    pthread_mutex_t lock;
+    loop_item_t *head;
+    loop_item_t *tail;
+};
+
+static int aio_mode = AIO_OFF;
+static int nqueues = 1;
+static thread_pool_t *pools[AIO_QUEUE_MAX];
+static uint64_t q_inflight[AIO_QUEUE_MAX];
+#ifndef NO_IO_URING
+static uring_t rings[AIO_QUEUE_MAX];
+#endif
+static __thread aio_loop_t *thread_loop = NULL;
+
+static uint64_t submitted = 0;
+static uint64_t completed = 0;
+static uint64_t failed = 0;
+static uint64_t batches = 0;
+
+static void job_finish(aio_job_t *job, int ret);
+static void job_result(aio_job_t *job, int res, bool *again);
+static void pool_job(void *arg);
+#ifndef NO_IO_URING
+static int uring_setup(uring_t *ring);
+static void uring_free(uring_t *ring);
+static void uring_push(uring_t *ring, aio_job_t **jobs, int n, bool counted);
+static void uring_stop(uring_t *ring);
+static void *reaper(void *arg);
+#endif
+static void loop_read_cb(evutil_socket_t fd, short what, void *arg);
+
+
+static void job_finish(aio_job_t *job, int ret)
+{
+    __sync_fetch_and_sub(&q_inflight[job->op.queue], 1);
+    __sync_fetch_and_add(&completed, 1);
+    if(ret == ZIMG_ERR)
+        __sync_fetch_and_add(&failed, 1);
+    job->op.cb(ret, job->op.arg);
+    free(job);
+}
+
+/**
+ * @brief job_result Account the result of a read or write.
+ *
+ * @param job The job.
+ * @param res Bytes done, or -errno.
+ * @param again It gets true if the rest of the job must be submitted again.
+ */
+static void job_result(aio_job_t *job, int res, bool *again)
+{
+    *again = false;
+    if(res == -EINTR || res == -EAGAIN)
+    {
+        *again = true;
+        return;
+    }
+    if(res <= 0)
+    {
+        LOG_PRINT(LOG_ERROR, "Async %s of fd[%d] Failed: %s.", job->op.type == AIO_READ ? "Read" : "Write",
+                job->op.fd, res < 0 ? strerror(-res) : "end of file");
+        job_finish(job, ZIMG_ERR);
+        return;
+    }
+    job->done += res;
+    if(job->done < job->op.len)
+        *again = true;
+    else
+        job_finish(job, ZIMG_OK);
+}
+
+static void pool_job(void *arg)
+{
+    aio_job_t *job = (aio_job_t *)arg;
+    int ret;
+
+    if(job->op.type == AIO_READ)
+        ret = pread_all(job->op.fd, job->op.buf, job->op.len, job->op.off);
+    else
+        ret = pwrite_all(job->op.fd, job->op.buf, job->op.len, job->op.off);
+    job_finish(job, ret);
+}
+
+#ifndef NO_IO_URING
+/**
+ * @brief uring_setup Create the io_uring of a queue and map its rings.
+ *
+ * @param ring The io_uring.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not supported.
+ */
+static int uring_setup(uring_t *ring)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    pthread_mutex_init(&ring->sq_lock, NULL);
+    pthread_cond_init(&ring->sq_cond, NULL);
+    ring->fd = syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &p);
+    if(ring->fd < 0)
+        goto err;
+    ring->entries = p.sq_entries;
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED)
+        goto err;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED)
+            goto err;
+    }
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        goto err;
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return ZIMG_OK;
+
+err:
+    if(ring->sq_ptr == MAP_FAILED)
+        ring->sq_ptr = NULL;
+    if(ring->cq_ptr == MAP_FAILED)
+        ring->cq_ptr = NULL;
+    if(ring->sqes == MAP_FAILED)
+        ring->sqes = NULL;
+    uring_free(ring);
+    return ZIMG_ERR;
+}
+
+static void uring_free(uring_t *ring)
+{
+    if(ring->sqes)
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if(ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if(ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if(ring->fd >= 0)
+        close(ring->fd);
+    pthread_mutex_destroy(&ring->sq_lock);
+    pthread_cond_destroy(&ring->sq_cond);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * @brief uring_push Queue jobs of one disk to its io_uring by one system
+ * call. It waits while AIO_QUEUE_DEPTH jobs are in flight, so the completion
+ * ring never overflows.
+ *
+ * @param ring The io_uring of the queue of the jobs.
+ * @param jobs The jobs, a NULL job stops the reaper.
+ * @param n The number of jobs, not more than ring->entries.
+ * @param counted The jobs are in flight already, such as the rest of a short
+ * read.
+ */
+static void uring_push(uring_t *ring, aio_job_t **jobs, int n, bool counted)
+{
+    struct io_uring_sqe *sqe;
+    aio_job_t *job;
+    unsigned tail, idx;
+    int i, ret, left = n;
+
+    pthread_mutex_lock(&ring->sq_lock);
+    if(!counted)
+    {
+        while(ring->inflight + n > ring->entries)
+            pthread_cond_wait(&ring->sq_cond, &ring->sq_lock);
+        ring->inflight += n;
+        for(i = 0; i < n; i++)
+        {
+            if(jobs[i] != NULL)
+                __sync_fetch_and_add(&q_inflight[jobs[i]->op.queue], 1);
+        }
+    }
+
+    tail = *ring->sq_tail;
+    for(i = 0; i < n; i++)
+    {
+        job = jobs[i];
+        idx = tail & *ring->sq_mask;
+        sqe = &ring->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        if(job == NULL)
+        {
+            sqe->opcode = IORING_OP_NOP;
+        }
+        else
+        {
+            job->iov.iov_base = job->op.buf + job->done;
+            job->iov.iov_len = job->op.len - job->done;
+            sqe->opcode = job->op.type == AIO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->fd = job->op.fd;
+            sqe->addr = (uint64_t)(uintptr_t)&job->iov;
+            sqe->len = 1;
+            sqe->off = job->op.off + job->done;
+        }
+        sqe->user_data = (uint64_t)(uintptr_t)job;
+        ring->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while(left > 0)
+    {
+        ret = syscall(__NR_io_uring_enter, ring->fd, left, 0, 0, NULL, 0);
+        if(ret > 0)
+            left -= ret;
+        else if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            LOG_PRINT(LOG_ERROR, "io_uring_enter() Failed: %s.", strerror(errno));
+            break;
+        }
+        else
+            sched_yield();
+    }
+    pthread_mutex_unlock(&ring->sq_lock);
+}
+
+/**
+ * @brief uring_stop Wait for the jobs in flight, then stop the reaper and
+ * free the io_uring.
+ *
+ * @param ring The io_uring.
+ */
+static void uring_stop(uring_t *ring)
+{
+    aio_job_t *stop = NULL;
+
+    pthread_mutex_lock(&ring->sq_lock);
+    while(ring->inflight > 0)
+        pthread_cond_wait(&ring->sq_cond, &ring->sq_lock);
+    ring->stop = true;
+    pthread_mutex_unlock(&ring->sq_lock);
+    uring_push(ring, &stop, 1, true);
+    pthread_join(ring->reaper, NULL);
+    uring_free(ring);
+}
+
+static void *reaper(void *arg)
+{
+    uring_t *ring = (uring_t *)arg;
+    struct io_uring_cqe *cqe;
+    aio_job_t *job;
+    unsigned head;
+    bool again;
+    int res;
+
+    while(1)
+    {
+        head = *ring->cq_head;
+        if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        job = (aio_job_t *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if(job == NULL)
+        {
+            if(ring->stop)
+                break;
+            continue;
+        }
+        job_result(job, res, &again);
+        if(again)
+        {
+            uring_push(ring, &job, 1, true);
+            continue;
+        }
+        pthread_mutex_lock(&ring->sq_lock);
+        ring->inflight--;
+        pthread_cond_broadcast(&ring->sq_cond);
+        pthread_mutex_unlock(&ring->sq_lock);
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * @brief aio_init Start the backend of asynchronous I/O.
+ *
+ * @param backend AIO_URING, or AIO_THREADS to use the thread pool only.
+ * @param num_threads The number of threads of the pool of a queue.
+ * @param num_queues The number of queues, one for each disk.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int aio_init(int backend, int num_threads, int num_queues)
+{
+    int q;
+
+    if(backend == AIO_OFF)
+        return ZIMG_OK;
+    nqueues = num_queues < 1 ? 1 : (num_queues > AIO_QUEUE_MAX ? AIO_QUEUE_MAX : num_queues);
+#ifndef NO_IO_URING
+    if(backend == AIO_URING)
+    {
+        //every queue has its own io_uring and reaper, a read stuck on a slow
+        //disk only holds the ring of that disk
+        for(q = 0; q < nqueues; q++)
+        {
+            if(uring_setup(&rings[q]) == ZIMG_ERR)
+                break;
+            if(pthread_create(&rings[q].reaper, NULL, reaper, &rings[q]) != 0)
+            {
+                uring_free(&rings[q]);
+                break;
+            }
+        }
+        if(q == nqueues)
+        {
+            aio_mode = AIO_URING;
+            LOG_PRINT(LOG_INFO, "Async I/O by io_uring, entries: %u queues: %d.", rings[0].entries, nqueues);
+            return ZIMG_OK;
+        }
+        while(q-- > 0)
+            uring_stop(&rings[q]);
+        LOG_PRINT(LOG_WARNING, "io_uring Not Supported, Use Threads for Async I/O.");
+    }
+#endif
+    for(q = 0; q < nqueues; q++)
+    {
+        if((pools[q] = thread_pool_new(num_threads)) == NULL)
+        {
+            while(q-- > 0)
+            {
+                thread_pool_free(pools[q]);
+                pools[q] = NULL;
+            }
+            return ZIMG_ERR;
+        }
+    }
+    aio_mode = AIO_THREADS;
+    LOG_PRINT(LOG_INFO, "Async I/O by %d Threads of %d Queues.", num_threads, nqueues);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief aio_destroy Wait for the I/Os in flight and stop the backend.
+ */
+void aio_destroy(void)
+{
+#ifndef NO_IO_URING
+    if(aio_mode == AIO_URING)
+    {
+        int q;
+        for(q = 0; q < nqueues; q++)
+            uring_stop(&rings[q]);
+    }
+#endif
+    if(aio_mode == AIO_THREADS)
+    {
+        int q;
+        for(q = 0; q < nqueues; q++)
+        {
+            thread_pool_free(pools[q]);
+            pools[q] = NULL;
+        }
+    }
+    aio_mode = AIO_OFF;
+}
+
+/**
+ * @brief aio_backend Get the backend in use, AIO_OFF if not started.
+ */
+int aio_backend(void)
+{
+    return aio_mode;
+}
+
+const char *aio_backend_name(int backend)
+{
+    if(backend == AIO_URING)
+        return "uring";
+    if(backend == AIO_THREADS)
+        return "threads";
+    return "off";
+}
+
+/**
+ * @brief aio_submit Submit a batch of reads and writes. On io_uring the
+ * batch is queued by one system call. Every callback is called once, on
+ * io_uring by the reaper thread, so a callback must not submit I/O itself.
+ *
+ * @param ops The I/Os, they are copied.
+ * @param n The number of I/Os.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail, then no callback is
+ * called.
+ */
+int aio_submit(const aio_op_t *ops, int n)
+{
+    aio_job_t **jobs;
+    int i, j, m, q;
+
+    if(aio_mode == AIO_OFF || n <= 0)
+        return ZIMG_ERR;
+    if((jobs = (aio_job_t **)malloc(n * sizeof(aio_job_t *))) == NULL)
+        return ZIMG_ERR;
+    for(i = 0; i < n; i++)
+    {
+        if((jobs[i] = (aio_job_t *)calloc(1, sizeof(aio_job_t))) == NULL)
+        {
+            while(i-- > 0)
+                free(jobs[i]);
+            free(jobs);
+            return ZIMG_ERR;
+        }
+        jobs[i]->op = ops[i];
+        if(jobs[i]->op.queue < 0 || jobs[i]->op.queue >= nqueues)
+            jobs[i]->op.queue = 0;
+    }
+
+    __sync_fetch_and_add(&submitted, n);
+#ifndef NO_IO_URING
+    if(aio_mode == AIO_URING)
+    {
+        aio_job_t *tmp;
+
+        //the jobs of a disk are moved together and go to its io_uring
+        for(q = 0, i = 0; q < nqueues && i < n; q++)
+        {
+            for(j = m = i; j < n; j++)
+            {
+                if(jobs[j]->op.queue != q)
+                    continue;
+                tmp = jobs[m];
+                jobs[m++] = jobs[j];
+                jobs[j] = tmp;
+            }
+            for(; i < m; i += j)
+            {
+                j = m - i > AIO_QUEUE_DEPTH ? AIO_QUEUE_DEPTH : m - i;
+                __sync_fetch_and_add(&batches, 1);
+                uring_push(&rings[q], jobs + i, j, false);
+            }
+        }
+        free(jobs);
+        return ZIMG_OK;
+    }
+#endif
+    for(i = 0; i < n; i += m)
+    {
+        m = n - i;
+        __sync_fetch_and_add(&batches, 1);
+        for(j = i; j < i + m; j++)
+        {
+            __sync_fetch_and_add(&q_inflight[jobs[j]->op.queue], 1);
+            if(thread_pool_add(pools[jobs[j]->op.queue], pool_job, jobs[j]) == ZIMG_ERR)
+                pool_job(jobs[j]);
+        }
+    }
+    free(jobs);
+    return ZIMG_OK;
+}
+
+int aio_pread(int fd, char *buf, size_t len, off_t off, aio_cb cb, void *arg)
+{
+    aio_op_t op = { AIO_READ, fd, buf, len, off, cb, arg, 0 };
+    return aio_submit(&op, 1);
+}
+
+int aio_pwrite(int fd, char *buf, size_t len, off_t off, aio_cb cb, void *arg)
+{
+    aio_op_t op = { AIO_WRITE, fd, buf, len, off, cb, arg, 0 };
+    return aio_submit(&op, 1);
+}
+
+void aio_stats(aio_stats_t *st)
+{
+    st->backend = aio_mode;
+    st->submitted = __sync_fetch_and_add(&submitted, 0);
+    st->completed = __sync_fetch_and_add(&completed, 0);
+    st->failed = __sync_fetch_and_add(&failed, 0);
+    st->batches = __sync_fetch_and_add(&batches, 0);
+    st->inflight = st->submitted - st->completed;
+    st->queues = aio_mode == AIO_OFF ? 0 : nqueues;
+}
+
+/**
+ * @brief aio_queue_inflight Get the I/Os of a queue which are not done.
+ *
+ * @param queue The queue.
+ *
+ * @return The number of I/Os.
+ */
+uint64_t aio_queue_inflight(int queue)
+{
+    if(queue < 0 || queue >= AIO_QUEUE_MAX)
+        return 0;
+    return __sync_fetch_and_add(&q_inflight[queue], 0);
+}
+
+static void loop_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+    aio_loop_t *loop = (aio_loop_t *)arg;
+    loop_item_t *item, *next;
+    char buf[64];
+
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+    pthread_mutex_lock(&loop->lock);
+    item = loop->head;
+    loop->head = loop->tail = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    for(; item != NULL; item = next)
+    {
+        next = item->next;
+        item->cb(item->arg);
+        free(item);
+    }
+}
+
+/**
+ * @brief aio_loop_get Get the loop of the calling thread, it is made at the
+ * first call. It must be called in the thread running the event_base.
+ *
+ * @param base The event_base of the thread.
+ *
+ * @return The loop or NULL for fail.
+ */
+aio_loop_t *aio_loop_get(struct event_base *base)
+{
+    aio_loop_t *loop;
+
+    if(thread_loop != NULL)
+        return thread_loop;
+    if((loop = (aio_loop_t *)calloc(1, sizeof(aio_loop_t))) == NULL)
+        return NULL;
+    if(pipe(loop->fds) == -1)
+    {
+        free(loop);
+        return NULL;
+    }
+    fcntl(loop->fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(loop->fds[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&loop->lock, NULL);
+    loop->ev = event_new(base, loop->fds[0], EV_READ | EV_PERSIST, loop_read_cb, loop);
+    if(loop->ev == NULL || event_add(loop->ev, NULL) == -1)
+    {
+        if(loop->ev)
+            event_free(loop->ev);
+        close(loop->fds[0]);
+        close(loop->fds[1]);
+        free(loop);
+        return NULL;
+    }
+    thread_loop = loop;
+    return loop;
+}
+
+/**
+ * @brief aio_loop_post Run a function in the thread of a loop, it can be
+ * called in any thread.
+ *
+ * @param loop The loop.
+ * @param cb The function.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int aio_loop_post(aio_loop_t *loop, aio_loop_cb cb, void *arg)
+{
+    loop_item_t *item = (loop_item_t *)malloc(sizeof(loop_item_t));
+    bool wake;
+
+    if(item == NULL)
+        return ZIMG_ERR;
+    item->cb = cb;
+    item->arg = arg;
+    item->next = NULL;
+
+    pthread_mutex_lock(&loop->lock);
+    wake = loop->head == NULL;
+    if(loop->tail)
+        loop->tail->next = item;
+    else
+        loop->head = item;
+    loop->tail = item;
+    pthread_mutex_unlock(&loop->lock);
+
+    if(wake && write(loop->fds[1], "", 1) == -1 && errno != EAGAIN)
+        LOG_PRINT(LOG_ERROR, "Loop Wake Failed!");
+    return ZIMG_OK;
+}
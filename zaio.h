@@ -0,0 +1,82 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zaio.h
+ * @brief Asynchronous file I/O by io_uring or a thread pool header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZAIO_H
+#define ZAIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "zcommon.h"
+
+struct event_base;
+
+#define AIO_OFF 0                       /* blocking I/O on the worker threads */
+#define AIO_URING 1
+#define AIO_THREADS 2
+
+#define AIO_QUEUE_DEPTH 256             /* I/Os in flight at most of a queue */
+#define AIO_QUEUE_MAX 16                /* queues of disks */
+
+#define AIO_READ 0
+#define AIO_WRITE 1
+
+/* called on an I/O thread when an I/O is done, ret is ZIMG_OK or ZIMG_ERR */
+typedef void (*aio_cb)(int ret, void *arg);
+
+typedef struct aio_op_s {
+    int type;                           /* AIO_READ or AIO_WRITE */
+    int fd;
+    char *buf;
+    size_t len;
+    off_t off;
+    aio_cb cb;
+    void *arg;
+    int queue;                          /* the queue of its disk, 0 by default */
+} aio_op_t;
+
+typedef struct aio_stats_s {
+    int backend;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t batches;
+    uint64_t inflight;
+    int queues;
+} aio_stats_t;
+
+/* runs a function in the thread of an event_base */
+typedef struct aio_loop_s aio_loop_t;
+typedef void (*aio_loop_cb)(void *arg);
+
+int aio_init(int backend, int num_threads, int num_queues);
+void aio_destroy(void);
+int aio_backend(void);
+const char *aio_backend_name(int backend);
+int aio_submit(const aio_op_t *ops, int n);
+int aio_pread(int fd, char *buf, size_t len, off_t off, aio_cb cb, void *arg);
+int aio_pwrite(int fd, char *buf, size_t len, off_t off, aio_cb cb, void *arg);
+void aio_stats(aio_stats_t *st);
+uint64_t aio_queue_inflight(int queue);
+aio_loop_t *aio_loop_get(struct event_base *base);
+int aio_loop_post(aio_loop_t *loop, aio_loop_cb cb, void *arg);
+
+#endif
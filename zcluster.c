@@ -0,0 +1,425 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zcluster.c
+ * @brief Placement of images on the nodes of a cluster. Every node has
+ * CLUSTER_VNODES points on a consistent hash ring hashed from its host:port,
+ * and the md5 of an image picks the node owning it, so all nodes agree on
+ * the owner with the same list of nodes. A request for an image owned by
+ * another node is sent on to it by libevent's HTTP client, or redirected.
+ * A rendered variant is held by the node its md5 and name pick on the same
+ * ring, the others ask it before rendering the variant again.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zcluster.h"
+#include "zlog.h"
+
+typedef struct cluster_point_s {
+    uint32_t hash;
+    int peer;
+} cluster_point_t;
+
+/* a request sent to a node */
+typedef struct cluster_req_s {
+    struct evhttp_request *req;
+    struct event *timer;
+    cluster_cb cb;
+    void *arg;
+    bool sending;               /* evhttp_make_request() is not returned yet */
+    bool failed;                /* failed while sending */
+} cluster_req_t;
+
+static cluster_peer_t peers[CLUSTER_MAX];
+static int npeers = 0;
+static int self = -1;
+static int mode = CLUSTER_PROXY;
+static cluster_point_t points[CLUSTER_MAX * CLUSTER_VNODES];
+static int npoints = 0;
+static uint64_t nrequests = 0;
+static uint64_t nredirected = 0;
+static uint64_t nfailed = 0;
+static uint64_t nfetch_hits = 0;
+static uint64_t nfetch_misses = 0;
+/* the connections of a worker to the nodes, they live as long as it */
+static __thread struct evhttp_connection **thread_conns = NULL;
+static __thread unsigned thread_next = 0;
+
+static uint32_t fnv_hash(const char *str);
+static int point_cmp(const void *a, const void *b);
+static int point_of_hash(uint32_t h);
+static int point_of(const char *md5);
+static struct evhttp_connection *peer_conn(struct event_base *base, int peer);
+static void cluster_req_free(cluster_req_t *cr);
+static void response_cb(struct evhttp_request *req, void *arg);
+static void timeout_cb(evutil_socket_t fd, short what, void *arg);
+
+
+/* FNV-1a, mixed at the end so the points of similar keys spread */
+static uint32_t fnv_hash(const char *str)
+{
+    uint32_t h = 2166136261u;
+    while(*str)
+    {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+    const cluster_point_t *pa = (const cluster_point_t *)a;
+    const cluster_point_t *pb = (const cluster_point_t *)b;
+    if(pa->hash != pb->hash)
+        return pa->hash < pb->hash ? -1 : 1;
+    return pa->peer - pb->peer;
+}
+
+/**
+ * @brief point_of_hash Find the first point of the ring at or after a hash.
+ *
+ * @param h The hash.
+ *
+ * @return The index of the point.
+ */
+static int point_of_hash(uint32_t h)
+{
+    int lo = 0, hi = npoints;
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == npoints ? 0 : lo;
+}
+
+/**
+ * @brief point_of Find the first point of the ring at or after a md5.
+ *
+ * @param md5 The md5, its first 8 hex digits are its place on the ring.
+ *
+ * @return The index of the point.
+ */
+static int point_of(const char *md5)
+{
+    char head[9];
+
+    snprintf(head, sizeof(head), "%s", md5);
+    return point_of_hash((uint32_t)strtoul(head, NULL, 16));
+}
+
+/**
+ * @brief cluster_init Set the nodes of the cluster.
+ *
+ * @param list The host:port of every node separated by commas, empty for no
+ * cluster. All nodes must have the same list.
+ * @param me The host:port of this node in the list. A node not in the list
+ * owns nothing and sends every request on.
+ * @param how CLUSTER_PROXY or CLUSTER_REDIRECT.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int cluster_init(const char *list, const char *me, int how)
+{
+    char buf[CLUSTER_MAX * 160];
+    char key[200];
+    char *p, *port, *save = NULL;
+    int i;
+
+    npeers = npoints = 0;
+    self = -1;
+    mode = how;
+    snprintf(buf, sizeof(buf), "%s", list);
+    for(p = strtok_r(buf, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save))
+    {
+        if(*p == '\0')
+            continue;
+        if(npeers >= CLUSTER_MAX)
+        {
+            LOG_PRINT(LOG_ERROR, "Too Many Nodes, %d at most!", CLUSTER_MAX);
+            return ZIMG_ERR;
+        }
+        if((port = strrchr(p, ':')) == NULL || atoi(port + 1) <= 0 || port - p >= (int)sizeof(peers[0].host))
+        {
+            LOG_PRINT(LOG_ERROR, "Node[%s] is Not host:port!", p);
+            return ZIMG_ERR;
+        }
+        snprintf(peers[npeers].host, sizeof(peers[npeers].host), "%.*s", (int)(port - p), p);
+        peers[npeers].port = atoi(port + 1);
+        snprintf(peers[npeers].name, sizeof(peers[npeers].name), "%s:%d", peers[npeers].host, peers[npeers].port);
+        if(me != NULL && strcmp(peers[npeers].name, me) == 0)
+            self = npeers;
+        for(i = 0; i < CLUSTER_VNODES; i++)
+        {
+            snprintf(key, sizeof(key), "%s#%d", peers[npeers].name, i);
+            points[npoints].hash = fnv_hash(key);
+            points[npoints].peer = npeers;
+            npoints++;
+        }
+        npeers++;
+    }
+    qsort(points, npoints, sizeof(cluster_point_t), point_cmp);
+    if(npeers > 0)
+    {
+        if(self == -1)
+            LOG_PRINT(LOG_WARNING, "Node[%s] is Not in the Cluster, It Owns No Image.", me ? me : "");
+        LOG_PRINT(LOG_INFO, "Cluster of %d Nodes, Requests Are %s.", npeers, mode == CLUSTER_REDIRECT ? "Redirected" : "Proxied");
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief cluster_on Check images are placed on the nodes of a cluster.
+ */
+bool cluster_on(void)
+{
+    return npeers > 0;
+}
+
+int cluster_mode(void)
+{
+    return mode;
+}
+
+/**
+ * @brief cluster_owner Get the node owning an image.
+ *
+ * @param md5 The md5 of the image.
+ *
+ * @return The index of the node, -1 for this node or no cluster.
+ */
+int cluster_owner(const char *md5)
+{
+    int owner;
+
+    if(npeers == 0)
+        return -1;
+    owner = points[point_of(md5)].peer;
+    return owner == self ? -1 : owner;
+}
+
+/**
+ * @brief cluster_holder Get the node holding a rendered variant, the
+ * variants of an image are spread over the nodes.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the variant, such as 100*100p.
+ *
+ * @return The index of the node, -1 for this node or no cluster.
+ */
+int cluster_holder(const char *md5, const char *name)
+{
+    char key[200];
+    int holder;
+
+    if(npeers == 0)
+        return -1;
+    snprintf(key, sizeof(key), "%s/%s", md5, name);
+    holder = points[point_of_hash(fnv_hash(key))].peer;
+    return holder == self ? -1 : holder;
+}
+
+/**
+ * @brief cluster_fetched Count a variant asked from its holder.
+ *
+ * @param hit The holder sent it.
+ */
+void cluster_fetched(bool hit)
+{
+    __sync_fetch_and_add(hit ? &nfetch_hits : &nfetch_misses, 1);
+}
+
+const cluster_peer_t *cluster_peer(int i)
+{
+    return i >= 0 && i < npeers ? &peers[i] : NULL;
+}
+
+/**
+ * @brief cluster_location Get the URL of a request on another node.
+ *
+ * @param peer The node.
+ * @param uri The path and query of the request.
+ * @param buf It gets the URL.
+ * @param size The size of buf.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int cluster_location(int peer, const char *uri, char *buf, size_t size)
+{
+    if(peer < 0 || peer >= npeers || snprintf(buf, size, "http://%s%s", peers[peer].name, uri) >= (int)size)
+        return ZIMG_ERR;
+    __sync_fetch_and_add(&nredirected, 1);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief peer_conn Get a connection of the calling worker to a node, they are
+ * made at the first call and taken in turn. A closed connection is opened
+ * again by libevent when it is used.
+ *
+ * @param base The event_base of the worker.
+ * @param peer The node.
+ *
+ * @return The connection or NULL for fail.
+ */
+static struct evhttp_connection *peer_conn(struct event_base *base, int peer)
+{
+    struct evhttp_connection **conn;
+
+    if(thread_conns == NULL
+            && (thread_conns = (struct evhttp_connection **)calloc(npeers * CLUSTER_CONNS, sizeof(*thread_conns))) == NULL)
+        return NULL;
+    conn = &thread_conns[peer * CLUSTER_CONNS + thread_next++ % CLUSTER_CONNS];
+    if(*conn == NULL)
+    {
+        if((*conn = evhttp_connection_base_new(base, NULL, peers[peer].host, peers[peer].port)) == NULL)
+            return NULL;
+        evhttp_connection_set_timeout(*conn, CLUSTER_TIMEOUT);
+    }
+    return *conn;
+}
+
+static void cluster_req_free(cluster_req_t *cr)
+{
+    if(cr->timer)
+        event_free(cr->timer);
+    free(cr);
+}
+
+static void response_cb(struct evhttp_request *req, void *arg)
+{
+    cluster_req_t *cr = (cluster_req_t *)arg;
+    int status = req ? evhttp_request_get_response_code(req) : 0;
+
+    if(cr->sending)
+    {
+        //it failed at once, cluster_request() returns the error
+        cr->failed = true;
+        return;
+    }
+    if(status == 0)
+        __sync_fetch_and_add(&nfailed, 1);
+    cr->cb(status, status ? evhttp_request_get_input_headers(req) : NULL,
+            status ? evhttp_request_get_input_buffer(req) : NULL, cr->arg);
+    cluster_req_free(cr);
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *arg)
+{
+    cluster_req_t *cr = (cluster_req_t *)arg;
+
+    //the request is freed by libevent and response_cb() is not called
+    evhttp_cancel_request(cr->req);
+    __sync_fetch_and_add(&nfailed, 1);
+    cr->cb(0, NULL, NULL, cr->arg);
+    cluster_req_free(cr);
+}
+
+/**
+ * @brief cluster_request Send a request to another node, it must be called
+ * in the thread running the event_base.
+ *
+ * @param base The event_base of the thread, cb is called in it.
+ * @param peer The node.
+ * @param method The method of the request.
+ * @param uri The path and query of the request.
+ * @param body The body, it is drained, NULL for none.
+ * @param type The Content-Type of body.
+ * @param timeout The ms to wait for the reply, 0 for CLUSTER_TIMEOUT.
+ * @param cb It gets the reply.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for sent and ZIMG_ERR for fail, then cb is not called.
+ */
+int cluster_request(struct event_base *base, int peer, enum evhttp_cmd_type method, const char *uri,
+        struct evbuffer *body, const char *type, int timeout, cluster_cb cb, void *arg)
+{
+    struct evhttp_connection *conn;
+    struct evkeyvalq *out;
+    cluster_req_t *cr;
+    struct timeval tv;
+    int ret;
+
+    if(peer < 0 || peer >= npeers || (conn = peer_conn(base, peer)) == NULL)
+        return ZIMG_ERR;
+    if((cr = (cluster_req_t *)calloc(1, sizeof(cluster_req_t))) == NULL)
+        return ZIMG_ERR;
+    cr->cb = cb;
+    cr->arg = arg;
+    if((cr->req = evhttp_request_new(response_cb, cr)) == NULL)
+    {
+        free(cr);
+        return ZIMG_ERR;
+    }
+    out = evhttp_request_get_output_headers(cr->req);
+    evhttp_add_header(out, "Host", peers[peer].name);
+    evhttp_add_header(out, CLUSTER_HEADER, self == -1 ? "router" : peers[self].name);
+    if(body != NULL)
+    {
+        if(type != NULL)
+            evhttp_add_header(out, "Content-Type", type);
+        evbuffer_add_buffer(evhttp_request_get_output_buffer(cr->req), body);
+    }
+    if(timeout > 0)
+    {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        if((cr->timer = evtimer_new(base, timeout_cb, cr)) == NULL || evtimer_add(cr->timer, &tv) == -1)
+        {
+            evhttp_request_free(cr->req);
+            cluster_req_free(cr);
+            return ZIMG_ERR;
+        }
+    }
+
+    cr->sending = true;
+    ret = evhttp_make_request(conn, cr->req, method, uri);
+    cr->sending = false;
+    if(ret == -1 || cr->failed)
+    {
+        LOG_PRINT(LOG_ERROR, "Request to Node[%s] Failed!", peers[peer].name);
+        __sync_fetch_and_add(&nfailed, 1);
+        cluster_req_free(cr);
+        return ZIMG_ERR;
+    }
+    __sync_fetch_and_add(&nrequests, 1);
+    return ZIMG_OK;
+}
+
+void cluster_stats(cluster_stats_t *st)
+{
+    st->peers = npeers;
+    st->self = self;
+    st->mode = mode;
+    st->requests = __sync_fetch_and_add(&nrequests, 0);
+    st->redirected = __sync_fetch_and_add(&nredirected, 0);
+    st->failed = __sync_fetch_and_add(&nfailed, 0);
+    st->fetch_hits = __sync_fetch_and_add(&nfetch_hits, 0);
+    st->fetch_misses = __sync_fetch_and_add(&nfetch_misses, 0);
+}
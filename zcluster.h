@@ -0,0 +1,74 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zcluster.h
+ * @brief Placement of images on the nodes of a cluster header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZCLUSTER_H
+#define ZCLUSTER_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include "zcommon.h"
+
+#define CLUSTER_MAX 64                  /* nodes of a cluster */
+#define CLUSTER_VNODES 160              /* points of a node on the hash ring */
+#define CLUSTER_CONNS 4                 /* connections of a worker to a node */
+#define CLUSTER_TIMEOUT 10              /* seconds to wait for a node at most */
+#define CLUSTER_HEADER "X-Zimg-Peer"    /* a request sent by a node, it is never sent on */
+
+#define CLUSTER_PROXY 0                 /* send a request on to the owner */
+#define CLUSTER_REDIRECT 1              /* tell the client where the owner is */
+
+typedef struct cluster_peer_s {
+    char host[128];
+    int port;
+    char name[160];                     /* host:port */
+} cluster_peer_t;
+
+typedef struct cluster_stats_s {
+    int peers;
+    int self;                           /* the index of this node, -1 for a router owning nothing */
+    int mode;
+    uint64_t requests;                  /* sent to other nodes */
+    uint64_t redirected;
+    uint64_t failed;                    /* requests not answered in time */
+    uint64_t fetch_hits;                /* variants sent by their holders */
+    uint64_t fetch_misses;              /* variants rendered after their holders did not send them */
+} cluster_stats_t;
+
+/* status is 0 if the node is not reached, then headers and body are NULL */
+typedef void (*cluster_cb)(int status, struct evkeyvalq *headers, struct evbuffer *body, void *arg);
+
+int cluster_init(const char *peers, const char *self, int mode);
+bool cluster_on(void);
+int cluster_mode(void);
+int cluster_owner(const char *md5);
+int cluster_holder(const char *md5, const char *name);
+void cluster_fetched(bool hit);
+const cluster_peer_t *cluster_peer(int i);
+int cluster_location(int peer, const char *uri, char *buf, size_t size);
+int cluster_request(struct event_base *base, int peer, enum evhttp_cmd_type method, const char *uri,
+        struct evbuffer *body, const char *type, int timeout, cluster_cb cb, void *arg);
+void cluster_stats(cluster_stats_t *st);
+
+#endif
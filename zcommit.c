@@ -0,0 +1,407 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zcommit.c
+ * @brief Group commit of durable writes. A writer queues its file and waits,
+ * the committer thread gathers the writes of a few milliseconds, makes all of
+ * them durable by one syncfs(), renames their temp files and syncs again, then
+ * wakes the writers up. Without syncfs() every file is synced by fdatasync().
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+//for syncfs()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "zcommit.h"
+#include "zlog.h"
+
+static int commit_interval = 0;
+static int root_fd = -1;
+static commit_t *pending = NULL;
+static commit_t **pending_tail = &pending;
+static bool commit_stop = false;
+static pthread_t committer_tid;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;   /* a write is queued */
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;     /* a batch is committed */
+/* guarded by commit_lock */
+static uint64_t ncommits = 0;
+static uint64_t nbatches = 0;
+static uint64_t nfailed = 0;
+static uint64_t max_batch = 0;
+static uint64_t sync_us = 0;
+
+#ifndef NO_SYNCFS
+static int sync_fs(commit_t *batch, bool meta);
+#endif
+static int sync_data(commit_t *batch);
+static int sync_meta(commit_t *batch);
+static void commit_batch(commit_t *batch);
+static void commit_wake(commit_t *c, void *arg);
+static void *committer(void *arg);
+
+#ifndef NO_SYNCFS
+/**
+ * @brief sync_fs Sync the file system of the images and every other one a
+ * write of the batch is on, such as a disk of the images, each once.
+ *
+ * @param batch The writes.
+ * @param meta Sync the file systems of the renamed writes only.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int sync_fs(commit_t *batch, bool meta)
+{
+    dev_t devs[COMMIT_FS_MAX];
+    int ndevs = 0, i, fd;
+    struct stat st;
+    commit_t *c;
+
+    if(syncfs(root_fd) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "syncfs Failed: %s", strerror(errno));
+        return ZIMG_ERR;
+    }
+    if(fstat(root_fd, &st) == 0)
+        devs[ndevs++] = st.st_dev;
+    for(c = batch; c != NULL; c = c->next)
+    {
+        if(meta && (c->ret != ZIMG_OK || c->from == NULL))
+            continue;
+        fd = (meta || c->fd == -1) ? c->dirfd : c->fd;
+        if(fd == -1 || fstat(fd, &st) == -1)
+            continue;
+        for(i = 0; i < ndevs && devs[i] != st.st_dev; i++);
+        if(i < ndevs)
+            continue;
+        if(syncfs(fd) == -1)
+        {
+            LOG_PRINT(LOG_ERROR, "syncfs Failed: %s", strerror(errno));
+            return ZIMG_ERR;
+        }
+        if(ndevs < COMMIT_FS_MAX)
+            devs[ndevs++] = st.st_dev;
+    }
+    return ZIMG_OK;
+}
+#endif
+
+/**
+ * @brief sync_data Make the data of a batch durable.
+ *
+ * @param batch The writes, ret of a failed one is set to ZIMG_ERR.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR if the whole batch failed.
+ */
+static int sync_data(commit_t *batch)
+{
+    commit_t *c;
+#ifndef NO_SYNCFS
+    if(sync_fs(batch, false) == ZIMG_ERR)
+        return ZIMG_ERR;
+    for(c = batch; c != NULL; c = c->next)
+        c->ret = ZIMG_OK;
+#else
+    for(c = batch; c != NULL; c = c->next)
+    {
+        c->ret = ZIMG_OK;
+        if(c->fd != -1 && fdatasync(c->fd) == -1)
+        {
+            LOG_PRINT(LOG_ERROR, "fdatasync Failed: %s", strerror(errno));
+            c->ret = ZIMG_ERR;
+        }
+    }
+#endif
+    return ZIMG_OK;
+}
+
+/**
+ * @brief sync_meta Make the renames of a batch durable.
+ *
+ * @param batch The writes, ret of a failed one is set to ZIMG_ERR.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR if the whole batch failed.
+ */
+static int sync_meta(commit_t *batch)
+{
+    commit_t *c;
+#ifndef NO_SYNCFS
+    bool renamed = false;
+    for(c = batch; c != NULL; c = c->next)
+        renamed = renamed || (c->ret == ZIMG_OK && c->from != NULL);
+    if(renamed && sync_fs(batch, true) == ZIMG_ERR)
+        return ZIMG_ERR;
+#else
+    for(c = batch; c != NULL; c = c->next)
+    {
+        if(c->ret == ZIMG_OK && c->dirfd != -1 && fsync(c->dirfd) == -1)
+        {
+            LOG_PRINT(LOG_ERROR, "fsync Failed: %s", strerror(errno));
+            c->ret = ZIMG_ERR;
+        }
+    }
+#endif
+    return ZIMG_OK;
+}
+
+/**
+ * @brief commit_batch Commit the writes gathered in an interval. A temp file
+ * is renamed only after its data is durable, so a crash never leaves a
+ * partial image under its real name.
+ *
+ * @param batch The writes.
+ */
+static void commit_batch(commit_t *batch)
+{
+    commit_t *c;
+    struct timespec start, end;
+    uint64_t n = 0, failed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(sync_data(batch) == ZIMG_OK)
+    {
+        for(c = batch; c != NULL; c = c->next)
+        {
+            if(c->ret == ZIMG_OK && c->from != NULL && renameat(c->from_dirfd, c->from, c->dirfd, c->to) == -1)
+            {
+                LOG_PRINT(LOG_ERROR, "Rename [%s] to [%s] Failed!", c->from, c->to);
+                c->ret = ZIMG_ERR;
+            }
+        }
+        if(sync_meta(batch) == ZIMG_ERR)
+        {
+            for(c = batch; c != NULL; c = c->next)
+                c->ret = ZIMG_ERR;
+        }
+    }
+    else
+    {
+        for(c = batch; c != NULL; c = c->next)
+            c->ret = ZIMG_ERR;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for(c = batch; c != NULL; c = c->next)
+    {
+        n++;
+        if(c->ret == ZIMG_ERR)
+            failed++;
+    }
+    pthread_mutex_lock(&commit_lock);
+    ncommits += n;
+    nfailed += failed;
+    nbatches++;
+    if(n > max_batch)
+        max_batch = n;
+    sync_us += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    pthread_mutex_unlock(&commit_lock);
+    LOG_PRINT(LOG_DEBUG, "Committed %llu Writes, %llu Failed.", (unsigned long long)n, (unsigned long long)failed);
+
+    //a write may be freed by its callback
+    while(batch != NULL)
+    {
+        c = batch;
+        batch = c->next;
+        c->cb(c, c->arg);
+    }
+}
+
+/**
+ * @brief committer The thread committing the queued writes every interval.
+ * The writes queued while a batch is being synced go to the next one.
+ */
+static void *committer(void *arg)
+{
+    struct timespec ts;
+    commit_t *batch;
+
+    ts.tv_sec = commit_interval / 1000;
+    ts.tv_nsec = (commit_interval % 1000) * 1000000L;
+    pthread_mutex_lock(&commit_lock);
+    for(;;)
+    {
+        while(pending == NULL && !commit_stop)
+            pthread_cond_wait(&commit_cond, &commit_lock);
+        if(pending == NULL)
+            break;
+        //gather the writes coming in the interval
+        if(!commit_stop)
+        {
+            pthread_mutex_unlock(&commit_lock);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&commit_lock);
+        }
+        batch = pending;
+        pending = NULL;
+        pending_tail = &pending;
+        pthread_mutex_unlock(&commit_lock);
+
+        commit_batch(batch);
+        pthread_mutex_lock(&commit_lock);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return NULL;
+}
+
+/**
+ * @brief commit_init Start the committer of durable writes.
+ *
+ * @param root A directory in the file system of the images.
+ * @param interval The ms to gather writes into a batch, 0 for not durable.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int commit_init(const char *root, int interval)
+{
+    if(interval <= 0)
+        return ZIMG_OK;
+    if((root_fd = open(root, O_RDONLY | O_DIRECTORY)) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "Dir[%s] Open Failed!", root);
+        return ZIMG_ERR;
+    }
+    commit_interval = interval;
+    commit_stop = false;
+    if(pthread_create(&committer_tid, NULL, committer, NULL) != 0)
+    {
+        LOG_PRINT(LOG_ERROR, "Committer Start Failed!");
+        close(root_fd);
+        root_fd = -1;
+        commit_interval = 0;
+        return ZIMG_ERR;
+    }
+    LOG_PRINT(LOG_INFO, "Durable Writes Committed Every %d ms.", interval);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief commit_destroy Stop the committer after the queued writes are
+ * committed.
+ */
+void commit_destroy(void)
+{
+    if(commit_interval == 0)
+        return;
+    pthread_mutex_lock(&commit_lock);
+    commit_stop = true;
+    pthread_cond_signal(&commit_cond);
+    pthread_mutex_unlock(&commit_lock);
+    pthread_join(committer_tid, NULL);
+    close(root_fd);
+    root_fd = -1;
+    commit_interval = 0;
+}
+
+/**
+ * @brief commit_on Check writes are made durable.
+ *
+ * @return true for durable writes.
+ */
+bool commit_on(void)
+{
+    return commit_interval > 0;
+}
+
+/**
+ * @brief commit_async Queue a write, the callback is called when its batch
+ * is committed, so the writer goes on meanwhile.
+ *
+ * @param c The write, it and its fds must be valid until cb is called. If
+ * the rename fails, the temp file is left to the caller.
+ * @param cb It is called on the committer thread, c->ret is ZIMG_OK for
+ * durable and ZIMG_ERR for fail.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for queued and ZIMG_ERR for fail, then cb is not called.
+ */
+int commit_async(commit_t *c, commit_cb cb, void *arg)
+{
+    if(commit_interval == 0)
+        return ZIMG_ERR;
+    c->ret = ZIMG_ERR;
+    c->done = false;
+    c->cb = cb;
+    c->arg = arg;
+    c->next = NULL;
+
+    pthread_mutex_lock(&commit_lock);
+    if(commit_stop)
+    {
+        pthread_mutex_unlock(&commit_lock);
+        return ZIMG_ERR;
+    }
+    *pending_tail = c;
+    pending_tail = &c->next;
+    if(pending == c)
+        pthread_cond_signal(&commit_cond);
+    pthread_mutex_unlock(&commit_lock);
+    return ZIMG_OK;
+}
+
+static void commit_wake(commit_t *c, void *arg)
+{
+    pthread_mutex_lock(&commit_lock);
+    c->done = true;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&commit_lock);
+}
+
+/**
+ * @brief commit_wait Queue a write and wait until its batch is committed.
+ * It blocks for up to an interval, so it is for the threads of the pools,
+ * never the thread of a request.
+ *
+ * @param c The write, its fds must be open until it returns. If the rename
+ * fails, the temp file is left to the caller.
+ *
+ * @return ZIMG_OK for durable and ZIMG_ERR for fail.
+ */
+int commit_wait(commit_t *c)
+{
+    if(commit_async(c, commit_wake, NULL) == ZIMG_ERR)
+        return ZIMG_ERR;
+    pthread_mutex_lock(&commit_lock);
+    while(!c->done)
+        pthread_cond_wait(&done_cond, &commit_lock);
+    pthread_mutex_unlock(&commit_lock);
+    return c->ret;
+}
+
+/**
+ * @brief commit_stats Get the counters of group commit.
+ *
+ * @param st It gets the counters.
+ */
+void commit_stats(commit_stats_t *st)
+{
+    pthread_mutex_lock(&commit_lock);
+    st->interval = commit_interval;
+    st->commits = ncommits;
+    st->batches = nbatches;
+    st->failed = nfailed;
+    st->max_batch = max_batch;
+    st->sync_us = sync_us;
+    pthread_mutex_unlock(&commit_lock);
+}
@@ -0,0 +1,65 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zcommit.h
+ * @brief Group commit of durable writes header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZCOMMIT_H
+#define ZCOMMIT_H
+
+#include <stdint.h>
+#include "zcommon.h"
+
+#define COMMIT_FS_MAX 16                /* file systems synced once each in a batch */
+
+struct commit_s;
+typedef void (*commit_cb)(struct commit_s *c, void *arg);
+
+/* a write waiting to be durable, it lives on the stack of the writer, or
+ * until its callback is called */
+typedef struct commit_s {
+    int fd;                             /* the data to sync, -1 for none */
+    int dirfd;                          /* synced after the rename, or another fd such as a journal, -1 for none */
+    int from_dirfd;
+    const char *from;                   /* renamed to dirfd/to after fd is synced, NULL for no rename */
+    const char *to;
+    int ret;
+    bool done;
+    commit_cb cb;                       /* called by the committer when the batch is committed */
+    void *arg;
+    struct commit_s *next;
+} commit_t;
+
+typedef struct commit_stats_s {
+    int interval;                       /* ms, 0 for off */
+    uint64_t commits;
+    uint64_t batches;
+    uint64_t failed;
+    uint64_t max_batch;
+    uint64_t sync_us;                   /* time spent in syncing */
+} commit_stats_t;
+
+int commit_init(const char *root, int interval);
+void commit_destroy(void);
+bool commit_on(void);
+int commit_async(commit_t *c, commit_cb cb, void *arg);
+int commit_wait(commit_t *c);
+void commit_stats(commit_stats_t *st);
+
+#endif
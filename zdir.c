@@ -0,0 +1,262 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zdir.c
+ * @brief Cache of directory fds of the lvl1/lvl2 storage fan-out. Image
+ * files are opened by openat() relative to the cached fd of their lvl2
+ * directory, so no path is walked from img_path and nothing depends on the
+ * working directory of the process. A cached fd is closed only when its
+ * slot is taken by another directory and nobody uses it. More roots with the
+ * same fan-out, such as a fast tier, share the cache.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "zdir.h"
+#include "zutil.h"
+#include "zlog.h"
+#include "zspinlock.h"
+
+#define DIR_LVL_NUM 1024                /* str_hash() is less than it */
+#define DIR_ROOT_IDS (DIR_LVL_NUM * (DIR_LVL_NUM + 1))  /* ids of the dirs under a root */
+
+typedef struct dir_slot_s {
+    spin_lock_t lock;
+    int id;                             /* DIR_ROOT_IDS * root + lvl1, or + DIR_LVL_NUM * (lvl1 + 1) + lvl2 */
+    int fd;
+    int refs;
+} dir_slot_t;
+
+static int root_fds[DIR_ROOT_MAX];
+static int nroots = 0;
+static dir_slot_t slots[DIR_CACHE_SIZE];
+static int nslots = DIR_CACHE_SIZE;
+
+static int slot_of(int id);
+static int dir_get(int parent, const char *name, int id, bool create, zdir_t *dir);
+
+
+static int slot_of(int id)
+{
+    return (unsigned int)(id * 2654435761u) % nslots;
+}
+
+/**
+ * @brief dir_cache_init Open the root of images. The cache uses a quarter
+ * of the fds the process may open at most.
+ *
+ * @param root The path of img_path.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int dir_cache_init(const char *root)
+{
+    struct rlimit rl;
+    int i;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < DIR_CACHE_SIZE)
+        nslots = rl.rlim_cur / 4 > 0 ? rl.rlim_cur / 4 : 1;
+    nroots = 0;
+    if(dir_root_add(root) == ZIMG_ERR)
+        return ZIMG_ERR;
+    for(i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        spin_init(&slots[i].lock, NULL);
+        slots[i].id = -1;
+        slots[i].fd = -1;
+        slots[i].refs = 0;
+    }
+    LOG_PRINT(LOG_INFO, "Dir Cache of [%s] Init, slots: %d.", root, nslots);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief dir_cache_free Close all cached fds.
+ */
+void dir_cache_free(void)
+{
+    int i;
+
+    for(i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if(slots[i].fd != -1)
+            close(slots[i].fd);
+        slots[i].id = -1;
+        slots[i].fd = -1;
+    }
+    for(i = 0; i < nroots; i++)
+        close(root_fds[i]);
+    nroots = 0;
+}
+
+/**
+ * @brief dir_root_add Open another root of images, its directories are
+ * cached as the ones of img_path.
+ *
+ * @param root The path of the root.
+ *
+ * @return The id of the root for dir_open_root(), or ZIMG_ERR for fail.
+ */
+int dir_root_add(const char *root)
+{
+    int fd;
+
+    if(nroots >= DIR_ROOT_MAX)
+    {
+        LOG_PRINT(LOG_ERROR, "Too Many Roots of Images!");
+        return ZIMG_ERR;
+    }
+    if((fd = open(root, O_RDONLY | O_DIRECTORY)) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "Dir[%s] Open Failed!", root);
+        return ZIMG_ERR;
+    }
+    root_fds[nroots] = fd;
+    return nroots++;
+}
+
+/**
+ * @brief dir_get Get a directory from the cache, or open it and put it in.
+ *
+ * @param parent The fd of the parent directory.
+ * @param name The name of the directory in parent.
+ * @param id The id of the directory in the cache.
+ * @param create Make the directory if it does not exist.
+ * @param dir It gets the directory.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int dir_get(int parent, const char *name, int id, bool create, zdir_t *dir)
+{
+    int s = slot_of(id);
+    dir_slot_t *slot = &slots[s];
+    int fd;
+
+    spin_lock(&slot->lock);
+    if(slot->id == id)
+    {
+        slot->refs++;
+        spin_unlock(&slot->lock);
+        dir->fd = slot->fd;
+        dir->slot = s;
+        return ZIMG_OK;
+    }
+    spin_unlock(&slot->lock);
+
+    fd = openat(parent, name, O_RDONLY | O_DIRECTORY);
+    if(fd == -1 && errno == ENOENT && create)
+    {
+        if(mkdirat(parent, name, 00755) == -1 && errno != EEXIST)
+            return ZIMG_ERR;
+        fd = openat(parent, name, O_RDONLY | O_DIRECTORY);
+    }
+    if(fd == -1)
+        return ZIMG_ERR;
+
+    dir->fd = fd;
+    dir->slot = -1;
+    spin_lock(&slot->lock);
+    if(slot->id == id)
+    {
+        //opened by another thread meanwhile
+        slot->refs++;
+        dir->fd = slot->fd;
+        dir->slot = s;
+    }
+    else if(slot->refs == 0)
+    {
+        if(slot->fd != -1)
+            close(slot->fd);
+        slot->id = id;
+        slot->fd = fd;
+        slot->refs = 1;
+        dir->slot = s;
+    }
+    spin_unlock(&slot->lock);
+    if(dir->fd != fd)
+        close(fd);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief dir_open Open the lvl2 directory of an image, such as
+ * img_path/lvl1/lvl2. The directory of the md5 is not included.
+ *
+ * @param md5 The md5 of the image.
+ * @param create Make the directories if they do not exist.
+ * @param dir It gets the directory.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int dir_open(const char *md5, bool create, zdir_t *dir)
+{
+    return dir_open_root(0, md5, create, dir);
+}
+
+/**
+ * @brief dir_open_root Open the lvl2 directory of an image under a root
+ * added by dir_root_add().
+ *
+ * @param root The id of the root, 0 for img_path.
+ * @param md5 The md5 of the image.
+ * @param create Make the directories if they do not exist.
+ * @param dir It gets the directory.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int dir_open_root(int root, const char *md5, bool create, zdir_t *dir)
+{
+    int lvl1 = str_hash(md5);
+    int lvl2 = str_hash(md5 + 3);
+    int base = DIR_ROOT_IDS * root;
+    char name[16];
+    zdir_t parent;
+    int ret;
+
+    if(root < 0 || root >= nroots)
+        return ZIMG_ERR;
+    snprintf(name, sizeof(name), "%d", lvl1);
+    if(dir_get(root_fds[root], name, base + lvl1, create, &parent) == ZIMG_ERR)
+        return ZIMG_ERR;
+    snprintf(name, sizeof(name), "%d", lvl2);
+    ret = dir_get(parent.fd, name, base + DIR_LVL_NUM * (lvl1 + 1) + lvl2, create, dir);
+    dir_close(&parent);
+    return ret;
+}
+
+/**
+ * @brief dir_close Release a directory got by dir_open().
+ *
+ * @param dir The directory.
+ */
+void dir_close(zdir_t *dir)
+{
+    if(dir->slot == -1)
+    {
+        close(dir->fd);
+    }
+    else
+    {
+        spin_lock(&slots[dir->slot].lock);
+        slots[dir->slot].refs--;
+        spin_unlock(&slots[dir->slot].lock);
+    }
+    dir->fd = -1;
+}
@@ -0,0 +1,44 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zdir.h
+ * @brief Cache of directory fds of the lvl1/lvl2 storage fan-out header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZDIR_H
+#define ZDIR_H
+
+#include "zcommon.h"
+
+#define DIR_CACHE_SIZE 4096             /* slots at most, each keeps one dir fd open */
+#define DIR_ROOT_MAX 16                 /* img_path and the other roots */
+
+/* an opened lvl2 directory, release it by dir_close() */
+typedef struct zdir_s {
+    int fd;
+    int slot;                           /* -1 if the fd is not cached */
+} zdir_t;
+
+int dir_cache_init(const char *root);
+void dir_cache_free(void);
+int dir_root_add(const char *root);
+int dir_open(const char *md5, bool create, zdir_t *dir);
+int dir_open_root(int root, const char *md5, bool create, zdir_t *dir);
+void dir_close(zdir_t *dir);
+
+#endif
@@ -0,0 +1,239 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zdisk.c
+ * @brief Placement of images on many disks. The md5 of an image picks its
+ * disk on a consistent hash ring, where every disk has DISK_VNODES points
+ * hashed from its path. A new disk only takes the images of the ranges it
+ * splits, and each of them was on the next disk of the ring before, so an
+ * image is looked up on its disk, then on the disk it was on before, then in
+ * img_path where the images stored without disks are.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "zdisk.h"
+#include "zutil.h"
+#include "zlog.h"
+
+typedef struct disk_s {
+    char path[512];
+    int root;                           /* the id of zdir */
+    dev_t dev;
+} disk_t;
+
+typedef struct disk_point_s {
+    uint32_t hash;
+    int disk;
+} disk_point_t;
+
+static disk_t disks[DISK_MAX];
+static int ndisks = 0;
+static disk_point_t points[DISK_MAX * DISK_VNODES];
+static int npoints = 0;
+
+static uint32_t fnv_hash(const char *str);
+static int point_cmp(const void *a, const void *b);
+static int point_of(const char *md5);
+
+
+/* FNV-1a, mixed at the end so the points of similar keys spread */
+static uint32_t fnv_hash(const char *str)
+{
+    uint32_t h = 2166136261u;
+    while(*str)
+    {
+        h ^= (unsigned char)*str++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+    const disk_point_t *pa = (const disk_point_t *)a;
+    const disk_point_t *pb = (const disk_point_t *)b;
+    if(pa->hash != pb->hash)
+        return pa->hash < pb->hash ? -1 : 1;
+    return pa->disk - pb->disk;
+}
+
+/**
+ * @brief point_of Find the first point of the ring at or after a md5.
+ *
+ * @param md5 The md5, its first 8 hex digits are its place on the ring.
+ *
+ * @return The index of the point.
+ */
+static int point_of(const char *md5)
+{
+    char head[9];
+    uint32_t h;
+    int lo = 0, hi = npoints;
+
+    snprintf(head, sizeof(head), "%s", md5);
+    h = (uint32_t)strtoul(head, NULL, 16);
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == npoints ? 0 : lo;
+}
+
+/**
+ * @brief disk_init Add the disks to store images on.
+ *
+ * @param paths The directories of the disks separated by commas, empty for
+ * storing images in img_path only. They are made if they do not exist.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int disk_init(const char *paths)
+{
+    char buf[DISK_MAX * 512];
+    char key[600];
+    char *p, *save = NULL;
+    struct stat st;
+    int i;
+
+    ndisks = npoints = 0;
+    snprintf(buf, sizeof(buf), "%s", paths);
+    for(p = strtok_r(buf, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save))
+    {
+        if(*p == '\0')
+            continue;
+        if(ndisks >= DISK_MAX)
+        {
+            LOG_PRINT(LOG_ERROR, "Too Many Disks, %d at most!", DISK_MAX);
+            return ZIMG_ERR;
+        }
+        if(mk_dirs(p) == ZIMG_ERR)
+        {
+            LOG_PRINT(LOG_ERROR, "Disk[%s] Create Failed!", p);
+            return ZIMG_ERR;
+        }
+        if(stat(p, &st) == -1 || (disks[ndisks].root = dir_root_add(p)) == ZIMG_ERR)
+            return ZIMG_ERR;
+        snprintf(disks[ndisks].path, sizeof(disks[ndisks].path), "%s", p);
+        disks[ndisks].dev = st.st_dev;
+        for(i = 0; i < DISK_VNODES; i++)
+        {
+            snprintf(key, sizeof(key), "%s#%d", p, i);
+            points[npoints].hash = fnv_hash(key);
+            points[npoints].disk = ndisks;
+            npoints++;
+        }
+        LOG_PRINT(LOG_INFO, "Disk[%s] Added.", p);
+        ndisks++;
+    }
+    qsort(points, npoints, sizeof(disk_point_t), point_cmp);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief disk_count Get the number of disks, 0 for img_path only.
+ */
+int disk_count(void)
+{
+    return ndisks;
+}
+
+const char *disk_path(int i)
+{
+    return i >= 0 && i < ndisks ? disks[i].path : NULL;
+}
+
+/**
+ * @brief disk_of Get the disk an image is stored on.
+ *
+ * @param md5 The md5 of the image.
+ *
+ * @return The index of the disk, -1 for img_path.
+ */
+int disk_of(const char *md5)
+{
+    if(ndisks == 0)
+        return -1;
+    return points[point_of(md5)].disk;
+}
+
+/**
+ * @brief disk_roots Get the roots an image may be in, the first one is where
+ * it is written.
+ *
+ * @param md5 The md5 of the image.
+ * @param roots It gets the ids of zdir, DISK_ROOTS_MAX at most.
+ *
+ * @return The number of roots.
+ */
+int disk_roots(const char *md5, int *roots)
+{
+    int n = 0, i, p, owner;
+
+    if(ndisks > 0)
+    {
+        p = point_of(md5);
+        owner = points[p].disk;
+        roots[n++] = disks[owner].root;
+        //the next disk of the ring owned the image before the owner was added
+        for(i = 1; i < npoints; i++)
+        {
+            if(points[(p + i) % npoints].disk != owner)
+            {
+                roots[n++] = disks[points[(p + i) % npoints].disk].root;
+                break;
+            }
+        }
+    }
+    roots[n++] = 0;
+    return n;
+}
+
+/**
+ * @brief disk_queue Get the async I/O queue of a file by its disk, so a slow
+ * disk does not hold the I/Os of the others.
+ *
+ * @param fd The file.
+ *
+ * @return The queue, 0 for the files not on the disks.
+ */
+int disk_queue(int fd)
+{
+    struct stat st;
+    int i;
+
+    if(ndisks == 0 || fstat(fd, &st) == -1)
+        return 0;
+    for(i = 0; i < ndisks; i++)
+    {
+        if(disks[i].dev == st.st_dev)
+            return i + 1;
+    }
+    return 0;
+}
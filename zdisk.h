@@ -0,0 +1,40 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zdisk.h
+ * @brief Placement of images on many disks header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZDISK_H
+#define ZDISK_H
+
+#include "zcommon.h"
+#include "zdir.h"
+
+#define DISK_MAX (DIR_ROOT_MAX - 2)     /* img_path and the fast tier take a root each */
+#define DISK_VNODES 160                 /* points of a disk on the hash ring */
+#define DISK_ROOTS_MAX 3                /* roots an image is looked up in */
+
+int disk_init(const char *paths);
+int disk_count(void);
+const char *disk_path(int i);
+int disk_of(const char *md5);
+int disk_roots(const char *md5, int *roots);
+int disk_queue(int fd);
+
+#endif
@@ -24,11 +24,24 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <ctype.h>
 #include <htparse.h>
 #include "zhttpd.h"
 #include "zimg.h"
 #include "zutil.h"
 #include "zlog.h"
+#include "zupload.h"
+#include "zvolume.h"
+#include "zvariant.h"
+#include "zaio.h"
+#include "zcache.h"
+#include "zcommit.h"
+#include "ztier.h"
+#include "zdisk.h"
+#include "zcluster.h"
+#include "zorigin.h"
+#include "zshard.h"
+#include "zrender.h"
 
 static char *server_name = "zimg/1.0.0 (Unix)";
 struct setting settings;
@@ -38,6 +51,8 @@ static const char * guess_content_type(const char *path);
 static int print_headers(evhtp_header_t * header, void * arg); 
 static int get_req_method(evhtp_request_t *req);
 static void send_reply(evhtp_request_t *req, char *type);
+static void peer_reply(evhtp_request_t *req, int status, struct evkeyvalq *headers, struct evbuffer *body);
+static bool doc_serve(evhtp_request_t *req, zimg_req_t *zimg_req, int get_img_rst, char *buff, size_t len);
 
 static int get_req_method(evhtp_request_t *req)
 {
@@ -59,8 +74,109 @@ static void send_reply(evhtp_request_t *req, char *type){
 
     evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", server_name, 0, 0));
     evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", guess_type(type), 0, 0));
+    //a HEAD reply has the length of the body without the body
+    if(evhtp_request_get_method(req) == htp_method_HEAD)
+    {
+	if(evhtp_header_find(req->headers_out, "Content-Length") == NULL)
+	{
+	    char length[32];
+	    snprintf(length, sizeof(length), "%zu", evbuffer_get_length(req->buffer_out));
+	    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Length", length, 0, 1));
+	}
+	evbuffer_drain(req->buffer_out, evbuffer_get_length(req->buffer_out));
+    }
     evhtp_send_reply(req, EVHTP_RES_OK);
 }
+
+/**
+ * @brief img_etag Make the strong ETag of a variant. Images are named by the
+ * md5 of their content and a variant is the same for the same name, so the
+ * tag is the key of the variant and it never changes.
+ *
+ * @param zimg_req The request of the image with its rsp_name.
+ * @param etag It gets the quoted tag.
+ * @param size The size of etag.
+ */
+static void img_etag(const zimg_req_t *zimg_req, char *etag, size_t size)
+{
+    snprintf(etag, size, "\"%s-%s\"", zimg_req->md5, zimg_req->rsp_name);
+}
+
+/**
+ * @brief add_cache_headers Add the ETag and Cache-Control of an image reply.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image with its rsp_name.
+ */
+static void add_cache_headers(evhtp_request_t *req, const zimg_req_t *zimg_req)
+{
+    char etag[192];
+    char cache_control[64];
+
+    img_etag(zimg_req, etag, sizeof(etag));
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("ETag", etag, 0, 1));
+    if(settings.max_age > 0)
+    {
+	snprintf(cache_control, sizeof(cache_control), "public, max-age=%d, immutable", settings.max_age);
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Cache-Control", cache_control, 0, 1));
+    }
+}
+
+/**
+ * @brief etag_match Check an If-None-Match header has a tag. The weak
+ * comparison is used as RFC 7232 asks, and * is not matched as it asks for
+ * the image to be found.
+ *
+ * @param inm The value of If-None-Match, a list of tags.
+ * @param etag The quoted tag.
+ *
+ * @return true if it has the tag.
+ */
+static bool etag_match(const char *inm, const char *etag)
+{
+    size_t len = strlen(etag);
+    const char *p = inm;
+
+    while(*p != '\0')
+    {
+	while(*p == ' ' || *p == '\t' || *p == ',')
+	    p++;
+	if(strncmp(p, "W/", 2) == 0)
+	    p += 2;
+	if(strncmp(p, etag, len) == 0 && (p[len] == '\0' || p[len] == ',' || p[len] == ' ' || p[len] == '\t'))
+	    return true;
+	while(*p != '\0' && *p != ',')
+	    p++;
+    }
+    return false;
+}
+
+/**
+ * @brief not_modified Answer a conditional GET with 304 if the client has
+ * the image already, so it is not looked for at all.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image with its rsp_name.
+ *
+ * @return true if 304 is sent.
+ */
+static bool not_modified(evhtp_request_t *req, const zimg_req_t *zimg_req)
+{
+    const char *inm = evhtp_header_find(req->headers_in, "If-None-Match");
+    char etag[192];
+
+    if(inm == NULL)
+	return false;
+    img_etag(zimg_req, etag, sizeof(etag));
+    if(!etag_match(inm, etag))
+	return false;
+    LOG_PRINT(LOG_INFO, "Image[%s/%s] Not Modified.", zimg_req->md5, zimg_req->rsp_name);
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", server_name, 0, 0));
+    add_cache_headers(req, zimg_req);
+    evhtp_send_reply(req, EVHTP_RES_NOTMOD);
+    return true;
+}
+
 /**
  * @brief guess_type It returns a HTTP type by guessing the file type.
  *
@@ -169,260 +285,1550 @@ void dump_request_cb(evhtp_request_t *req, void *arg)
 /**
  * @brief echo_cb Callback function of echo test.
  *
- * @param req The request of a test url.
- * @param arg It is not useful.
+ * @param req The request of a test url.
+ * @param arg It is not useful.
+ */
+void echo_cb(evhtp_request_t *req, void *arg)
+{
+    evbuffer_add_printf(req->buffer_out, "<html><body><h1>zimg works!</h1></body></html>");
+    send_reply(req,"html");
+}
+
+/**
+ * @brief status_request_cb The callback of a status request, it replies the
+ * usage of storage in json.
+ *
+ * @param req The request of /status.
+ * @param arg It is not useful.
+ */
+void status_request_cb(evhtp_request_t *req, void *arg)
+{
+    vol_stats_t vst;
+    variant_stats_t vast;
+    aio_stats_t ast;
+    commit_stats_t cst;
+    tier_stats_t tst;
+    cluster_stats_t clst;
+    origin_stats_t ost;
+    render_stats_t rst;
+    int i;
+
+    variant_stats(&vast);
+    aio_stats(&ast);
+    evbuffer_add_printf(req->buffer_out,
+	    "{\"variant\":{\"budget\":%llu,\"variants\":%llu,\"bytes\":%llu,"
+	    "\"evictions\":%llu,\"evicted_bytes\":%llu,\"scanning\":%s}",
+	    (unsigned long long)vast.budget, (unsigned long long)vast.variants, (unsigned long long)vast.bytes,
+	    (unsigned long long)vast.evictions, (unsigned long long)vast.evicted_bytes,
+	    vast.scanning ? "true" : "false");
+    evbuffer_add_printf(req->buffer_out,
+	    ",\"aio\":{\"backend\":\"%s\",\"submitted\":%llu,\"completed\":%llu,\"failed\":%llu,"
+	    "\"batches\":%llu,\"inflight\":%llu,\"queues\":%d}",
+	    aio_backend_name(ast.backend), (unsigned long long)ast.submitted, (unsigned long long)ast.completed,
+	    (unsigned long long)ast.failed, (unsigned long long)ast.batches, (unsigned long long)ast.inflight,
+	    ast.queues);
+    if(disk_count() > 0)
+    {
+	evbuffer_add_printf(req->buffer_out, ",\"disks\":[");
+	for(i = 0; i < disk_count(); i++)
+	    evbuffer_add_printf(req->buffer_out, "%s{\"path\":\"%s\",\"inflight\":%llu}",
+		    i > 0 ? "," : "", disk_path(i), (unsigned long long)aio_queue_inflight(i + 1));
+	evbuffer_add_printf(req->buffer_out, "]");
+    }
+    //connections accepted by each shard show how the kernel spreads them
+    if(shard_count() > 0)
+    {
+	evbuffer_add_printf(req->buffer_out, ",\"shards\":[");
+	for(i = 0; i < shard_count(); i++)
+	    evbuffer_add_printf(req->buffer_out, "%s{\"accepted\":%llu}",
+		    i > 0 ? "," : "", (unsigned long long)shard_accepted(i));
+	evbuffer_add_printf(req->buffer_out, "]");
+    }
+    commit_stats(&cst);
+    evbuffer_add_printf(req->buffer_out,
+	    ",\"commit\":{\"interval\":%d,\"commits\":%llu,\"batches\":%llu,\"failed\":%llu,"
+	    "\"max_batch\":%llu,\"sync_us\":%llu}",
+	    cst.interval, (unsigned long long)cst.commits, (unsigned long long)cst.batches,
+	    (unsigned long long)cst.failed, (unsigned long long)cst.max_batch, (unsigned long long)cst.sync_us);
+    if(tier_on())
+    {
+	tier_stats(&tst);
+	evbuffer_add_printf(req->buffer_out,
+		",\"tier\":{\"budget\":%llu,\"hot\":%llu,\"bytes\":%llu,\"queued\":%llu,"
+		"\"promotions\":%llu,\"demotions\":%llu,\"fast_hits\":%llu,\"slow_hits\":%llu}",
+		(unsigned long long)tst.budget, (unsigned long long)tst.hot, (unsigned long long)tst.bytes,
+		(unsigned long long)tst.queued, (unsigned long long)tst.promotions, (unsigned long long)tst.demotions,
+		(unsigned long long)tst.fast_hits, (unsigned long long)tst.slow_hits);
+    }
+    if(cluster_on())
+    {
+	cluster_stats(&clst);
+	evbuffer_add_printf(req->buffer_out,
+		",\"cluster\":{\"nodes\":%d,\"self\":\"%s\",\"mode\":\"%s\",\"requests\":%llu,"
+		"\"redirected\":%llu,\"failed\":%llu,\"fetch_hits\":%llu,\"fetch_misses\":%llu}",
+		clst.peers, clst.self == -1 ? "" : cluster_peer(clst.self)->name,
+		clst.mode == CLUSTER_REDIRECT ? "redirect" : "proxy", (unsigned long long)clst.requests,
+		(unsigned long long)clst.redirected, (unsigned long long)clst.failed,
+		(unsigned long long)clst.fetch_hits, (unsigned long long)clst.fetch_misses);
+    }
+    if(origin_on())
+    {
+	origin_stats(&ost);
+	evbuffer_add_printf(req->buffer_out,
+		",\"origin\":{\"url\":\"%s\",\"fetches\":%llu,\"coalesced\":%llu,\"failed\":%llu,"
+		"\"bytes\":%llu,\"inflight\":%d}",
+		settings.origin, (unsigned long long)ost.fetches, (unsigned long long)ost.coalesced,
+		(unsigned long long)ost.failed, (unsigned long long)ost.bytes, ost.inflight);
+    }
+    if(render_on())
+    {
+	render_stats(&rst);
+	evbuffer_add_printf(req->buffer_out,
+		",\"render\":{\"limit\":%d,\"queue_max\":%d,\"wait_ms\":%d,\"queued\":%d,\"running\":%d,"
+		"\"rendered\":%llu,\"rejected\":%llu,\"expired\":%llu}",
+		rst.limit, rst.queue_max, rst.wait_ms, rst.queued, rst.running, (unsigned long long)rst.rendered,
+		(unsigned long long)rst.rejected, (unsigned long long)rst.expired);
+    }
+    if(settings.volume_on)
+    {
+	vol_stats(&vst);
+	evbuffer_add_printf(req->buffer_out,
+		",\"volume\":{\"volumes\":%u,\"active\":%d,\"keys\":%llu,\"bytes\":%llu,\"dead_bytes\":%llu,"
+		"\"compacting\":%d,\"compact_done\":%llu,\"compact_total\":%llu,"
+		"\"compactions\":%llu,\"reclaimed_bytes\":%llu}",
+		vst.volumes, vst.active, (unsigned long long)vst.keys,
+		(unsigned long long)vst.bytes, (unsigned long long)vst.dead_bytes,
+		vst.compacting, (unsigned long long)vst.compact_done, (unsigned long long)vst.compact_total,
+		(unsigned long long)vst.compactions, (unsigned long long)vst.reclaimed_bytes);
+    }
+    evbuffer_add_printf(req->buffer_out, "}");
+    send_reply(req, "json");
+}
+
+void phone_request_cb(evhtp_request_t *req, void *arg){
+    const char *phone_str = evhtp_kv_find(req->uri->query, "q"); 
+    if(phone_str == NULL){
+	evbuffer_add_printf(req->buffer_out, "{\"status\":-1}");
+	send_reply(req,"json");
+	return;
+    }
+  
+    size_t img_size;
+    int buff_type = BUFF_TYPE_MALLOC;
+    char *p = get_phone_img(phone_str,&img_size,&buff_type);
+    if(p != NULL){
+	if(evbuffer_add_reference(req->buffer_out, p, img_size, release_img_buff, (void *)(intptr_t)buff_type) == -1)
+	    release_img_buff(p, img_size, (void *)(intptr_t)buff_type);
+    }
+
+    send_reply(req,"jpg");
+}
+
+/* a request sent on to the node owning its image */
+typedef struct peer_proxy_s {
+    evhtp_request_t *req;       /* NULL if the connection is closed meanwhile */
+} peer_proxy_t;
+
+static evhtp_res peer_proxy_fini(evhtp_request_t *req, void *arg)
+{
+    ((peer_proxy_t *)arg)->req = NULL;
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief req_uri Get the path and query of a request.
+ *
+ * @param req The request.
+ * @param buf It gets the uri.
+ * @param size The size of buf.
+ */
+static void req_uri(evhtp_request_t *req, char *buf, size_t size)
+{
+    if(req->uri->query_raw != NULL && req->uri->query_raw[0] != '\0')
+	snprintf(buf, size, "%s?%s", req->uri->path->full, (const char *)req->uri->query_raw);
+    else
+	snprintf(buf, size, "%s", req->uri->path->full);
+}
+
+/**
+ * @brief peer_proxied Send the reply of the owner as the reply of a request,
+ * it runs in the thread of the request.
+ *
+ * @param status The status of the reply, 0 if the owner is not reached.
+ * @param headers The headers of the reply.
+ * @param body The body of the reply.
+ * @param arg The peer_proxy_t.
+ */
+static void peer_proxied(int status, struct evkeyvalq *headers, struct evbuffer *body, void *arg)
+{
+    peer_proxy_t *pp = (peer_proxy_t *)arg;
+    evhtp_request_t *req = pp->req;
+
+    if(req == NULL)
+    {
+	LOG_PRINT(LOG_INFO, "Proxied Request is Gone.");
+	goto done;
+    }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+    peer_reply(req, status, headers, body);
+    evhtp_request_resume(req);
+
+done:
+    free(pp);
+}
+
+/**
+ * @brief peer_reply Send the reply of another node as the reply of a
+ * request.
+ *
+ * @param req The request.
+ * @param status The status of the reply, 0 if the node is not reached.
+ * @param headers The headers of the reply.
+ * @param body The body of the reply.
+ */
+static void peer_reply(evhtp_request_t *req, int status, struct evkeyvalq *headers, struct evbuffer *body)
+{
+    struct evkeyval *kv;
+
+    if(status == 0)
+    {
+	LOG_PRINT(LOG_ERROR, "Owner of the Request Not Reached!");
+	if(evhtp_request_get_method(req) != htp_method_HEAD)
+	    evbuffer_add_printf(req->buffer_out, "<html><body><h1>502 Bad Gateway!</h1></body></html>");
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", server_name, 0, 0));
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", guess_type("html"), 0, 0));
+	evhtp_send_reply(req, EVHTP_RES_BADGATEWAY);
+    }
+    else
+    {
+	//the headers of the connection are not the ones of the client
+	for(kv = headers->tqh_first; kv != NULL; kv = kv->next.tqe_next)
+	{
+	    if(strcasecmp(kv->key, "Connection") == 0 || strcasecmp(kv->key, "Keep-Alive") == 0
+		    || strcasecmp(kv->key, "Transfer-Encoding") == 0)
+		continue;
+	    //the length of a HEAD reply is the one of the body not sent
+	    if(strcasecmp(kv->key, "Content-Length") == 0 && evhtp_request_get_method(req) != htp_method_HEAD)
+		continue;
+	    evhtp_headers_add_header(req->headers_out, evhtp_header_new(kv->key, kv->value, 1, 1));
+	}
+	evbuffer_add_buffer(req->buffer_out, body);
+	evhtp_send_reply(req, status);
+    }
+}
+
+/**
+ * @brief peer_route Answer a request by the node owning its image. The
+ * request is sent on to it, or redirected to it in CLUSTER_REDIRECT mode.
+ *
+ * @param req The request.
+ * @param peer The owner.
+ * @param method The method sent to the owner.
+ * @param uri The path and query sent to the owner.
+ * @param body The body sent to the owner, it is drained, NULL for none.
+ * @param type The Content-Type of body.
+ *
+ * @return ZIMG_OK for answered or started, and ZIMG_ERR for fail.
+ */
+static int peer_route(evhtp_request_t *req, int peer, enum evhttp_cmd_type method, const char *uri,
+	struct evbuffer *body, const char *type)
+{
+    peer_proxy_t *pp;
+    char location[1024];
+
+    if(cluster_mode() == CLUSTER_REDIRECT)
+    {
+	if(cluster_location(peer, uri, location, sizeof(location)) == ZIMG_ERR)
+	    return ZIMG_ERR;
+	LOG_PRINT(LOG_INFO, "Request Redirected to <%s>", location);
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", server_name, 0, 0));
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Location", location, 0, 1));
+	evhtp_send_reply(req, EVHTP_RES_TMPREDIR);
+	return ZIMG_OK;
+    }
+
+    if((pp = (peer_proxy_t *)calloc(1, sizeof(peer_proxy_t))) == NULL)
+	return ZIMG_ERR;
+    pp->req = req;
+    //the fini hook is only taken once the request is sent, so a failure
+    //leaves the one of the caller (e.g. the upload context) in place
+    if(cluster_request(req->conn->evbase, peer, method, uri, body, type, 0, peer_proxied, pp) == ZIMG_ERR)
+    {
+	free(pp);
+	return ZIMG_ERR;
+    }
+    //the answer comes on this thread, so it comes after the pause
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)peer_proxy_fini, pp);
+    evhtp_request_pause(req);
+    LOG_PRINT(LOG_INFO, "Request Proxied to Node[%s] <%s>", cluster_peer(peer)->name, uri);
+    return ZIMG_OK;
+}
+
+/* a single upload waiting for its image to be committed */
+typedef struct post_save_s {
+    evhtp_request_t *req;       /* NULL if the connection is closed meanwhile */
+    aio_loop_t *loop;
+    upload_ctx_t *ctx;
+    int ret;
+} post_save_t;
+
+static evhtp_res post_save_fini(evhtp_request_t *req, void *arg)
+{
+    ((post_save_t *)arg)->req = NULL;
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief post_save_reply Send the reply of an upload after its image is
+ * committed, it runs in the thread of the request.
+ *
+ * @param arg The post_save_t.
+ */
+static void post_save_reply(void *arg)
+{
+    post_save_t *ps = (post_save_t *)arg;
+    evhtp_request_t *req = ps->req;
+
+    if(req == NULL)
+    {
+	LOG_PRINT(LOG_INFO, "Request of Upload[%s] is Gone.", ps->ctx->files->md5sum);
+	goto done;
+    }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+
+    if(ps->ret == ZIMG_OK)
+    {
+	LOG_PRINT(LOG_INFO, "============post_request_cb() OK!===============");
+	evbuffer_add_printf(req->buffer_out, "{\"status\":0,\"picture\":%s}", ps->ctx->files->md5sum);
+    }
+    else
+    {
+	LOG_PRINT(LOG_ERROR, "Image Save Failed!");
+	evbuffer_add_printf(req->buffer_out, "{\"status\":-1}");
+    }
+    send_reply(req, "json");
+    evhtp_request_resume(req);
+
+done:
+    upload_ctx_free(ps->ctx);
+    free(ps);
+}
+
+/* on a thread of the upload pool */
+static void post_saved(int ret, void *arg)
+{
+    post_save_t *ps = (post_save_t *)arg;
+
+    ps->ret = ret;
+    if(aio_loop_post(ps->loop, post_save_reply, ps) == ZIMG_ERR)
+	LOG_PRINT(LOG_ERROR, "Post Upload[%s] to Loop Failed!", ps->ctx->files->md5sum);
+}
+
+/**
+ * @brief post_save_start Save an upload by the pool and pause the request
+ * until it is committed, so the reply is not sent before the image is
+ * durable and the thread goes on with other connections meanwhile.
+ *
+ * @param req The request.
+ * @param ctx The upload context, it belongs to the saving if it is started.
+ *
+ * @return ZIMG_OK for started and ZIMG_ERR for fail.
+ */
+static int post_save_start(evhtp_request_t *req, upload_ctx_t *ctx)
+{
+    post_save_t *ps = (post_save_t *)calloc(1, sizeof(post_save_t));
+
+    if(ps == NULL || (ps->loop = aio_loop_get(req->conn->evbase)) == NULL)
+    {
+	free(ps);
+	return ZIMG_ERR;
+    }
+    ps->req = req;
+    ps->ctx = ctx;
+    if(upload_save_async(ctx, post_saved, ps) == ZIMG_ERR)
+    {
+	free(ps);
+	return ZIMG_ERR;
+    }
+    //the reply is posted to this thread, so it comes after the pause
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)post_save_fini, ps);
+    evhtp_request_pause(req);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief post_request_cb The callback function of a POST request to upload a image.
+ * The body is a form, or the image itself with a Content-Type of
+ * application/octet-stream which can also be PUT.
+ *
+ * @param req The request with image buffer.
+ * @param arg It is not useful.
+ */
+void post_request_cb(evhtp_request_t *req, void *arg)
+{
+/**
+Sample Post Data
+Header:
+Content-Length:50108
+Content-Type:multipart/form-data; boundary=----WebKitFormBoundaryhIgUVzoG5V655hmr
+Body:
+------WebKitFormBoundaryhIgUVzoG5V655hmr
+Content-Disposition: form-data; name="userfile"; filename="t.png"\r\n
+Content-Type: image/png\r\n\r\n
+
+
+------WebKitFormBoundaryhIgUVzoG5V655hmr--
+*/
+
+    upload_ctx_t *ctx = (upload_ctx_t *)arg;
+    bool own_ctx = false;
+    struct evbuffer *body = NULL;
+    int peer;
+
+    //eheck request method, PUT is for a raw body
+    int req_method = get_req_method(req);
+    if(req_method != htp_method_POST && req_method != htp_method_PUT)
+    {
+	LOG_PRINT(LOG_INFO, "Request Method Not Support.");
+	goto err;
+    }
+    //originals got from an origin are only a cache, an upload here may be
+    //removed by the budget and never found again
+    if(origin_on())
+    {
+	LOG_PRINT(LOG_WARNING, "Upload Refused, Originals Are Got from the Origin.");
+	goto err;
+    }
+
+    if(ctx == NULL)
+    {
+	//the body is not received by upload_headers_cb() hooks, parse it at once
+	ctx = upload_ctx_new(req, false);
+	if(ctx == NULL)
+	{
+	    goto err;
+	}
+	own_ctx = true;
+
+	if(evbuffer_get_length(req->buffer_in) <= 0)
+	{
+	    LOG_PRINT(LOG_ERROR, "Empty Request!");
+	    goto err;
+	}
+	upload_feed(ctx, req->buffer_in);
+    }
+    upload_finish(ctx);
+
+    //the file has been checked, hashed and stored while received
+    if(ctx->state != UPLOAD_DONE)
+    {
+	LOG_PRINT(LOG_ERROR, "Image Not complete!");
+	goto err;
+    }
+
+    //the image is stored by the node owning it, the body is sent on as the
+    //image itself
+    if(cluster_on() && evhtp_header_find(req->headers_in, CLUSTER_HEADER) == NULL
+	    && (peer = cluster_owner(ctx->files->md5sum)) != -1)
+    {
+	if(cluster_mode() == CLUSTER_REDIRECT)
+	{
+	    if(peer_route(req, peer, EVHTTP_REQ_POST, req->uri->path->full, NULL, NULL) == ZIMG_ERR)
+		goto err;
+	    goto sent;
+	}
+	if((body = evbuffer_new()) == NULL || upload_body(ctx, body) == ZIMG_ERR
+		|| peer_route(req, peer, EVHTTP_REQ_PUT, "/upload", body, "application/octet-stream") == ZIMG_ERR)
+	    goto err;
+	evbuffer_free(body);
+	//the fini hook of ctx is replaced by the proxy and the body is copied
+	upload_ctx_free(ctx);
+	return;
+    }
+
+    LOG_PRINT(LOG_INFO, "Begin to Save Image...");
+    if(commit_on())
+    {
+	//the hooks of ctx are replaced, it is freed after the reply
+	if(post_save_start(req, ctx) == ZIMG_OK)
+	    return;
+	//a durable save waits for the committer, never in this thread
+	LOG_PRINT(LOG_ERROR, "Image Save Start Failed!");
+	goto err;
+    }
+    if(upload_save(ctx) == ZIMG_ERR)
+    {
+	LOG_PRINT(LOG_ERROR, "Image Save Failed!");
+	goto err;
+    }
+
+    LOG_PRINT(LOG_INFO, "============post_request_cb() OK!===============");
+    evbuffer_add_printf(req->buffer_out, "{\"status\":0,\"picture\":%s}",ctx->files->md5sum);
+    goto done;
+
+err:
+    LOG_PRINT(LOG_INFO, "============post_request_cb() ERROR!===============");
+    evbuffer_add_printf(req->buffer_out, "{\"status\":-1}"); 
+
+done:
+    send_reply(req,"json");
+
+sent:
+    //clean up
+    if(body)
+	evbuffer_free(body);
+    if(own_ctx)
+    {
+	upload_ctx_free(ctx);
+    }
+}
+
+
+/* a batch upload waiting for its files to be saved */
+typedef struct batch_wait_s {
+    evhtp_request_t *req;       /* NULL if the connection is closed meanwhile */
+    upload_ctx_t *ctx;
+} batch_wait_t;
+
+static evhtp_res batch_wait_fini(evhtp_request_t *req, void *arg)
+{
+    ((batch_wait_t *)arg)->req = NULL;
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief batch_reply Send the reply of a batch upload after all its files
+ * are saved, it runs in the thread of the request.
+ *
+ * @param arg The batch_wait_t.
+ */
+static void batch_reply(void *arg)
+{
+    batch_wait_t *bw = (batch_wait_t *)arg;
+    evhtp_request_t *req = bw->req;
+    upload_ctx_t *ctx = bw->ctx;
+    upload_file_t *file;
+
+    if(req == NULL)
+    {
+	LOG_PRINT(LOG_INFO, "Request of Batch Upload is Gone.");
+	goto done;
+    }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+
+    evbuffer_add(req->buffer_out, "[", 1);
+    for(file = ctx->files; file != NULL; file = file->next)
+    {
+	if(file->status == ZIMG_OK)
+	    evbuffer_add_printf(req->buffer_out, "{\"status\":0,\"picture\":\"%s\"}", file->md5sum);
+	else
+	    evbuffer_add_printf(req->buffer_out, "{\"status\":-1}");
+	if(file->next != NULL)
+	    evbuffer_add(req->buffer_out, ",", 1);
+    }
+    evbuffer_add(req->buffer_out, "]", 1);
+    LOG_PRINT(LOG_INFO, "============batch_request_cb() OK! files: %d===============", ctx->nfiles);
+    send_reply(req, "json");
+    evhtp_request_resume(req);
+
+done:
+    upload_ctx_free(ctx);
+    free(bw);
+}
+
+/**
+ * @brief batch_wait_start Pause a batch upload until the pool has saved all
+ * its files. The reply is posted back to this thread, so it never waits for
+ * the pool or for the committer of durable writes.
+ *
+ * @param req The request.
+ * @param ctx The upload context, it belongs to the waiting if it is started.
+ *
+ * @return ZIMG_OK for started and ZIMG_ERR for fail.
+ */
+static int batch_wait_start(evhtp_request_t *req, upload_ctx_t *ctx)
+{
+    batch_wait_t *bw = (batch_wait_t *)calloc(1, sizeof(batch_wait_t));
+    aio_loop_t *loop;
+
+    if(bw == NULL || (loop = aio_loop_get(req->conn->evbase)) == NULL)
+    {
+	free(bw);
+	return ZIMG_ERR;
+    }
+    bw->req = req;
+    bw->ctx = ctx;
+    if(upload_wait_async(ctx, loop, batch_reply, bw) == ZIMG_ERR)
+    {
+	free(bw);
+	return ZIMG_ERR;
+    }
+    //the reply is posted to this thread, so it comes after the pause
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)batch_wait_fini, bw);
+    evhtp_request_pause(req);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief batch_request_cb The callback function of a POST request to upload
+ * many images in one form. The images are saved by the upload pool while the
+ * form is received, the reply is a JSON array of the status of each file in
+ * the order of the form.
+ *
+ * @param req The request with image buffers.
+ * @param arg The upload context set by batch_headers_cb().
+ */
+void batch_request_cb(evhtp_request_t *req, void *arg)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)arg;
+    bool own_ctx = false;
+    bool paused = false;
+
+    int req_method = get_req_method(req);
+    if(req_method != htp_method_POST)
+    {
+	LOG_PRINT(LOG_INFO, "Request Method Not Support.");
+	goto err;
+    }
+    if(origin_on())
+    {
+	LOG_PRINT(LOG_WARNING, "Upload Refused, Originals Are Got from the Origin.");
+	goto err;
+    }
+
+    if(ctx == NULL)
+    {
+	//the body is not received by batch_headers_cb() hooks, parse it at once
+	ctx = upload_ctx_new(req, true);
+	if(ctx == NULL)
+	{
+	    goto err;
+	}
+	own_ctx = true;
+	upload_feed(ctx, req->buffer_in);
+    }
+    upload_finish(ctx);
+
+    if(ctx->state != UPLOAD_DONE || ctx->nfiles == 0)
+    {
+	LOG_PRINT(LOG_ERROR, "Batch Form Not complete!");
+	goto err;
+    }
+
+    //the whole body is received, a read paused by the bound of the batch is
+    //resumed after the reply
+    paused = upload_detach(ctx);
+    if(batch_wait_start(req, ctx) == ZIMG_OK)
+    {
+	//the hooks of ctx are replaced, it is freed after the reply
+	return;
+    }
+    LOG_PRINT(LOG_ERROR, "Batch Wait Start Failed!");
+
+err:
+    LOG_PRINT(LOG_INFO, "============batch_request_cb() ERROR!===============");
+    evbuffer_add_printf(req->buffer_out, "{\"status\":-1}"); 
+    send_reply(req,"json");
+    if(paused)
+	evhtp_request_resume(req);
+
+    if(own_ctx)
+    {
+	upload_ctx_free(ctx);
+    }
+}
+
+
+/* a GET request waiting for its image read by async I/O */
+typedef struct doc_read_s {
+    evhtp_request_t *req;       /* NULL if the connection is closed meanwhile */
+    aio_loop_t *loop;
+    zimg_req_t *zimg_req;
+    char *buff;
+    size_t len;
+    int ret;
+} doc_read_t;
+
+/* a new image being sent and saved at the same time */
+typedef struct doc_save_s {
+    char md5[33];
+    char name[128];
+    char *buff;
+    size_t len;
+    int buff_type;
+    int refs;
+} doc_save_t;
+
+static void zimg_req_free(zimg_req_t *zimg_req)
+{
+    if(zimg_req->rsp_fd != -1)
+	close(zimg_req->rsp_fd);
+    free(zimg_req->md5);
+    free(zimg_req);
+}
+
+static evhtp_res doc_read_fini(evhtp_request_t *req, void *arg)
+{
+    ((doc_read_t *)arg)->req = NULL;
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief doc_read_reply Send the image read by async I/O, it runs in the
+ * thread of the request.
+ *
+ * @param arg The doc_read_t.
+ */
+static void doc_read_reply(void *arg)
+{
+    doc_read_t *rd = (doc_read_t *)arg;
+    zimg_req_t *zimg_req = rd->zimg_req;
+    evhtp_request_t *req = rd->req;
+    char cache_key[128];
+
+    if(req == NULL)
+    {
+	LOG_PRINT(LOG_INFO, "Request of Image[%s/%s] is Gone.", zimg_req->md5, zimg_req->rsp_name);
+	free(rd->buff);
+	goto done;
+    }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+
+    if(rd->ret == ZIMG_OK)
+    {
+	snprintf(cache_key, sizeof(cache_key), "img:%s:%d:%d:%d:%d", zimg_req->md5,
+		zimg_req->width, zimg_req->height, zimg_req->proportion, zimg_req->gray);
+	set_cache_bin(cache_key, rd->buff, rd->len);
+    }
+    if(rd->ret == ZIMG_OK && evbuffer_add_reference(req->buffer_out, rd->buff, rd->len,
+		release_img_buff, (void *)(intptr_t)BUFF_TYPE_MALLOC) == 0)
+    {
+	add_cache_headers(req, zimg_req);
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Accept-Ranges", "bytes", 0, 0));
+	send_reply(req, "jpg");
+    }
+    else
+    {
+	free(rd->buff);
+	evbuffer_add_printf(req->buffer_out, "<html><body><h1>404 Not Found!</h1></body></html>");
+	send_reply(req, "html");
+    }
+    evhtp_request_resume(req);
+
+done:
+    zimg_req_free(zimg_req);
+    free(rd);
+}
+
+/* on an I/O thread */
+static void doc_read_done(int ret, void *arg)
+{
+    doc_read_t *rd = (doc_read_t *)arg;
+
+    rd->ret = ret;
+    close(rd->zimg_req->rsp_fd);
+    rd->zimg_req->rsp_fd = -1;
+    if(aio_loop_post(rd->loop, doc_read_reply, rd) == ZIMG_ERR)
+	LOG_PRINT(LOG_ERROR, "Post Image[%s] to Loop Failed!", rd->zimg_req->md5);
+}
+
+/**
+ * @brief doc_read_start Read a stored image to be cached by async I/O and
+ * pause the request until it is read, so the thread goes on with other
+ * connections. Images not cached are sent by sendfile() instead.
+ *
+ * @param req The request.
+ * @param zimg_req The request of image with the fd, it belongs to the read
+ * if it is started.
+ * @param len The length of image.
+ *
+ * @return ZIMG_OK for started and ZIMG_ERR for fail.
+ */
+static int doc_read_start(evhtp_request_t *req, zimg_req_t *zimg_req, size_t len)
+{
+    doc_read_t *rd = (doc_read_t *)calloc(1, sizeof(doc_read_t));
+
+    if(rd == NULL || (rd->loop = aio_loop_get(req->conn->evbase)) == NULL
+	    || (rd->buff = (char *)malloc(len)) == NULL)
+    {
+	LOG_PRINT(LOG_ERROR, "Async Read of Image[%s] Start Failed!", zimg_req->md5);
+	free(rd);
+	return ZIMG_ERR;
+    }
+    rd->req = req;
+    rd->zimg_req = zimg_req;
+    rd->len = len;
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)doc_read_fini, rd);
+    evhtp_request_pause(req);
+    aio_op_t op = { AIO_READ, zimg_req->rsp_fd, rd->buff, len, zimg_req->rsp_off, doc_read_done, rd,
+	disk_queue(zimg_req->rsp_fd) };
+    if(aio_submit(&op, 1) == ZIMG_ERR)
+    {
+	LOG_PRINT(LOG_ERROR, "Async Read of Image[%s] Start Failed!", zimg_req->md5);
+	evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+	evhtp_request_resume(req);
+	free(rd->buff);
+	free(rd);
+	return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+static doc_save_t *doc_save_new(zimg_req_t *zimg_req, char *buff, size_t len)
+{
+    doc_save_t *save = (doc_save_t *)malloc(sizeof(doc_save_t));
+    if(save == NULL)
+	return NULL;
+    snprintf(save->md5, sizeof(save->md5), "%s", zimg_req->md5);
+    snprintf(save->name, sizeof(save->name), "%s", zimg_req->rsp_name);
+    save->buff = buff;
+    save->len = len;
+    save->buff_type = zimg_req->buff_type;
+    save->refs = 2;
+    return save;
+}
+
+/**
+ * @brief doc_save_release Release a new image held by the reply and by the
+ * saving, the last one frees it. It has the same type as
+ * evbuffer_ref_cleanup_cb.
+ */
+static void doc_save_release(const void *data, size_t len, void *arg)
+{
+    doc_save_t *save = (doc_save_t *)arg;
+    if(__sync_sub_and_fetch(&save->refs, 1) > 0)
+	return;
+    release_img_buff(save->buff, save->len, (void *)(intptr_t)save->buff_type);
+    free(save);
+}
+
+/* on an I/O thread */
+static void doc_saved(int ret, void *arg)
+{
+    doc_save_t *save = (doc_save_t *)arg;
+
+    if(ret == ZIMG_OK)
+	variant_add(save->md5, save->name, save->len);
+    else
+	LOG_PRINT(LOG_WARNING, "New Image[%s/%s] Save Failed!", save->md5, save->name);
+    doc_save_release(save->buff, save->len, save);
+}
+
+/**
+ * @brief parse_range Parse the byte ranges of a Range header, those past the
+ * end of the image are dropped and the others are cut to its end.
+ *
+ * @param value The value of the header, such as bytes=0-99,200-,-50.
+ * @param len The size of the image.
+ * @param start It gets the first byte of each range.
+ * @param end It gets the last byte of each range.
+ *
+ * @return The number of ranges kept, 0 if none of them can be sent, -1 if
+ * the header is bad or has more than RANGE_MAX ranges, so it is ignored.
+ */
+static int parse_range(const char *value, size_t len, off_t *start, off_t *end)
+{
+    const char *p;
+    char *q;
+    unsigned long long a, b;
+    int n = 0;
+
+    if(strncasecmp(value, "bytes=", 6) != 0)
+	return -1;
+    p = value + 6;
+    for(;;)
+    {
+	while(*p == ' ' || *p == '\t')
+	    p++;
+	if(*p == '-')
+	{
+	    //the last bytes
+	    if(!isdigit((unsigned char)p[1]))
+		return -1;
+	    b = strtoull(p + 1, &q, 10);
+	    a = b < len ? len - b : 0;
+	    b = len - 1;
+	    if(len == 0 || a > b)
+		a = len;
+	}
+	else
+	{
+	    if(!isdigit((unsigned char)*p))
+		return -1;
+	    a = strtoull(p, &q, 10);
+	    if(*q != '-')
+		return -1;
+	    p = q + 1;
+	    if(isdigit((unsigned char)*p))
+	    {
+		b = strtoull(p, &q, 10);
+		if(b < a)
+		    return -1;
+	    }
+	    else
+	    {
+		b = len - 1;
+		q = (char *)p;
+	    }
+	    if(b >= len)
+		b = len - 1;
+	}
+	if(a < len)
+	{
+	    if(n == RANGE_MAX)
+		return -1;
+	    start[n] = a;
+	    end[n] = b;
+	    n++;
+	}
+	p = q;
+	while(*p == ' ' || *p == '\t')
+	    p++;
+	if(*p == '\0')
+	    return n;
+	if(*p++ != ',')
+	    return -1;
+    }
+}
+
+/**
+ * @brief doc_range Answer a Range request of a stored image with 206. The
+ * ranges are sent from the file or the volume by sendfile(), the image is
+ * never read into memory.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image with its fd, the fd belongs to
+ * the reply if it is answered.
+ * @param len The size of the image.
+ *
+ * @return true if it is answered, false if the whole image should be sent.
  */
-void echo_cb(evhtp_request_t *req, void *arg)
+static bool doc_range(evhtp_request_t *req, zimg_req_t *zimg_req, size_t len)
 {
-    evbuffer_add_printf(req->buffer_out, "<html><body><h1>zimg works!</h1></body></html>");
-    send_reply(req,"html");
-}
-
-void phone_request_cb(evhtp_request_t *req, void *arg){
-    const char *phone_str = evhtp_kv_find(req->uri->query, "q"); 
-    if(phone_str == NULL){
-	evbuffer_add_printf(req->buffer_out, "{\"status\":-1}");
-	send_reply(req,"json");
+    const char *range = evhtp_header_find(req->headers_in, "Range");
+    const char *if_range = evhtp_header_find(req->headers_in, "If-Range");
+    off_t start[RANGE_MAX], end[RANGE_MAX];
+    char etag[192];
+    char content_range[96];
+    char boundary[32];
+    char type[80];
+    int i, n, fd;
+
+    if(range == NULL)
+	return false;
+    //a client having another version gets the whole image, only the strong
+    //ETag is kept by If-Range as there is no Last-Modified
+    if(if_range != NULL)
+    {
+	img_etag(zimg_req, etag, sizeof(etag));
+	if(strcmp(if_range, etag) != 0)
+	    return false;
     }
-  
-    size_t img_size;
-    char *p = get_phone_img(phone_str,&img_size);
-    if(p != NULL){
-	evbuffer_add(req->buffer_out, p, img_size);
-	free(p);
+    if((n = parse_range(range, len, start, end)) == -1)
+    {
+	LOG_PRINT(LOG_INFO, "Range[%s] Ignored.", range);
+	return false;
     }
 
-    send_reply(req,"jpg");
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", server_name, 0, 0));
+    if(n == 0)
+    {
+	LOG_PRINT(LOG_INFO, "Range[%s] of Image[%s/%s] Not Satisfiable.", range, zimg_req->md5, zimg_req->rsp_name);
+	close(zimg_req->rsp_fd);
+	zimg_req->rsp_fd = -1;
+	snprintf(content_range, sizeof(content_range), "bytes */%zu", len);
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Range", content_range, 0, 1));
+	evhtp_send_reply(req, EVHTP_RES_RANGENOTSC);
+	return true;
+    }
+
+    if(n == 1)
+    {
+	snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%zu",
+		(long long)start[0], (long long)end[0], len);
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Range", content_range, 0, 1));
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", guess_type("jpg"), 0, 0));
+    }
+    else
+    {
+	snprintf(boundary, sizeof(boundary), "zimg%08lx%08lx", random(), random());
+	snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s", boundary);
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", type, 0, 1));
+    }
+    for(i = 0; i < n; i++)
+    {
+	//each part owns an fd as evbuffer closes it after sending
+	fd = i == n - 1 ? zimg_req->rsp_fd : dup(zimg_req->rsp_fd);
+	if(i == n - 1)
+	    zimg_req->rsp_fd = -1;
+	if(n > 1)
+	    evbuffer_add_printf(req->buffer_out, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%zu\r\n\r\n",
+		    boundary, guess_type("jpg"), (long long)start[i], (long long)end[i], len);
+	if(fd == -1 || evbuffer_add_file(req->buffer_out, fd, zimg_req->rsp_off + start[i], end[i] - start[i] + 1) == -1)
+	{
+	    LOG_PRINT(LOG_ERROR, "evbuffer_add_file() of Range Failed!");
+	    if(zimg_req->rsp_fd != -1)
+		close(zimg_req->rsp_fd);
+	    zimg_req->rsp_fd = -1;
+	    evbuffer_drain(req->buffer_out, evbuffer_get_length(req->buffer_out));
+	    evhtp_send_reply(req, EVHTP_RES_SERVERR);
+	    return true;
+	}
+    }
+    if(n > 1)
+	evbuffer_add_printf(req->buffer_out, "\r\n--%s--\r\n", boundary);
+    add_cache_headers(req, zimg_req);
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Accept-Ranges", "bytes", 0, 0));
+    LOG_PRINT(LOG_INFO, "Send %d Ranges of Image[%s/%s].", n, zimg_req->md5, zimg_req->rsp_name);
+    evhtp_send_reply(req, EVHTP_RES_PARTIAL);
+    return true;
 }
 
 /**
- * @brief post_request_cb The callback function of a POST request to upload a image.
+ * @brief doc_serve Send the image got by get_img() as the reply of a GET
+ * request, and save it if it is a new variant.
  *
- * @param req The request with image buffer.
- * @param arg It is not useful.
+ * @param req The request.
+ * @param zimg_req The request of the image, it is freed.
+ * @param get_img_rst The return value of get_img().
+ * @param buff The image got by get_img().
+ * @param len The size of the image.
+ *
+ * @return true if the reply is sent later, after the image is read by async
+ * I/O.
  */
-void post_request_cb(evhtp_request_t *req, void *arg)
+static bool doc_serve(evhtp_request_t *req, zimg_req_t *zimg_req, int get_img_rst, char *buff, size_t len)
 {
-/**
-Sample Post Data
-Header:
-Content-Length:50108
-Content-Type:multipart/form-data; boundary=----WebKitFormBoundaryhIgUVzoG5V655hmr
-Body:
-------WebKitFormBoundaryhIgUVzoG5V655hmr
-Content-Disposition: form-data; name="userfile"; filename="t.png"\r\n
-Content-Type: image/png\r\n\r\n
-
-
-------WebKitFormBoundaryhIgUVzoG5V655hmr--
-*/
-
-    //statement here for common goto err
-    char *fileName = NULL;
-    char *buff = NULL;
-    char *boundaryPattern = NULL;
+    bool own_buff = true;
+    bool pending = false;
+    doc_save_t *save = NULL;
 
-    //eheck request method
-    int req_method = get_req_method(req);
-    if(req_method != htp_method_POST)
+    if(get_img_rst == -1)
     {
-	LOG_PRINT(LOG_INFO, "Request Method Not Support.");
+	LOG_PRINT(LOG_ERROR, "zimg Requset Get Image[MD5: %s] Failed!", zimg_req->md5);
 	goto err;
     }
 
-    const char *p = NULL;
-    const char *q = NULL;
-
-    //check Content-Length
-    p = evhtp_header_find(req->headers_in, "Content-Length");
-    if (p == NULL)
+    LOG_PRINT(LOG_INFO, "get buffer length: %d", len);
+    //a range of a stored image is sent from disk, never read by async I/O
+    if(zimg_req->rsp_fd != -1 && doc_range(req, zimg_req, len))
     {
-	LOG_PRINT(LOG_ERROR, "Content-Length error!");
-	goto err;
+	LOG_PRINT(LOG_INFO, "============send_document_cb() DONE!===============");
+	goto done;
     }
-    int post_size = atoi(p);
-
-    //check Content-Type
-    p = evhtp_header_find(req->headers_in, "Content-Type");
-    if (p == NULL)
+    //the bytes are only needed in memory to be cached, any other disk hit
+    //keeps the zero-copy sendfile() path
+    if(zimg_req->rsp_fd != -1 && aio_backend() != AIO_OFF && settings.cache_on && len < CACHE_MAX_SIZE)
     {
-	LOG_PRINT(LOG_ERROR, "Content-Type error!");
-	goto err;
+	//disk hit, the reply is sent when the async read is done
+	if(doc_read_start(req, zimg_req, len) == ZIMG_ERR)
+	    goto err;
+	zimg_req = NULL;
+	pending = true;
+	goto done;
     }
-
-    if(strstr(p, "multipart/form-data") == 0)
+    else if(zimg_req->rsp_fd != -1)
     {
-	LOG_PRINT(LOG_ERROR, "POST form error!");
-	goto err;
+	//disk hit, evbuffer sends it by sendfile() and closes the fd after that
+	if(evbuffer_add_file(req->buffer_out, zimg_req->rsp_fd, zimg_req->rsp_off, len) == -1)
+	{
+	    LOG_PRINT(LOG_ERROR, "evbuffer_add_file() Failed!");
+	    zimg_req->rsp_fd = -1;
+	    goto err;
+	}
+	zimg_req->rsp_fd = -1;
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Accept-Ranges", "bytes", 0, 0));
     }
-
-    p = strstr(p, "boundary=");
-    if(p == 0)
+    else
     {
-	LOG_PRINT(LOG_ERROR, "boundary NOT found!");
-	goto err;
+	//a new image is saved by async I/O after the reply, so both hold buff
+	if(get_img_rst == 2 && aio_backend() != AIO_OFF)
+	    save = doc_save_new(zimg_req, buff, len);
+	if((save && evbuffer_add_reference(req->buffer_out, buff, len, doc_save_release, save) == -1)
+		|| (!save && evbuffer_add_reference(req->buffer_out, buff, len, release_img_buff, (void *)(intptr_t)zimg_req->buff_type) == -1))
+	{
+	    LOG_PRINT(LOG_ERROR, "evbuffer_add_reference() Failed!");
+	    free(save);
+	    goto err;
+	}
+	//buff belongs to buffer_out now. It is only drained in the event loop
+	//after this callback returns, so it is still valid for new_img() below.
+	own_buff = false;
     }
 
-    //find the boundary
-    p += 9;
-    if (strlen(p)<= 0)
+    LOG_PRINT(LOG_INFO, "Got the File!");
+    add_cache_headers(req, zimg_req);
+    send_reply(req,"jpg");
+    LOG_PRINT(LOG_INFO, "============send_document_cb() DONE!===============");
+
+    if(save)
     {
-	LOG_PRINT(LOG_ERROR, "boundary length error!");
-	goto err;
+	if(new_img_async(zimg_req->md5, zimg_req->rsp_name, buff, len, doc_saved, save) == ZIMG_ERR)
+	{
+	    LOG_PRINT(LOG_WARNING, "New Image[%s/%s] Save Failed!", zimg_req->md5, zimg_req->rsp_name);
+	    doc_save_release(buff, len, save);
+	}
+    }
+    else if(get_img_rst == 2)
+    {
+	if(new_img(zimg_req->md5, zimg_req->rsp_name, buff, len) == ZIMG_ERR)
+	{
+	    LOG_PRINT(LOG_WARNING, "New Image[%s/%s] Save Failed!", zimg_req->md5, zimg_req->rsp_name);
+	}
+	else
+	    variant_add(zimg_req->md5, zimg_req->rsp_name, len);
     }
+    goto done;
+
+err:
+    evbuffer_add_printf(req->buffer_out, "<html><body><h1>404 Not Found!</h1></body></html>");
+    send_reply(req,"html");
+    LOG_PRINT(LOG_INFO, "============send_document_cb() ERROR!===============");
+
+done:
+    if(buff && own_buff)
+	release_img_buff(buff, len, (void *)(intptr_t)zimg_req->buff_type);
+    if(zimg_req)
+	zimg_req_free(zimg_req);
+    return pending;
+}
 
-    boundaryPattern = (char *)malloc(strlen(p) + 3);
+#define RENDER_QUEUED 0
+#define RENDER_RUNNING 1
+#define RENDER_EXPIRED 2        /* shed by the render queue when it is dequeued */
+#define RENDER_CANCELLED 3      /* shed by its timer, the job only frees it */
+
+/* a GET request waiting for its image rendered by the render queue */
+typedef struct doc_render_s {
+    evhtp_request_t *req;       /* NULL if the connection is closed meanwhile */
+    aio_loop_t *loop;
+    zimg_req_t *zimg_req;
+    struct event *timer;        /* fires when it waited render_wait() ms */
+    int state;
+    int ret;
+    char *buff;
+    size_t len;
+} doc_render_t;
 
-    memcpy(boundaryPattern,"--",2);
-    memcpy(boundaryPattern + 2,p,strlen(p));
-    boundaryPattern[strlen(p) + 2] = '\0';
-    LOG_PRINT(LOG_INFO, "boundary Find: boundary=%s", boundaryPattern + 4);
-    LOG_PRINT(LOG_INFO, "boundaryPattern = %s, strlen = %d", boundaryPattern, strlen(boundaryPattern));
+/**
+ * @brief doc_shed Answer a request which cannot be rendered in time with
+ * 503, the client may ask again after Retry-After.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image, it is freed.
+ */
+static void doc_shed(evhtp_request_t *req, zimg_req_t *zimg_req)
+{
+    char retry[16];
 
-    //copy evhtp buffer
-    evbuf_t *buf = req->buffer_in;
-    buff = (char *)malloc(post_size);
+    LOG_PRINT(LOG_WARNING, "Render of Image[%s/%s] is Shed.", zimg_req->md5, zimg_req->rsp_name);
+    snprintf(retry, sizeof(retry), "%d", render_retry_after());
+    evbuffer_add_printf(req->buffer_out, "<html><body><h1>503 Service Unavailable!</h1></body></html>");
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", server_name, 0, 0));
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", guess_type("html"), 0, 0));
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Retry-After", retry, 0, 1));
+    evhtp_send_reply(req, EVHTP_RES_SERVUNAVAIL);
+    zimg_req_free(zimg_req);
+}
 
-    int rmblen, evblen;
-    int img_size = 0;
+static evhtp_res doc_render_fini(evhtp_request_t *req, void *arg)
+{
+    ((doc_render_t *)arg)->req = NULL;
+    return EVHTP_RES_OK;
+}
 
-    if(evbuffer_get_length(buf) <= 0)
+/**
+ * @brief doc_render_reply Send the image rendered, it runs in the thread of
+ * the request. A new variant is still saved if the request is gone.
+ *
+ * @param arg The doc_render_t.
+ */
+static void doc_render_reply(void *arg)
+{
+    doc_render_t *rd = (doc_render_t *)arg;
+    zimg_req_t *zimg_req = rd->zimg_req;
+    evhtp_request_t *req = rd->req;
+
+    if(rd->timer)
+	event_free(rd->timer);
+    //the 503 was sent by the timer
+    if(rd->state == RENDER_CANCELLED)
+	goto done;
+    if(req == NULL)
     {
-	LOG_PRINT(LOG_ERROR, "Empty Request!");
-	goto err;
+	LOG_PRINT(LOG_INFO, "Request of Image[%s/%s] is Gone.", zimg_req->md5, zimg_req->rsp_name);
+	if(rd->buff && rd->ret == 2 && new_img(zimg_req->md5, zimg_req->rsp_name, rd->buff, rd->len) == ZIMG_OK)
+	    variant_add(zimg_req->md5, zimg_req->rsp_name, rd->len);
+	if(rd->buff)
+	    release_img_buff(rd->buff, rd->len, (void *)(intptr_t)zimg_req->buff_type);
+	zimg_req_free(zimg_req);
+	goto done;
     }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
 
-    while((evblen = evbuffer_get_length(buf)) > 0)
+    if(rd->state == RENDER_EXPIRED)
     {
-	LOG_PRINT(LOG_INFO, "evblen = %d", evblen);
-	rmblen = evbuffer_remove(buf, buff, evblen);
-	LOG_PRINT(LOG_INFO, "rmblen = %d", rmblen);
-	if(rmblen < 0)
-	{
-	    LOG_PRINT(LOG_ERROR, "evbuffer_remove failed!");
-	    goto err;
-	}
+	doc_shed(req, zimg_req);
+	evhtp_request_resume(req);
     }
+    //the request stays paused while its image is read by async I/O
+    else if(!doc_serve(req, zimg_req, rd->ret, rd->buff, rd->len))
+	evhtp_request_resume(req);
+
+done:
+    free(rd);
+}
+
+/* on a render thread */
+static void doc_render_job(bool expired, void *arg)
+{
+    doc_render_t *rd = (doc_render_t *)arg;
 
-    //find the fileName
-    p = strstr(buff,"filename=");
-    if (p == NULL)
+    //a job cancelled by its timer is not rendered, it is only freed in the
+    //thread of the request
+    if(!__sync_bool_compare_and_swap(&rd->state, RENDER_QUEUED, expired ? RENDER_EXPIRED : RENDER_RUNNING))
     {
-	LOG_PRINT(LOG_ERROR, "Content-Disposition Not Found!");
-	goto err;
+	if(aio_loop_post(rd->loop, doc_render_reply, rd) == ZIMG_ERR)
+	    LOG_PRINT(LOG_ERROR, "Post Cancelled Render to Loop Failed!");
+	return;
+    }
+    if(!expired)
+	rd->ret = get_img(rd->zimg_req, &rd->buff, &rd->len);
+    if(aio_loop_post(rd->loop, doc_render_reply, rd) == ZIMG_ERR)
+	LOG_PRINT(LOG_ERROR, "Post Image[%s/%s] to Loop Failed!", rd->zimg_req->md5, rd->zimg_req->rsp_name);
+}
+
+/* the render waited too long in the queue, shed it now rather than when a
+ * render thread gets to it */
+static void doc_render_timeout(evutil_socket_t fd, short what, void *arg)
+{
+    doc_render_t *rd = (doc_render_t *)arg;
+    evhtp_request_t *req = rd->req;
+
+    if(!__sync_bool_compare_and_swap(&rd->state, RENDER_QUEUED, RENDER_CANCELLED))
+	return;
+    if(req == NULL)
+    {
+	zimg_req_free(rd->zimg_req);
+	return;
     }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+    rd->req = NULL;
+    doc_shed(req, rd->zimg_req);
+    evhtp_request_resume(req);
+}
+
+/**
+ * @brief doc_render Render an image by the render queue and pause the
+ * request until it is done, or answer 503 at once if the queue is full, or
+ * when it waits longer than render_wait() ms.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image, it is freed.
+ *
+ * @return true if the reply is sent later.
+ */
+static bool doc_render(evhtp_request_t *req, zimg_req_t *zimg_req)
+{
+    doc_render_t *rd = (doc_render_t *)calloc(1, sizeof(doc_render_t));
 
-    p += 9;
-    if(p[0] == '\"')
+    if(rd == NULL || (rd->loop = aio_loop_get(req->conn->evbase)) == NULL)
     {
-	p++;
-	q = strstr(p,"\"");
+	free(rd);
+	doc_shed(req, zimg_req);
+	return false;
     }
-    else
+    rd->req = req;
+    rd->zimg_req = zimg_req;
+    rd->state = RENDER_QUEUED;
+    if(render_wait() > 0 && (rd->timer = evtimer_new(req->conn->evbase, doc_render_timeout, rd)) != NULL)
     {
-	q = strstr(p,"\r\n");
+	struct timeval tv;
+	tv.tv_sec = render_wait() / 1000;
+	tv.tv_usec = (render_wait() % 1000) * 1000;
+	//without the timer the render queue still sheds it when dequeued
+	if(evtimer_add(rd->timer, &tv) == -1)
+	{
+	    event_free(rd->timer);
+	    rd->timer = NULL;
+	}
     }
-
-    if(q == NULL)
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)doc_render_fini, rd);
+    evhtp_request_pause(req);
+    if(render_submit(doc_render_job, rd) == ZIMG_ERR)
     {
-	LOG_PRINT(LOG_ERROR, "quote \" or \\r\\n Not Found!");
-	goto err;
+	evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+	if(rd->timer)
+	    event_free(rd->timer);
+	free(rd);
+	doc_shed(req, zimg_req);
+	evhtp_request_resume(req);
+	return false;
     }
+    return true;
+}
 
-    fileName = (char *)malloc((q - p)+ 1);
-    memcpy(fileName, p, q - p);
-    fileName[q - p] = '\0';
-    LOG_PRINT(LOG_INFO, "fileName = %s", fileName);
+/* a GET request waiting for a variant from the node holding it */
+typedef struct peer_fetch_s {
+    evhtp_request_t *req;       /* NULL if the connection is closed meanwhile */
+    zimg_req_t *zimg_req;
+} peer_fetch_t;
 
-    //check file extension
-    char fileExt[32];
-    if(get_ext(fileName, fileExt) == -1)
-    {
-	LOG_PRINT(LOG_ERROR, "Get Type of File[%s] Failed!", fileName);
-	goto err;
-    }
+static evhtp_res peer_fetch_fini(evhtp_request_t *req, void *arg)
+{
+    ((peer_fetch_t *)arg)->req = NULL;
+    return EVHTP_RES_OK;
+}
 
-    if(is_img(fileExt) != 1)
+/**
+ * @brief peer_fetched Send the variant got from its holder, or render it
+ * here if the holder does not send it in time. It runs in the thread of the
+ * request.
+ *
+ * @param status The status of the reply, 0 if the holder is not reached.
+ * @param headers The headers of the reply.
+ * @param body The body of the reply.
+ * @param arg The peer_fetch_t.
+ */
+static void peer_fetched(int status, struct evkeyvalq *headers, struct evbuffer *body, void *arg)
+{
+    peer_fetch_t *pf = (peer_fetch_t *)arg;
+    evhtp_request_t *req = pf->req;
+    zimg_req_t *zimg_req = pf->zimg_req;
+    const char *type = headers ? evhttp_find_header(headers, "Content-Type") : NULL;
+    char cache_key[128];
+    char *buff = NULL;
+    size_t len = 0;
+    int get_img_rst;
+
+    //a holder without the variant replies a html page
+    bool hit = status == EVHTP_RES_OK && type != NULL && strncmp(type, "image/", 6) == 0;
+    cluster_fetched(hit);
+    if(req == NULL)
     {
-	LOG_PRINT(LOG_ERROR, "fileExt[%s] is Not Supported!", fileExt);
-	goto err;
+	LOG_PRINT(LOG_INFO, "Request of Image[%s/%s] is Gone.", zimg_req->md5, zimg_req->rsp_name);
+	zimg_req_free(zimg_req);
+	goto done;
     }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
 
-    p = q + 2;
-    //check Content-Type in body
-    if(strstr(p,"Content-Type") == NULL)
+    if(hit)
     {
-	LOG_PRINT(LOG_ERROR, "Content-Type Not Found!");
-	goto err;
+	LOG_PRINT(LOG_INFO, "Got Image[%s/%s] from Its Holder.", zimg_req->md5, zimg_req->rsp_name);
+	len = evbuffer_get_length(body);
+	if(settings.cache_on && len < CACHE_MAX_SIZE && (buff = (char *)evbuffer_pullup(body, -1)) != NULL)
+	{
+	    snprintf(cache_key, sizeof(cache_key), "img:%s:%d:%d:%d:%d", zimg_req->md5,
+		    zimg_req->width, zimg_req->height, zimg_req->proportion, zimg_req->gray);
+	    set_cache_bin(cache_key, buff, len);
+	}
+	peer_reply(req, status, headers, body);
+	zimg_req_free(zimg_req);
+	evhtp_request_resume(req);
+	goto done;
     }
 
-    q = strstr(p,"\r\n");
-    if(p == NULL)
+    LOG_PRINT(LOG_INFO, "Holder Has No Image[%s/%s], Render it.", zimg_req->md5, zimg_req->rsp_name);
+    if(render_on())
     {
-	LOG_PRINT(LOG_ERROR, "Content-Type ERROR!");
-	goto err;
+	doc_render(req, zimg_req);
+	goto done;
     }
-    //\r\n\r\n
-    p = q + 4;
+    get_img_rst = get_img(zimg_req, &buff, &len);
+    //the request stays paused while its image is read by async I/O
+    if(!doc_serve(req, zimg_req, get_img_rst, buff, len))
+	evhtp_request_resume(req);
+
+done:
+    free(pf);
+}
 
-    //the following is binary data,you CAN NOT use string function which is not binary safe!
-    int m = kmp(p,post_size + (p - buff),boundaryPattern,strlen(boundaryPattern));
-    q = p + m;
-    if(q == NULL)
+/**
+ * @brief peer_fetch_start Ask the node holding a variant for it before it is
+ * rendered, the request is paused until the holder replies or
+ * settings.peer_fetch ms pass.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image, it belongs to the fetch if it is
+ * started.
+ * @param peer The holder.
+ *
+ * @return ZIMG_OK for started and ZIMG_ERR for fail.
+ */
+static int peer_fetch_start(evhtp_request_t *req, zimg_req_t *zimg_req, int peer)
+{
+    peer_fetch_t *pf;
+    char uri[1024];
+
+    if((pf = (peer_fetch_t *)calloc(1, sizeof(peer_fetch_t))) == NULL)
+	return ZIMG_ERR;
+    pf->req = req;
+    pf->zimg_req = zimg_req;
+    req_uri(req, uri, sizeof(uri));
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)peer_fetch_fini, pf);
+    evhtp_request_pause(req);
+    if(cluster_request(req->conn->evbase, peer, EVHTTP_REQ_GET, uri, NULL, NULL, settings.peer_fetch, peer_fetched, pf) == ZIMG_ERR)
     {
-	LOG_PRINT(LOG_ERROR, "Image Not complete!");
-	goto err;
+	evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+	evhtp_request_resume(req);
+	free(pf);
+	return ZIMG_ERR;
     }
-    img_size = q - p - 2;
+    LOG_PRINT(LOG_INFO, "Ask Node[%s] for Image[%s/%s].", cluster_peer(peer)->name, zimg_req->md5, zimg_req->rsp_name);
+    return ZIMG_OK;
+}
 
+/**
+ * @brief doc_head Answer a HEAD request of an image from the stored file or
+ * the cache, it is never read from disk or rendered. A variant not made yet
+ * is answered as not found, its length is unknown until a GET makes it.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image with its rsp_name.
+ */
+static void doc_head(evhtp_request_t *req, zimg_req_t *zimg_req)
+{
+    char cache_key[128];
+    char length[32];
+    char *buff = NULL;
+    size_t len = 0;
+    int fd = -1;
+    off_t off;
 
-    LOG_PRINT(LOG_INFO, "post_size = %d", post_size);
-    LOG_PRINT(LOG_INFO, "img_size = %d", img_size);
-    if(img_size <= 0)
+    if(open_img(zimg_req->md5, zimg_req->rsp_name, &fd, &off, &len) == ZIMG_OK)
     {
-	LOG_PRINT(LOG_ERROR, "Image Size is Zero!");
-	goto err;
+	close(fd);
+	evhtp_headers_add_header(req->headers_out, evhtp_header_new("Accept-Ranges", "bytes", 0, 0));
     }
+    else
+    {
+	snprintf(cache_key, sizeof(cache_key), "img:%s:%d:%d:%d:%d", zimg_req->md5,
+		zimg_req->width, zimg_req->height, zimg_req->proportion, zimg_req->gray);
+	if(!settings.cache_on || find_cache_bin(cache_key, &buff, &len) != 1)
+	{
+	    LOG_PRINT(LOG_INFO, "Image[%s/%s] of HEAD Not Found.", zimg_req->md5, zimg_req->rsp_name);
+	    evbuffer_add_printf(req->buffer_out, "<html><body><h1>404 Not Found!</h1></body></html>");
+	    send_reply(req, "html");
+	    return;
+	}
+	free(buff);
+    }
+    LOG_PRINT(LOG_INFO, "HEAD of Image[%s/%s], len: %zu.", zimg_req->md5, zimg_req->rsp_name, len);
+    snprintf(length, sizeof(length), "%zu", len);
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Length", length, 0, 1));
+    add_cache_headers(req, zimg_req);
+    send_reply(req, "jpg");
+}
 
-    char md5sum[33];
-
-    LOG_PRINT(LOG_INFO, "Begin to Save Image...");
-    if(save_img(p, img_size, md5sum) == -1)
+/**
+ * @brief doc_get Answer a GET of an image from the cache or the disk, or
+ * from the node holding it, or by rendering it.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image, it is freed.
+ *
+ * @return true if the reply is sent later, or the request is resumed by the
+ * render queue.
+ */
+static bool doc_get(evhtp_request_t *req, zimg_req_t *zimg_req)
+{
+    char *buff = NULL;
+    size_t len = 0;
+    int peer;
+
+    //a variant not stored here is asked from the node holding it before it
+    //is rendered again, and it is rendered by the render queue if there is
+    //one, so the cache and the disk are looked up first
+    bool ask_holder = settings.peer_fetch > 0 && cluster_on()
+	&& evhtp_header_find(req->headers_in, CLUSTER_HEADER) == NULL;
+    zimg_req -> stored_only = ask_holder || render_on();
+    int get_img_rst = get_img(zimg_req, &buff, &len);
+    zimg_req -> stored_only = false;
+    if(get_img_rst == IMG_NOT_STORED)
     {
-	LOG_PRINT(LOG_ERROR, "Image Save Failed!");
-	goto err;
+	if(ask_holder && (peer = cluster_holder(zimg_req->md5, zimg_req->rsp_name)) != -1 && peer_fetch_start(req, zimg_req, peer) == ZIMG_OK)
+	    return true;
+	if(render_on())
+	{
+	    doc_render(req, zimg_req);
+	    return true;
+	}
+	get_img_rst = get_img(zimg_req, &buff, &len);
     }
+    return doc_serve(req, zimg_req, get_img_rst, buff, len);
+}
 
-    LOG_PRINT(LOG_INFO, "============post_request_cb() OK!===============");
-    evbuffer_add_printf(req->buffer_out, "{\"status\":0,\"picture\":%s}",md5sum);
-    goto done;
+/* a GET request waiting for its original from the origin */
+typedef struct origin_wait_s {
+    evhtp_request_t *req;       /* NULL if the connection is closed meanwhile */
+    zimg_req_t *zimg_req;
+} origin_wait_t;
 
-err:
-    LOG_PRINT(LOG_INFO, "============post_request_cb() ERROR!===============");
-    evbuffer_add_printf(req->buffer_out, "{\"status\":-1}"); 
+static evhtp_res origin_wait_fini(evhtp_request_t *req, void *arg)
+{
+    ((origin_wait_t *)arg)->req = NULL;
+    return EVHTP_RES_OK;
+}
 
-done:
-    send_reply(req,"json");
+/**
+ * @brief origin_fetched Go on with a request when the fetch of its original
+ * is done, it runs in the thread of the request. If the fetch failed, the
+ * request is answered as not found.
+ *
+ * @param ret ZIMG_OK if the original is stored.
+ * @param arg The origin_wait_t.
+ */
+static void origin_fetched(int ret, void *arg)
+{
+    origin_wait_t *ow = (origin_wait_t *)arg;
+    evhtp_request_t *req = ow->req;
+    zimg_req_t *zimg_req = ow->zimg_req;
 
-    //clean up
-    if(fileName != NULL)
+    if(req == NULL)
     {
-	free(fileName);
+	LOG_PRINT(LOG_INFO, "Request of Image[%s/%s] is Gone.", zimg_req->md5, zimg_req->rsp_name);
+	zimg_req_free(zimg_req);
+	goto done;
     }
+    evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+    if(!doc_get(req, zimg_req))
+	evhtp_request_resume(req);
 
-    if(boundaryPattern != NULL)
-    {
-	free(boundaryPattern);
-    }
+done:
+    free(ow);
+}
 
-    if(buff != NULL)
+/**
+ * @brief origin_wait_start Get the missing original of a request from the
+ * origin, the request is paused until the fetch thread is done.
+ *
+ * @param req The request.
+ * @param zimg_req The request of the image, it belongs to the fetch if it is
+ * started.
+ *
+ * @return ZIMG_OK for started and ZIMG_ERR for fail.
+ */
+static int origin_wait_start(evhtp_request_t *req, zimg_req_t *zimg_req)
+{
+    origin_wait_t *ow;
+
+    if((ow = (origin_wait_t *)calloc(1, sizeof(origin_wait_t))) == NULL)
+	return ZIMG_ERR;
+    ow->req = req;
+    ow->zimg_req = zimg_req;
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)origin_wait_fini, ow);
+    evhtp_request_pause(req);
+    //the reply is posted to this thread, so it comes after the pause
+    if(origin_fetch(zimg_req->md5, aio_loop_get(req->conn->evbase), origin_fetched, ow) == ZIMG_ERR)
     {
-	free(buff);
+	evhtp_unset_hook(&req->hooks, evhtp_hook_on_request_fini);
+	evhtp_request_resume(req);
+	free(ow);
+	return ZIMG_ERR;
     }
-
+    return ZIMG_OK;
 }
 
-
 /**
  * @brief send_document_cb The callback function of get a image request.
  *
@@ -432,9 +1838,8 @@ done:
 void send_document_cb(evhtp_request_t *req, void *arg)
 {
     char *md5 = NULL;
-    size_t len;
     zimg_req_t *zimg_req = NULL;
-    char *buff = NULL;
+    int peer;
 
     int req_method = get_req_method(req);
     if(req_method == htp_method_POST){
@@ -442,7 +1847,7 @@ void send_document_cb(evhtp_request_t *req, void *arg)
 	post_request_cb(req, NULL);
 	return;
     }
-    else if(req_method != htp_method_GET)
+    else if(req_method != htp_method_GET && req_method != htp_method_HEAD)
     {
 	LOG_PRINT(LOG_INFO, "Request Method Not Support.");
 	goto err;
@@ -512,6 +1917,7 @@ void send_document_cb(evhtp_request_t *req, void *arg)
 	LOG_PRINT(LOG_WARNING, "Url is Not a zimg Request.");
 	goto err;
     }
+
     /* This holds the content we're sending. */
 
     int width, height, proportion, gray;
@@ -566,35 +1972,48 @@ void send_document_cb(evhtp_request_t *req, void *arg)
     }
 
     zimg_req = (zimg_req_t *)malloc(sizeof(zimg_req_t)); 
+    zimg_req -> rsp_name[0] = '\0';
+    zimg_req -> rsp_fd = -1;
+    zimg_req -> rsp_off = 0;
+    zimg_req -> buff_type = BUFF_TYPE_MALLOC;
     zimg_req -> md5 = md5;
     zimg_req -> width = width;
     zimg_req -> height = height;
     zimg_req -> proportion = proportion;
     zimg_req -> gray = gray;
+    img_name(zimg_req);
 
-    int get_img_rst = get_img(zimg_req, &buff,  &len);
+    //the name of the variant is its tag, a client having it needs nothing
+    //from the cache, the disk or the wand
+    if(not_modified(req, zimg_req))
+	goto done;
 
-    if(get_img_rst == -1)
+    //an image owned by another node is answered by it, unless it is here
+    if(cluster_on() && evhtp_header_find(req->headers_in, CLUSTER_HEADER) == NULL
+	    && (peer = cluster_owner(md5)) != -1 && exist_img(md5, "0*0p") == 0)
     {
-	LOG_PRINT(LOG_ERROR, "zimg Requset Get Image[MD5: %s] Failed!", zimg_req->md5);
-	goto err;
+	char peer_uri[1024];
+	req_uri(req, peer_uri, sizeof(peer_uri));
+	if(peer_route(req, peer, req_method == htp_method_HEAD ? EVHTTP_REQ_HEAD : EVHTTP_REQ_GET,
+		    peer_uri, NULL, NULL) == ZIMG_ERR)
+	    goto err;
+	goto done;
     }
 
-    LOG_PRINT(LOG_INFO, "get buffer length: %d", len);
-    evbuffer_add(req->buffer_out, buff, len);
-
-    LOG_PRINT(LOG_INFO, "Got the File!");
-    send_reply(req,"jpg");
-    LOG_PRINT(LOG_INFO, "============send_document_cb() DONE!===============");
-
-    if(get_img_rst == 2)
+    //HEAD is answered by what is known of the image, it is never rendered
+    if(req_method == htp_method_HEAD)
     {
-	if(new_img(buff, len, zimg_req->rsp_path) == ZIMG_ERR)
-	{
-	    LOG_PRINT(LOG_WARNING, "New Image[%s] Save Failed!", zimg_req->rsp_path);
-	}
+	doc_head(req, zimg_req);
+	goto done;
     }
-    goto done;
+
+    //a missing original is got from the origin by a fetch thread, the
+    //request waits for it paused instead of blocking this thread
+    if(origin_on() && exist_img(md5, zimg_req->rsp_name) == 0 && exist_img(md5, "0*0p") == 0
+	    && origin_wait_start(req, zimg_req) == ZIMG_OK)
+	return;
+    doc_get(req, zimg_req);
+    return;
 
 err:
     evbuffer_add_printf(req->buffer_out, "<html><body><h1>404 Not Found!</h1></body></html>");
@@ -602,15 +2021,9 @@ err:
     LOG_PRINT(LOG_INFO, "============send_document_cb() ERROR!===============");
 
 done:
-    if(buff)
-	free(buff);
     if(zimg_req)
-    {
-	if(zimg_req->md5)
-	    free(zimg_req->md5);
-	if(zimg_req->rsp_path)
-	    free(zimg_req->rsp_path);
-	free(zimg_req);
-    }
+	zimg_req_free(zimg_req);
+    else
+	free(md5);
 }
 
@@ -25,9 +25,13 @@
 #include <evhtp.h>
 #include "zcommon.h"
 
+#define RANGE_MAX 16                    /* ranges of a request at most, the whole image is sent for more */
+
 void dump_request_cb(evhtp_request_t *req, void *arg);
 void echo_cb(evhtp_request_t *req, void *arg);
+void status_request_cb(evhtp_request_t *req, void *arg);
 void post_request_cb(evhtp_request_t *req, void *arg);
+void batch_request_cb(evhtp_request_t *req, void *arg);
 void send_document_cb(evhtp_request_t *req, void *arg);
 void phone_request_cb(evhtp_request_t *req, void *arg);
 
@@ -22,17 +22,32 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
 #include <wand/MagickWand.h>
 #include "zimg.h"
 #include "zmd5.h"
 #include "zlog.h"
 #include "zcache.h"
 #include "zutil.h"
+#include "zwand.h"
+#include "zvolume.h"
+#include "zdir.h"
+#include "zvariant.h"
+#include "zaio.h"
+#include "zcommit.h"
+#include "ztier.h"
+#include "zdisk.h"
+#include "zorigin.h"
 
 extern struct setting settings;
 
+//glyphs of phone numbers, rendered by phone_atlas_init()
+static const char *phone_charset = "0123456789+-()";
+static unsigned char *phone_atlas = NULL;
+
 const char *get_img_format(const char *buff){
     if(buff == NULL){
 	return NULL;
@@ -52,21 +67,15 @@ const char *get_img_format(const char *buff){
     return NULL;
 }
 
-void calc_md5sum(const char *buff,const int len,char *md5sum){
-    if(buff == NULL || md5sum == NULL){
-	return;
-    }
-
-    LOG_PRINT(LOG_INFO, "Begin to Caculate MD5...");
-    md5_state_t mdctx;
-    md5_byte_t md_value[16];
-
+/**
+ * @brief md5_to_str Print a md5 digest as a 32 chars lowercase hex string.
+ *
+ * @param md_value The digest.
+ * @param md5sum It gets the string, 33 bytes at least.
+ */
+void md5_to_str(const unsigned char *md_value, char *md5sum){
     int i;
     int h, l;
-    md5_init(&mdctx);
-    md5_append(&mdctx, (const unsigned char*)(buff), len);
-    md5_finish(&mdctx, md_value);
-
     for(i=0; i<16; ++i)
     {
 	h = md_value[i] & 0xf0;
@@ -76,87 +85,238 @@ void calc_md5sum(const char *buff,const int len,char *md5sum){
 	md5sum[i * 2 + 1] = (char)((l >= 0x0 && l <= 0x9) ? (l + 0x30) : (l + 0x57));
     }
     md5sum[32] = '\0';
-    LOG_PRINT(LOG_INFO, "md5: %s", md5sum);
 }
 
-int convert2jpg(const char *buff, const int len,const char *path){
-    //http://members.shaw.ca/el.supremo/MagickWand/resize.htm
-    //MagickGetImageFormat
-    MagickWand *m_wand = NULL;
+int calc_md5sum(const char *buff,const int len,char *md5sum){
+    if(buff == NULL || md5sum == NULL){
+	return ZIMG_ERR;
+    }
 
-    m_wand = NewMagickWand();
+    LOG_PRINT(LOG_INFO, "Begin to Caculate MD5...");
+    md5_state_t mdctx;
+    md5_byte_t md_value[16];
+
+    if(md5_init(&mdctx) == -1){
+	LOG_PRINT(LOG_ERROR, "MD5 Init Failed!");
+	return ZIMG_ERR;
+    }
+    md5_append(&mdctx, (const unsigned char*)(buff), len);
+    if(md5_finish(&mdctx, md_value) == -1){
+	LOG_PRINT(LOG_ERROR, "MD5 Caculate Failed!");
+	return ZIMG_ERR;
+    }
+
+    md5_to_str(md_value, md5sum);
+    LOG_PRINT(LOG_INFO, "md5: %s", md5sum);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief store_jpg Strip a read image, encode it as JPEG and store it as the
+ * 0.jpg of an image.
+ *
+ * @param m_wand The wand with the image.
+ * @param md5 The md5 of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int store_jpg(MagickWand *m_wand, const char *md5){
+    size_t len = 0;
+    int ret = ZIMG_ERR;
 
-    MagickReadImageBlob(m_wand, buff, len);
-    
     //strip exif,GPS data
     MagickStripImage(m_wand);
 
     // Set the compression quality to 75 (high quality = low compression)
     MagickSetImageCompressionQuality(m_wand,75);
+    MagickSetImageFormat(m_wand, "JPEG");
+
+    char *blob = (char *)MagickGetImageBlob(m_wand, &len);
+    if(blob != NULL){
+	ret = new_img(md5, "0.jpg", blob, len);
+	MagickRelinquishMemory(blob);
+    }
+    return ret;
+}
+
+int convert2jpg(const char *buff, const int len, const char *md5){
+    //http://members.shaw.ca/el.supremo/MagickWand/resize.htm
+    //MagickGetImageFormat
+    MagickWand *m_wand = NULL;
+    int ret = ZIMG_ERR;
 
-    /* Write the new image */
-    MagickWriteImage(m_wand,path);
+    m_wand = get_magick_wand();
+
+    if(MagickReadImageBlob(m_wand, buff, len) == MagickTrue)
+	ret = store_jpg(m_wand, md5);
 
     /* Clean up */
-    if(m_wand)m_wand = DestroyMagickWand(m_wand);
+    put_magick_wand(m_wand);
 
-    return ZIMG_OK;
+    return ret;
 }
 
-char* get_phone_img(const char *phone_str, size_t *img_size){
-    if(phone_str == NULL){
-	return NULL;
-    }
+/**
+ * @brief convert_file2jpg Convert a image file to JPEG, it is used for the
+ * images which are too large to be kept in memory.
+ *
+ * @param src The path of the image.
+ * @param md5 The md5 of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int convert_file2jpg(const char *src, const char *md5){
+    MagickWand *m_wand = NULL;
+    int ret = ZIMG_ERR;
 
-    MagickWand *m_wand  = NULL;
-    PixelWand *p_wand  = NULL;
-    DrawingWand *d_wand = NULL;
+    m_wand = get_magick_wand();
 
+    if(MagickReadImage(m_wand, src) == MagickTrue)
+	ret = store_jpg(m_wand, md5);
 
-    /* Create a wand */
-    m_wand = NewMagickWand();
-    p_wand = NewPixelWand();
-    d_wand = NewDrawingWand();
+    put_magick_wand(m_wand);
 
-    PixelSetColor(p_wand,"white");
+    return ret;
+}
+
+/**
+ * @brief phone_atlas_init Render the glyphs of phone numbers once into an
+ * in-memory gray atlas. get_phone_img() builds images by copying them.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int phone_atlas_init(void)
+{
+    int i;
+    int len = strlen(phone_charset);
+    int width = len * PHONE_GLYPH_WIDTH;
+    char glyph[2] = {0, 0};
+    MagickBooleanType status;
 
-    int height = 18;
-    int width = strlen(phone_str) * 130 / 12;
+    MagickWand *m_wand = get_magick_wand();
+    PixelWand *p_wand = get_pixel_wand();
+    DrawingWand *d_wand = get_drawing_wand();
 
-    MagickNewImage(m_wand, width,height ,p_wand);
+    PixelSetColor(p_wand,"white");
+    MagickNewImage(m_wand, width, PHONE_HEIGHT, p_wand);
 
-    //draw number
     PixelSetColor(p_wand,"black");
     DrawSetFillColor(d_wand,p_wand);
     DrawSetFont (d_wand, "Arial" ) ;
     DrawSetFontSize(d_wand,20);
     DrawSetStrokeColor(d_wand,p_wand);
-    DrawAnnotation(d_wand,0,height -2,phone_str);
-    MagickDrawImage(m_wand,d_wand);
-    //MagickTrimImage(m_wand,0);
-    //ImageFormat MUST be SET,otherwise,otherwise we will not MagickGetImageBlob properly
-    MagickSetImageFormat(m_wand,"JPEG");
+    for(i = 0; i < len; i++)
+    {
+	glyph[0] = phone_charset[i];
+	DrawAnnotation(d_wand, i * PHONE_GLYPH_WIDTH, PHONE_HEIGHT - 2, (const unsigned char *)glyph);
+    }
+    status = MagickDrawImage(m_wand,d_wand);
+
+    unsigned char *atlas = NULL;
+    if(status == MagickTrue)
+	atlas = (unsigned char *)malloc(width * PHONE_HEIGHT);
+    if(atlas != NULL)
+	status = MagickExportImagePixels(m_wand, 0, 0, width, PHONE_HEIGHT, "I", CharPixel, atlas);
+
+    put_drawing_wand(d_wand);
+    put_magick_wand(m_wand);
+    put_pixel_wand(p_wand);
+
+    if(atlas == NULL || status == MagickFalse)
+    {
+	LOG_PRINT(LOG_ERROR, "Render Phone Glyph Atlas Failed!");
+	free(atlas);
+	return ZIMG_ERR;
+    }
+    phone_atlas = atlas;
+    LOG_PRINT(LOG_INFO, "Phone Glyph Atlas[%d glyphs] Rendered.", len);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief get_phone_img Get the JPEG image of a phone number. It is read from
+ * cache or built by copying the glyphs of the atlas, and then cached.
+ *
+ * @param phone_str The phone number.
+ * @param img_size It returns the size of the image.
+ * @param buff_type It returns the BUFF_TYPE_* of the image buffer.
+ *
+ * @return The image buffer, release it by release_img_buff(). NULL for fail.
+ */
+char* get_phone_img(const char *phone_str, size_t *img_size, int *buff_type){
+    if(phone_str == NULL || phone_atlas == NULL){
+	return NULL;
+    }
+
+    int i, y;
+    int len = strlen(phone_str);
+    if(len == 0 || len > PHONE_MAX_LEN){
+	LOG_PRINT(LOG_WARNING, "Phone[%s] Length Error!", phone_str);
+	return NULL;
+    }
+    for(i = 0; i < len; i++){
+	//make sure it is a valid memcached key
+	if(!isgraph((unsigned char)phone_str[i])){
+	    LOG_PRINT(LOG_WARNING, "Phone[%s] Has Illegal Char!", phone_str);
+	    return NULL;
+	}
+    }
 
-    char *p = NULL;
     char *data = NULL;
+    char cache_key[PHONE_MAX_LEN + 8];
+    sprintf(cache_key, "phone:%s", phone_str);
+    if(find_cache_bin(cache_key, &data, img_size) == 1){
+	LOG_PRINT(LOG_INFO, "Hit Phone Cache[Key: %s].", cache_key);
+	*buff_type = BUFF_TYPE_MALLOC;
+	return data;
+    }
 
-    p = (char *)MagickGetImageBlob(m_wand,img_size);
+    int height = PHONE_HEIGHT;
+    int width = len * PHONE_GLYPH_WIDTH;
+    int atlas_width = strlen(phone_charset) * PHONE_GLYPH_WIDTH;
+    unsigned char *pixels = (unsigned char *)malloc(width * height);
+    if(pixels == NULL){
+	LOG_PRINT(LOG_ERROR, "pixels Malloc Failed!");
+	return NULL;
+    }
 
-    if(p != NULL){
-	data = (char *)malloc(*img_size);
-	if(data != NULL){
-	    memcpy(data,p,*img_size);
-	}else{
-	    LOG_PRINT(LOG_INFO, "malloc Failed!");
+    //blit glyphs row by row, unknown chars are left blank
+    for(i = 0; i < len; i++){
+	const char *c = strchr(phone_charset, phone_str[i]);
+	unsigned char *dst = pixels + i * PHONE_GLYPH_WIDTH;
+	if(c == NULL){
+	    for(y = 0; y < height; y++)
+		memset(dst + y * width, 0xff, PHONE_GLYPH_WIDTH);
+	    continue;
 	}
-    }else{
+	const unsigned char *src = phone_atlas + (c - phone_charset) * PHONE_GLYPH_WIDTH;
+	for(y = 0; y < height; y++)
+	    memcpy(dst + y * width, src + y * atlas_width, PHONE_GLYPH_WIDTH);
+    }
+
+    MagickWand *m_wand = get_magick_wand();
+    if(MagickConstituteImage(m_wand, width, height, "I", CharPixel, pixels) == MagickFalse){
+	LOG_PRINT(LOG_ERROR, "MagickConstituteImage Failed!");
+	put_magick_wand(m_wand);
+	free(pixels);
+	return NULL;
+    }
+    //ImageFormat MUST be SET,otherwise,otherwise we will not MagickGetImageBlob properly
+    MagickSetImageFormat(m_wand,"JPEG");
+
+    //the encoder's buffer is returned as it is, release it by release_img_buff(BUFF_TYPE_MAGICK)
+    data = (char *)MagickGetImageBlob(m_wand,img_size);
+    if(data == NULL){
 	LOG_PRINT(LOG_INFO, "MagickGetImageBlob Failed!");
     }
-    
+    else{
+	*buff_type = BUFF_TYPE_MAGICK;
+	set_cache_bin(cache_key, data, *img_size);
+    }
+
     /* Tidy up */
-    MagickRelinquishMemory(p);
-    DestroyMagickWand(m_wand);
-    DestroyPixelWand(p_wand);
+    put_magick_wand(m_wand);
+    free(pixels);
 
     return data;
 }
@@ -179,7 +339,32 @@ int save_img(const char *buff, const int len, char *md5sum){
 	return ZIMG_ERR;
     }
 
-    calc_md5sum(buff,len,md5sum);
+    //never store an image under an md5 which is not its own
+    if(calc_md5sum(buff,len,md5sum) == ZIMG_ERR){
+	return ZIMG_ERR;
+    }
+
+    return save_img_with_md5(buff, len, md5sum);
+}
+
+/**
+ * @brief save_img_with_md5 Save buffer whose md5 has been caculated, such as
+ * it is hashed while the request is received.
+ *
+ * @param buff The char * from POST request
+ * @param len The length of buff
+ * @param md5sum The md5 of buff
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail
+ */
+int save_img_with_md5(const char *buff, const int len, const char *md5sum){
+    if(buff == NULL || md5sum == NULL || len <=0){
+	return ZIMG_ERR;
+    }
+
+    if(get_img_format(buff) == NULL){
+	return ZIMG_ERR;
+    }
 
     char cache_key[45];
     sprintf(cache_key, "img:%s:0:0:1:0", md5sum);
@@ -191,18 +376,7 @@ int save_img(const char *buff, const int len, char *md5sum){
 
     LOG_PRINT(LOG_INFO, "exist_cache not found. Begin to Check File.");
 
-    char *save_path = (char *)malloc(512);
-    if(save_path == NULL){
-	return ZIMG_ERR;
-    }
-    //caculate 2-level path
-    int lvl1 = str_hash(md5sum);
-    int lvl2 = str_hash(md5sum + 3);
-
-    sprintf(save_path, "%s/%d/%d/%s/0*0p", settings.img_path, lvl1, lvl2, md5sum);
-    LOG_PRINT(LOG_INFO, "save_path: %s", save_path);
-
-    if(is_file(save_path) == ZIMG_OK){
+    if(exist_img(md5sum, "0*0p") == 1){
 	LOG_PRINT(LOG_INFO, "Check File Exist. Needn't Save.");
 	//cache
 	if(len < CACHE_MAX_SIZE)
@@ -210,58 +384,438 @@ int save_img(const char *buff, const int len, char *md5sum){
 	    // to gen cache_key like this: rsp_path-/926ee2f570dc50b2575e35a6712b08ce
 	    set_cache_bin(cache_key, buff, len);
 	}
-	free(save_path);
 	return ZIMG_OK;
-    }else{
-	char *p = strrchr(save_path,'/');
-	*p = '\0';
-	if(mk_dirs(save_path) == ZIMG_ERR){
-	    LOG_PRINT(LOG_ERROR, "save_path[%s] Create Failed!", save_path);
-	    free(save_path);
-	    return ZIMG_ERR;
-	}
+    }
 
-	chdir(_init_path);
-	LOG_PRINT(LOG_INFO, "save_path[%s] Create Finish.", save_path);
+    if(new_img(md5sum, "0*0p", buff, len) != ZIMG_OK){
+	LOG_PRINT(LOG_WARNING, "Save Image[%s] Failed!", md5sum);
+	return ZIMG_ERR;
+    }
 
-	*p = '/';
-	LOG_PRINT(LOG_INFO, "save_name-->: %s", save_path);
+    //shrink as JPEG
+    if(convert2jpg(buff, len, md5sum) == ZIMG_OK){
+	LOG_PRINT(LOG_WARNING, "Convert Image[%s] to JPEG OK!", md5sum);
+    }
 
-	if(new_img(buff, len, save_path) != ZIMG_OK){
-	    LOG_PRINT(LOG_WARNING, "Save Image[%s] Failed!", save_path);
-	    free(save_path);
-	    return ZIMG_ERR;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief save_img_file Save an uploaded image which has been spilled to a
+ * temp file. The temp file is moved into the storage, so it must be in the
+ * same file system as img_path.
+ *
+ * @param tmp_path The temp file, it is moved or removed.
+ * @param md5sum The md5 of the image
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail
+ */
+int save_img_file(const char *tmp_path, const char *md5sum){
+    if(tmp_path == NULL || md5sum == NULL){
+	return ZIMG_ERR;
+    }
+
+    char cache_key[45];
+    sprintf(cache_key, "img:%s:0:0:1:0", md5sum);
+
+    if(exist_cache(cache_key) == 1 || exist_img(md5sum, "0*0p") == 1){
+	LOG_PRINT(LOG_INFO, "File Exist, Needn't Save.");
+	unlink(tmp_path);
+	return ZIMG_OK;
+    }
+
+    //shrink as JPEG before the temp file is moved
+    if(convert_file2jpg(tmp_path, md5sum) == ZIMG_OK){
+	LOG_PRINT(LOG_WARNING, "Convert Image[%s] to JPEG OK!", md5sum);
+    }
+
+    if(new_img_file(md5sum, "0*0p", tmp_path) != ZIMG_OK){
+	LOG_PRINT(LOG_WARNING, "Save Image[%s] Failed!", md5sum);
+	return ZIMG_ERR;
+    }
+
+    return ZIMG_OK;
+}
+
+/**
+ * @brief is_durable Check an image must be committed before it is
+ * acknowledged. Only the original one is, the others can be made again, as
+ * can an original got from the origin.
+ *
+ * @param name The name of the image.
+ *
+ * @return true for durable.
+ */
+static bool is_durable(const char *name){
+    return commit_on() && !origin_on() && strcmp(name, "0*0p") == 0;
+}
+
+/**
+ * @brief img_dir Open the lvl2 directory of an image from the cache, such
+ * as img_path/lvl1/lvl2, and get the path of the image relative to it.
+ *
+ * @param root The root of the directory, from disk_roots().
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant, such as 0*0p.
+ * @param create Make the directories of the image if they do not exist.
+ * @param dir It gets the directory, release it by dir_close().
+ * @param rel It gets the relative path md5/name, 512 bytes at least.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int img_dir(int root, const char *md5, const char *name, bool create, zdir_t *dir, char *rel){
+    snprintf(rel, 512, "%s/%s", md5, name);
+    if(dir_open_root(root, md5, create, dir) == ZIMG_ERR){
+	if(create)
+	    LOG_PRINT(LOG_ERROR, "Dir of Image[%s] Create Failed!", rel);
+	return ZIMG_ERR;
+    }
+    if(create && mkdirat(dir->fd, md5, 00755) == -1 && errno != EEXIST){
+	LOG_PRINT(LOG_ERROR, "Dir of Image[%s] Create Failed!", rel);
+	dir_close(dir);
+	return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief img_root Get the root a new image is written to, its disk or
+ * img_path.
+ */
+static int img_root(const char *md5){
+    int roots[DISK_ROOTS_MAX];
+    disk_roots(md5, roots);
+    return roots[0];
+}
+
+/**
+ * @brief exist_img Check an image is stored.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant.
+ *
+ * @return 1 for stored and 0 for not.
+ */
+int exist_img(const char *md5, const char *name){
+    char path[512];
+    zdir_t dir;
+    struct stat f_stat;
+    int roots[DISK_ROOTS_MAX];
+    int i, n, ret = 0;
+    if(settings.volume_on){
+	char key[VOLUME_KEY_MAX];
+	snprintf(key, sizeof(key), "%s/%s", md5, name);
+	if(vol_exist(key) == 1)
+	    return 1;
+    }
+    //images stored before volumes were used are still files
+    n = disk_roots(md5, roots);
+    for(i = 0; i < n && ret == 0; i++){
+	if(img_dir(roots[i], md5, name, false, &dir, path) == ZIMG_ERR)
+	    continue;
+	ret = fstatat(dir.fd, path, &f_stat, 0) == 0 && S_ISREG(f_stat.st_mode);
+	dir_close(&dir);
+    }
+    return ret;
+}
+
+/**
+ * @brief open_cold_img Open a stored image in volumes or img_path, the fast
+ * tier is skipped.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant.
+ * @param fd It gets the fd, the caller must close it.
+ * @param off It gets the offset of the image in fd.
+ * @param len It gets the length of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found or fail.
+ */
+static int open_cold_img(const char *md5, const char *name, int *fd, off_t *off, size_t *len){
+    char path[512];
+    zdir_t dir;
+    struct stat f_stat;
+    int roots[DISK_ROOTS_MAX];
+    int i, n;
+
+    if(settings.volume_on){
+	char key[VOLUME_KEY_MAX];
+	snprintf(key, sizeof(key), "%s/%s", md5, name);
+	if(vol_open(key, fd, off, len) == ZIMG_OK)
+	    return ZIMG_OK;
+    }
+
+    *fd = -1;
+    n = disk_roots(md5, roots);
+    for(i = 0; i < n && *fd == -1; i++){
+	if(img_dir(roots[i], md5, name, false, &dir, path) == ZIMG_ERR)
+	    continue;
+	*fd = openat(dir.fd, path, O_RDONLY);
+	dir_close(&dir);
+    }
+    if(*fd == -1)
+	return ZIMG_ERR;
+    if(fstat(*fd, &f_stat) == -1){
+	LOG_PRINT(LOG_ERROR, "File[%s] fstat Failed.", path);
+	close(*fd);
+	*fd = -1;
+	return ZIMG_ERR;
+    }
+    *off = 0;
+    *len = f_stat.st_size;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief open_img Open a stored image to send it without reading. The copy
+ * in the fast tier is opened if there is one.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant.
+ * @param fd It gets the fd, the caller must close it.
+ * @param off It gets the offset of the image in fd.
+ * @param len It gets the length of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found or fail.
+ */
+int open_img(const char *md5, const char *name, int *fd, off_t *off, size_t *len){
+    if(tier_open(md5, name, fd, len) == ZIMG_OK){
+	*off = 0;
+	return ZIMG_OK;
+    }
+    return open_cold_img(md5, name, fd, off, len);
+}
+
+/**
+ * @brief read_img Read a stored image into memory, from the fast tier if it
+ * is there.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant.
+ * @param buff It gets a malloc()ed buffer of the image.
+ * @param len It gets the length of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found or fail.
+ */
+int read_img(const char *md5, const char *name, char **buff, size_t *len){
+    int fd = -1;
+
+    *buff = NULL;
+    if(tier_open(md5, name, &fd, len) == ZIMG_OK){
+	if(*len > 0 && (*buff = (char *)malloc(*len)) != NULL && pread_all(fd, *buff, *len, 0) == ZIMG_OK){
+	    close(fd);
+	    return ZIMG_OK;
 	}
+	free(*buff);
+	*buff = NULL;
+	close(fd);
+    }
+    return read_cold_img(md5, name, buff, len);
+}
+
+/**
+ * @brief read_cold_img Read a stored image from volumes or img_path, the
+ * fast tier is skipped.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant.
+ * @param buff It gets a malloc()ed buffer of the image.
+ * @param len It gets the length of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found or fail.
+ */
+int read_cold_img(const char *md5, const char *name, char **buff, size_t *len){
+    int fd = -1;
+    off_t off;
+
+    *buff = NULL;
+    if(settings.volume_on){
+	char key[VOLUME_KEY_MAX];
+	snprintf(key, sizeof(key), "%s/%s", md5, name);
+	if(vol_read(key, buff, len) == ZIMG_OK)
+	    return ZIMG_OK;
+    }
 
-	//shrink as JPEG
-	p = strrchr(save_path,'/');
-	memcpy(p+1,"0.jpg",5);
-	*(p + 6) = '\0';
+    if(open_cold_img(md5, name, &fd, &off, len) == ZIMG_ERR)
+	return ZIMG_ERR;
+    if(*len == 0 || (*buff = (char *)malloc(*len)) == NULL ||
+	    pread_all(fd, *buff, *len, off) == ZIMG_ERR){
+	LOG_PRINT(LOG_ERROR, "Image[%s/%s] Read Failed.", md5, name);
+	free(*buff);
+	*buff = NULL;
+	close(fd);
+	return ZIMG_ERR;
+    }
+    close(fd);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief write_tmp_img Write an image to a temp file and rename it, so a
+ * partial image is never seen under its name. A durable one is renamed by
+ * group commit after its data is synced.
+ *
+ * @param dir The lvl2 directory of the image.
+ * @param md5 The md5 of the image.
+ * @param name The name of the image.
+ * @param path The path of the image relative to dir.
+ * @param buff The image, NULL to copy it from src.
+ * @param src A file of the image, it is copied in chunks, not read whole.
+ * @param len The length of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int write_tmp_img(zdir_t *dir, const char *md5, const char *name, const char *path,
+	const char *buff, int src, const size_t len){
+    static unsigned int seq = 0;
+    char tmp[512];
+    int fd, ret = ZIMG_ERR;
+
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%d.%u.tmp", md5, name, (int)getpid(), __sync_add_and_fetch(&seq, 1));
+    fd = openat(dir->fd, tmp, O_WRONLY | O_TRUNC | O_CREAT, 00644);
+    if(fd < 0){
+	LOG_PRINT(LOG_ERROR, "fd(%s) open failed!", tmp);
+	return ZIMG_ERR;
+    }
+    if((buff ? write_all(fd, buff, len) : copy_all(fd, src, len)) == ZIMG_ERR){
+	LOG_PRINT(LOG_ERROR, "write(%s) failed!", tmp);
+    }
+    else if(is_durable(name)){
+	commit_t c;
+	c.fd = fd;
+	c.dirfd = dir->fd;
+	c.from_dirfd = dir->fd;
+	c.from = tmp;
+	c.to = path;
+	ret = commit_wait(&c);
+    }
+    else if(renameat(dir->fd, tmp, dir->fd, path) == 0){
+	ret = ZIMG_OK;
+    }
+    close(fd);
+    if(ret == ZIMG_ERR){
+	LOG_PRINT(LOG_ERROR, "Image [%s] Commit Failed!", path);
+	unlinkat(dir->fd, tmp, 0);
+    }
+    return ret;
+}
+
+/**
+ * @brief new_img_file Move a file into the storage as an image.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant.
+ * @param tmp_path The file, it is moved or removed.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int new_img_file(const char *md5, const char *name, const char *tmp_path){
+    char path[512];
+    zdir_t dir;
+    int ret = ZIMG_ERR;
+
+    if(settings.volume_on){
+	char key[VOLUME_KEY_MAX];
+	struct stat f_stat;
+	int fd = open(tmp_path, O_RDONLY);
+	snprintf(key, sizeof(key), "%s/%s", md5, name);
+	if(fd != -1 && fstat(fd, &f_stat) == 0)
+	    ret = vol_put_fd(key, fd, f_stat.st_size);
+	if(fd != -1)
+	    close(fd);
+	unlink(tmp_path);
+	if(ret == ZIMG_OK && is_durable(name))
+	    ret = vol_sync(key);
+	return ret;
+    }
 
-	if(convert2jpg(buff,len,save_path) == ZIMG_OK){
-	    LOG_PRINT(LOG_WARNING, "Convert Image to JPEG [%s] OK!", save_path);
+    if(disk_count() > 0){
+	//the temp file is in img_path, it can not be renamed to another disk,
+	//it is copied there in chunks so a large upload is never in memory
+	int fd = open(tmp_path, O_RDONLY);
+	struct stat f_stat;
+	if(fd != -1 && fstat(fd, &f_stat) == 0 && f_stat.st_size > 0
+		&& img_dir(img_root(md5), md5, name, true, &dir, path) == ZIMG_OK){
+	    ret = write_tmp_img(&dir, md5, name, path, NULL, fd, f_stat.st_size);
+	    dir_close(&dir);
 	}
+	if(fd != -1)
+	    close(fd);
+	unlink(tmp_path);
+	return ret;
+    }
 
-	free(save_path);
-	return ZIMG_OK;
+    if(img_dir(0, md5, name, true, &dir, path) == ZIMG_ERR){
+	unlink(tmp_path);
+	return ZIMG_ERR;
     }
+    if(is_durable(name)){
+	commit_t c;
+	c.fd = open(tmp_path, O_RDONLY);
+	c.dirfd = dir.fd;
+	c.from_dirfd = AT_FDCWD;
+	c.from = tmp_path;
+	c.to = path;
+	ret = c.fd == -1 ? ZIMG_ERR : commit_wait(&c);
+	if(c.fd != -1)
+	    close(c.fd);
+	if(ret == ZIMG_ERR){
+	    LOG_PRINT(LOG_ERROR, "Commit [%s] to [%s] Failed!", tmp_path, path);
+	    unlink(tmp_path);
+	}
+	dir_close(&dir);
+	return ret;
+    }
+    if(renameat(AT_FDCWD, tmp_path, dir.fd, path) == -1){
+	LOG_PRINT(LOG_ERROR, "Rename [%s] to [%s] Failed!", tmp_path, path);
+	unlink(tmp_path);
+	dir_close(&dir);
+	return ZIMG_ERR;
+    }
+    dir_close(&dir);
+    return ZIMG_OK;
 }
 
 /**
- * @brief new_img The real function to save a image to disk.
+ * @brief new_img The real function to save a image to disk. It is appended
+ * to volumes if they are used, or written as a file. With durable writes the
+ * file is renamed from a temp one, and the original image is committed before
+ * it returns.
  *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant, such as 0*0p.
  * @param buff Const buff to write to disk.
  * @param len The length of buff.
- * @param save_name The name you want to save.
  *
  * @return ZIMG_OK for success and ZIMG_ERR for fail.
  */
-int new_img(const char *buff, const size_t len, const char *save_name){
+int new_img(const char *md5, const char *name, const char *buff, const size_t len){
     LOG_PRINT(LOG_INFO, "Start to Storage the New Image...");
-    int fd = -1;
-    int wlen = 0;
+    int fd = -1, ret;
+    char save_name[512];
+    zdir_t dir;
+
+    if(settings.volume_on){
+	char key[VOLUME_KEY_MAX];
+	snprintf(key, sizeof(key), "%s/%s", md5, name);
+	if(vol_put(key, buff, len) == ZIMG_ERR)
+	    return ZIMG_ERR;
+	return is_durable(name) ? vol_sync(key) : ZIMG_OK;
+    }
 
-    if((fd = open(save_name, O_WRONLY | O_TRUNC | O_CREAT, 00644)) < 0){
+    if(img_dir(img_root(md5), md5, name, true, &dir, save_name) == ZIMG_ERR){
+	return ZIMG_ERR;
+    }
+    if(commit_on()){
+	ret = write_tmp_img(&dir, md5, name, save_name, buff, -1, len);
+	dir_close(&dir);
+	if(ret == ZIMG_OK)
+	    LOG_PRINT(LOG_INFO, "Image [%s] Write Successfully!", save_name);
+	return ret;
+    }
+    fd = openat(dir.fd, save_name, O_WRONLY | O_TRUNC | O_CREAT, 00644);
+    dir_close(&dir);
+    if(fd < 0){
 	LOG_PRINT(LOG_ERROR, "fd(%s) open failed!", save_name);
 	return ZIMG_ERR;
     }
@@ -272,14 +826,8 @@ int new_img(const char *buff, const size_t len, const char *save_name){
 	return ZIMG_ERR;
     }
 
-    wlen = write(fd, buff, len);
-    if(wlen < len){
-	if(wlen == -1){
-	    LOG_PRINT(LOG_ERROR, "write(%s) failed!", save_name);
-	}else{
-	    LOG_PRINT(LOG_ERROR, "Only part of [%s] is been writed.", save_name);
-	}
-
+    if(write_all(fd, buff, len) == ZIMG_ERR){
+	LOG_PRINT(LOG_ERROR, "write(%s) failed!", save_name);
 	close(fd);
 	return ZIMG_ERR;
     }
@@ -291,6 +839,222 @@ int new_img(const char *buff, const size_t len, const char *save_name){
     return ZIMG_OK;
 }
 
+/* an image file being written by async I/O to a temp file */
+typedef struct img_write_s {
+    zdir_t dir;
+    char path[512];
+    char tmp[512];
+    int fd;
+    bool durable;
+    commit_t c;
+    aio_cb cb;
+    void *arg;
+} img_write_t;
+
+static void img_write_end(img_write_t *w, int ret){
+    close(w->fd);
+    if(ret == ZIMG_ERR){
+	//a part of the image must not be served
+	LOG_PRINT(LOG_ERROR, "Image [%s] Write Failed!", w->path);
+	unlinkat(w->dir.fd, w->tmp, 0);
+    }
+    else
+	LOG_PRINT(LOG_INFO, "Image [%s] Write Successfully!", w->path);
+    dir_close(&w->dir);
+    w->cb(ret, w->arg);
+    free(w);
+}
+
+static void img_committed(commit_t *c, void *arg){
+    img_write_end((img_write_t *)arg, c->ret);
+}
+
+/* the temp file is written, it is renamed into place here, or by the
+ * committer after it is synced if the image is durable */
+static void img_written(int ret, void *arg){
+    img_write_t *w = (img_write_t *)arg;
+
+    if(ret == ZIMG_OK && w->durable){
+	w->c.fd = w->fd;
+	w->c.dirfd = w->dir.fd;
+	w->c.from_dirfd = w->dir.fd;
+	w->c.from = w->tmp;
+	w->c.to = w->path;
+	if(commit_async(&w->c, img_committed, w) == ZIMG_OK)
+	    return;
+	ret = ZIMG_ERR;
+    }
+    else if(ret == ZIMG_OK && renameat(w->dir.fd, w->tmp, w->dir.fd, w->path) == -1){
+	LOG_PRINT(LOG_ERROR, "rename(%s) failed: %s", w->path, strerror(errno));
+	ret = ZIMG_ERR;
+    }
+    img_write_end(w, ret);
+}
+
+/**
+ * @brief new_img_async Save an image like new_img() by async I/O, so the
+ * caller is not blocked by writing. Only opening the file is done at once.
+ * The image is written to a temp file and renamed when it is complete, so a
+ * request for it never reads a part of it.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant, such as 0*0p.
+ * @param buff The image, it must be valid until cb is called.
+ * @param len The length of buff.
+ * @param cb It is called on an I/O thread, or the committer thread for a
+ * durable image, when the image is saved.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for submitted and ZIMG_ERR for fail, then cb is not called.
+ */
+int new_img_async(const char *md5, const char *name, const char *buff, const size_t len, aio_cb cb, void *arg){
+    static unsigned int seq = 0;
+    img_write_t *w;
+
+    if(aio_backend() == AIO_OFF)
+	return ZIMG_ERR;
+    if(settings.volume_on){
+	char key[VOLUME_KEY_MAX];
+	snprintf(key, sizeof(key), "%s/%s", md5, name);
+	return vol_put_async(key, buff, len, cb, arg);
+    }
+
+    if((w = (img_write_t *)malloc(sizeof(img_write_t))) == NULL)
+	return ZIMG_ERR;
+    if(img_dir(img_root(md5), md5, name, true, &w->dir, w->path) == ZIMG_ERR){
+	free(w);
+	return ZIMG_ERR;
+    }
+    snprintf(w->tmp, sizeof(w->tmp), "%s/.%s.%d.a%u.tmp", md5, name, (int)getpid(), __sync_add_and_fetch(&seq, 1));
+    if((w->fd = openat(w->dir.fd, w->tmp, O_WRONLY | O_TRUNC | O_CREAT, 00644)) < 0){
+	LOG_PRINT(LOG_ERROR, "fd(%s) open failed!", w->tmp);
+	dir_close(&w->dir);
+	free(w);
+	return ZIMG_ERR;
+    }
+    w->durable = is_durable(name);
+    w->cb = cb;
+    w->arg = arg;
+    aio_op_t op = { AIO_WRITE, w->fd, (char *)buff, len, 0, img_written, w, disk_queue(w->fd) };
+    if(aio_submit(&op, 1) == ZIMG_ERR){
+	close(w->fd);
+	unlinkat(w->dir.fd, w->tmp, 0);
+	dir_close(&w->dir);
+	free(w);
+	return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief del_img Remove a stored image from volumes and files.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the original image or a variant.
+ *
+ * @return ZIMG_OK for removed and ZIMG_ERR for not found.
+ */
+int del_img(const char *md5, const char *name){
+    char path[512];
+    zdir_t dir;
+    int roots[DISK_ROOTS_MAX];
+    int i, n, ret = ZIMG_ERR;
+
+    if(settings.volume_on){
+	char key[VOLUME_KEY_MAX];
+	snprintf(key, sizeof(key), "%s/%s", md5, name);
+	if(vol_del(key) == ZIMG_OK)
+	    ret = ZIMG_OK;
+    }
+    n = disk_roots(md5, roots);
+    for(i = 0; i < n; i++){
+	if(img_dir(roots[i], md5, name, false, &dir, path) == ZIMG_OK){
+	    if(unlinkat(dir.fd, path, 0) == 0)
+		ret = ZIMG_OK;
+	    dir_close(&dir);
+	}
+    }
+    tier_del(md5, name);
+    return ret;
+}
+
+/**
+ * @brief read_orig Read the original image into a wand and put it into cache.
+ *
+ * @param magick_wand The wand.
+ * @param md5 The md5 of the image.
+ * @param cache_key The cache key of the original image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int read_orig(MagickWand *magick_wand, const char *md5, const char *cache_key){
+    char *blob = NULL;
+    size_t blob_size = 0;
+    MagickBooleanType status;
+
+    if(read_img(md5, "0*0p", &blob, &blob_size) == ZIMG_ERR){
+	LOG_PRINT(LOG_WARNING, "Original Image[%s] Not Found!", md5);
+	return ZIMG_ERR;
+    }
+    tier_touch(md5, "0*0p", blob_size);
+    status = MagickReadImageBlob(magick_wand, blob, blob_size);
+    if(status == MagickFalse){
+	ThrowWandException(magick_wand);
+	free(blob);
+	return ZIMG_ERR;
+    }
+    if(blob_size < CACHE_MAX_SIZE){
+	set_cache_bin(cache_key, blob, blob_size);
+    }
+    free(blob);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief release_img_buff Release a buffer returned by get_img(). It has the
+ * same type as evbuffer_ref_cleanup_cb, so evbuffer can call it after the
+ * buffer is sent.
+ *
+ * @param data The buffer.
+ * @param len The length of the buffer.
+ * @param arg The BUFF_TYPE_* of the buffer, casted to a pointer.
+ */
+void release_img_buff(const void *data, size_t len, void *arg)
+{
+    if(data == NULL)
+	return;
+
+    if((intptr_t)arg == BUFF_TYPE_MAGICK)
+	MagickRelinquishMemory((void *)data);
+    else
+	free((void *)data);
+}
+
+/**
+ * @brief img_name Set rsp_name of a request to the name of the variant it
+ * asks for, such as 100*100p. Equal names are equal images.
+ *
+ * @param req The zimg_req_t with the params of a request.
+ */
+void img_name(zimg_req_t *req)
+{
+    char *name = req->rsp_name;
+    if(req->width == 0 && req->height == 0 && req->gray == 0)
+    {
+	LOG_PRINT(LOG_INFO, "Return original image.");
+	strcpy(name, "0*0p");
+    }
+    else if(req->proportion && req->gray)
+	sprintf(name, "%d*%dpg", req->width, req->height);
+    else if(req->proportion && !req->gray)
+	sprintf(name, "%d*%dp", req->width, req->height);
+    else if(!req->proportion && req->gray)
+	sprintf(name, "%d*%dg", req->width, req->height);
+    else
+	sprintf(name, "%d*%d", req->width, req->height);
+    LOG_PRINT(LOG_INFO, "Got the rsp_name: %s", name);
+}
+
 /* get image method used for zimg servise, such as:
  * http://127.0.0.1:4869/c6c4949e54afdb0972d323028657a1ef?w=100&h=50&p=1&g=1 */
 /**
@@ -300,25 +1064,29 @@ int new_img(const char *buff, const size_t len, const char *save_name){
  * @param buff_ptr This function return image buffer in it.
  * @param img_size Get_img will change this number to return the size of image buffer.
  *
- * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ * @return ZIMG_OK for success and ZIMG_ERR for fail, 1 for a stored image, 2
+ * for a new variant to be saved, and IMG_NOT_STORED for a variant not
+ * rendered by stored_only.
  */
 int get_img(zimg_req_t *req, char **buff_ptr, size_t *img_size)
 {
     int result = -1;
-    char *rsp_path = NULL;
-    char *whole_path = NULL;
-    char *orig_path = NULL;
-    char *color_path = NULL;
     char *img_format = NULL;
-    size_t len;
+    char *blob = NULL;
+    size_t blob_size = 0;
     int fd = -1;
-    struct stat f_stat;
+    off_t off = 0;
 
     MagickBooleanType status;
     MagickWand *magick_wand = NULL;
 
     LOG_PRINT(LOG_INFO, "get_img() start processing zimg request...");
 
+    *buff_ptr = NULL;
+    req->buff_type = BUFF_TYPE_MALLOC;
+    req->rsp_fd = -1;
+    req->rsp_off = 0;
+
     char *cache_key = (char *)malloc(strlen(req->md5) + 32);
     if(cache_key == NULL){
 	LOG_PRINT(LOG_INFO, "malloc failed!");
@@ -337,70 +1105,36 @@ int get_img(zimg_req_t *req, char **buff_ptr, size_t *img_size)
 	free(cache_key);
 	return ZIMG_OK;
     }
-    free(cache_key);
 
     LOG_PRINT(LOG_INFO, "Start to Find the Image...");
-
-    //check img dir
-    // /1023/1023/xxxxxxxxxxxxxxx.png
-    len = strlen(req->md5) + strlen(settings.img_path) + 12;
-    whole_path = malloc(len);
-
-    if (whole_path == NULL){
-	LOG_PRINT(LOG_ERROR, "whole_path malloc failed!");
-	return ZIMG_ERR;
-    }
-
-    int lvl1 = str_hash(req->md5);
-    int lvl2 = str_hash(req->md5 + 3);
-    sprintf(whole_path, "%s/%d/%d/%s", settings.img_path, lvl1, lvl2, req->md5);
-    LOG_PRINT(LOG_INFO, "docroot: %s", settings.img_path);
     LOG_PRINT(LOG_INFO, "req->md5: %s", req->md5);
-    LOG_PRINT(LOG_INFO, "whole_path: %s", whole_path);
-
-    char name[128];
-    if(req->proportion && req->gray)
-	sprintf(name, "%d*%dpg", req->width, req->height);
-    else if(req->proportion && !req->gray)
-	sprintf(name, "%d*%dp", req->width, req->height);
-    else if(!req->proportion && req->gray)
-	sprintf(name, "%d*%dg", req->width, req->height);
-    else
-	sprintf(name, "%d*%d", req->width, req->height);
-
-    orig_path = (char *)malloc(strlen(whole_path) + 6);
-    sprintf(orig_path, "%s/0*0p", whole_path);
-    LOG_PRINT(LOG_INFO, "0rig File Path: %s", orig_path);
 
-    rsp_path = (char *)malloc(512);
-    if(req->width == 0 && req->height == 0 && req->gray == 0)
-    {
-	LOG_PRINT(LOG_INFO, "Return original image.");
-	strcpy(rsp_path, orig_path);
-    }
-    else
-    {
-	sprintf(rsp_path, "%s/%s", whole_path, name);
-    }
-    LOG_PRINT(LOG_INFO, "Got the rsp_path: %s", rsp_path);
+    char *name = req->rsp_name;
+    img_name(req);
     bool got_rsp = true;
     bool got_color = false;
 
 
-    //status=MagickReadImage(magick_wand, rsp_path);
-    if((fd = open(rsp_path, O_RDONLY)) == -1)
-	//if(status == MagickFalse)
+    if(open_img(req->md5, name, &fd, &off, img_size) == ZIMG_ERR)
     {
-	magick_wand = NewMagickWand();
+	if(req->stored_only && strcmp(name, "0*0p") != 0)
+	{
+	    LOG_PRINT(LOG_INFO, "Image[%s/%s] is Not Stored.", req->md5, name);
+	    result = IMG_NOT_STORED;
+	    goto err;
+	}
+	magick_wand = get_magick_wand();
 	got_rsp = false;
 
 	if(req->gray == 1)
 	{
 	    sprintf(cache_key, "img:%s:%d:%d:%d:0", req->md5, req->width, req->height, req->proportion);
-	    if(find_cache_bin(cache_key, buff_ptr, img_size) == 1)
+	    if(find_cache_bin(cache_key, &blob, &blob_size) == 1)
 	    {
-		LOG_PRINT(LOG_INFO, "Hit Color Image Cache[Key: %s, len: %d].", cache_key, *img_size);
-		status = MagickReadImageBlob(magick_wand, *buff_ptr, *img_size);
+		LOG_PRINT(LOG_INFO, "Hit Color Image Cache[Key: %s, len: %d].", cache_key, blob_size);
+		status = MagickReadImageBlob(magick_wand, blob, blob_size);
+		free(blob);
+		blob = NULL;
 		if(status == MagickFalse)
 		{
 		    LOG_PRINT(LOG_WARNING, "Color Image Cache[Key: %s] is Bad. Remove.", cache_key);
@@ -409,84 +1143,54 @@ int get_img(zimg_req_t *req, char **buff_ptr, size_t *img_size)
 		else
 		{
 		    got_color = true;
-		    LOG_PRINT(LOG_INFO, "Read Image from Color Image Cache[Key: %s, len: %d] Succ. Goto Convert.", cache_key, *img_size);
+		    LOG_PRINT(LOG_INFO, "Read Image from Color Image Cache[Key: %s, len: %d] Succ. Goto Convert.", cache_key, blob_size);
 		    goto convert;
 		}
 	    }
 
-	    len = strlen(rsp_path);
-	    color_path = (char *)malloc(len);
-	    strncpy(color_path, rsp_path, len);
-	    color_path[len - 1] = '\0';
-	    LOG_PRINT(LOG_INFO, "color_path: %s", color_path);
-	    status=MagickReadImage(magick_wand, color_path);
-	    if(status == MagickTrue)
+	    char color_name[128];
+	    strcpy(color_name, name);
+	    color_name[strlen(name) - 1] = '\0';
+	    LOG_PRINT(LOG_INFO, "color_name: %s", color_name);
+	    if(read_img(req->md5, color_name, &blob, &blob_size) == ZIMG_OK)
 	    {
-		got_color = true;
-		LOG_PRINT(LOG_INFO, "Read Image from Color Image[%s] Succ. Goto Convert.", color_path);
-		*buff_ptr = (char *)MagickGetImageBlob(magick_wand, img_size);
-		if(*img_size < CACHE_MAX_SIZE)
+		status = MagickReadImageBlob(magick_wand, blob, blob_size);
+		if(status == MagickTrue)
 		{
-		    set_cache_bin(cache_key, *buff_ptr, *img_size);
-		    //                    img_format = MagickGetImageFormat(magick_wand);
-		    //                    sprintf(cache_key, "type:%s:%d:%d:%d:0", req->md5, req->width, req->height, req->proportion);
-		    //                    set_cache(cache_key, img_format);
+		    got_color = true;
+		    LOG_PRINT(LOG_INFO, "Read Image from Color Image[%s] Succ. Goto Convert.", color_name);
+		    if(blob_size < CACHE_MAX_SIZE)
+			set_cache_bin(cache_key, blob, blob_size);
 		}
-
-		goto convert;
+		free(blob);
+		blob = NULL;
+		if(got_color)
+		    goto convert;
 	    }
 	}
 
 	// to gen cache_key like this: rsp_path-/926ee2f570dc50b2575e35a6712b08ce
 	sprintf(cache_key, "img:%s:0:0:1:0", req->md5);
-	if(find_cache_bin(cache_key, buff_ptr, img_size) == 1)
+	if(find_cache_bin(cache_key, &blob, &blob_size) == 1)
 	{
 	    LOG_PRINT(LOG_INFO, "Hit Orignal Image Cache[Key: %s].", cache_key);
-	    status = MagickReadImageBlob(magick_wand, *buff_ptr, *img_size);
+	    status = MagickReadImageBlob(magick_wand, blob, blob_size);
+	    free(blob);
+	    blob = NULL;
 	    if(status == MagickFalse)
 	    {
 		LOG_PRINT(LOG_WARNING, "Open Original Image From Blob Failed! Begin to Open it From Disk.");
 		ThrowWandException(magick_wand);
 		del_cache(cache_key);
-		status = MagickReadImage(magick_wand, orig_path);
-		if(status == MagickFalse)
-		{
-		    ThrowWandException(magick_wand);
+		if(read_orig(magick_wand, req->md5, cache_key) == ZIMG_ERR)
 		    goto err;
-		}
-		else
-		{
-		    *buff_ptr = (char *)MagickGetImageBlob(magick_wand, img_size);
-		    if(*img_size < CACHE_MAX_SIZE)
-		    {
-			set_cache_bin(cache_key, *buff_ptr, *img_size);
-			//                        img_format = MagickGetImageFormat(magick_wand);
-			//                        sprintf(cache_key, "type:%s:0:0:1:0", req->md5);
-			//                        set_cache(cache_key, img_format);
-		    }
-		}
 	    }
 	}
 	else
 	{
 	    LOG_PRINT(LOG_INFO, "Not Hit Original Image Cache. Begin to Open it.");
-	    status = MagickReadImage(magick_wand, orig_path);
-	    if(status == MagickFalse)
-	    {
-		ThrowWandException(magick_wand);
+	    if(read_orig(magick_wand, req->md5, cache_key) == ZIMG_ERR)
 		goto err;
-	    }
-	    else
-	    {
-		*buff_ptr = (char *)MagickGetImageBlob(magick_wand, img_size);
-		if(*img_size < CACHE_MAX_SIZE)
-		{
-		    set_cache_bin(cache_key, *buff_ptr, *img_size);
-		    //                    img_format = MagickGetImageFormat(magick_wand);
-		    //                    sprintf(cache_key, "type:%s:0:0:1:0", req->md5);
-		    //                    set_cache(cache_key, img_format);
-		}
-	    }
 	}
 	int width, height;
 	width = req->width;
@@ -510,7 +1214,7 @@ int get_img(zimg_req_t *req, char **buff_ptr, size_t *img_size)
 	    status = MagickResizeImage(magick_wand, width, height, LanczosFilter, 1.0);
 	    if(status == MagickFalse)
 	    {
-		LOG_PRINT(LOG_ERROR, "Image[%s] Resize Failed!", orig_path);
+		LOG_PRINT(LOG_ERROR, "Image[%s] Resize Failed!", req->md5);
 		goto err;
 	    }
 	    LOG_PRINT(LOG_INFO, "Resize img succ.");
@@ -536,32 +1240,36 @@ int get_img(zimg_req_t *req, char **buff_ptr, size_t *img_size)
     }
     else
     {
-	fstat(fd, &f_stat);
-	size_t rlen = 0;
-	*img_size = f_stat.st_size;
 	if(*img_size <= 0)
 	{
-	    LOG_PRINT(LOG_ERROR, "File[%s] is Empty.", rsp_path);
+	    LOG_PRINT(LOG_ERROR, "Image[%s/%s] is Empty.", req->md5, name);
 	    goto err;
 	}
+	LOG_PRINT(LOG_INFO, "img_size = %d", *img_size);
+	variant_touch(req->md5, name);
+	tier_touch(req->md5, name, *img_size);
+	if(settings.cache_on == false || *img_size >= CACHE_MAX_SIZE || aio_backend() != AIO_OFF)
+	{
+	    //give the fd to caller, it is sent by sendfile(), or read by async
+	    //I/O if it is to be cached
+	    LOG_PRINT(LOG_INFO, "Send Image[%s/%s] without Reading it.", req->md5, name);
+	    req->rsp_fd = fd;
+	    req->rsp_off = off;
+	    fd = -1;
+	    goto done;
+	}
 	if((*buff_ptr = (char *)malloc(*img_size)) == NULL)
 	{
 	    LOG_PRINT(LOG_ERROR, "buff_ptr Malloc Failed!");
 	    goto err;
 	}
-	LOG_PRINT(LOG_INFO, "img_size = %d", *img_size);
 	//*buff_ptr = (char *)MagickGetImageBlob(magick_wand, img_size);
-	if((rlen = read(fd, *buff_ptr, *img_size)) == -1)
+	if(pread_all(fd, *buff_ptr, *img_size, off) == ZIMG_ERR)
 	{
-	    LOG_PRINT(LOG_ERROR, "File[%s] Read Failed.", rsp_path);
+	    LOG_PRINT(LOG_ERROR, "Image[%s/%s] Read Failed.", req->md5, name);
 	    LOG_PRINT(LOG_ERROR, "Error: %s.", strerror(errno));
 	    goto err;
 	}
-	else if(rlen < *img_size)
-	{
-	    LOG_PRINT(LOG_ERROR, "File[%s] Read Not Compeletly.", rsp_path);
-	    goto err;
-	}
 	goto done;
     }
 
@@ -575,7 +1283,7 @@ convert:
 	status = MagickSetImageColorspace(magick_wand, GRAYColorspace);
 	if(status == MagickFalse)
 	{
-	    LOG_PRINT(LOG_ERROR, "Image[%s] Remove Color Failed!", orig_path);
+	    LOG_PRINT(LOG_ERROR, "Image[%s] Remove Color Failed!", req->md5);
 	    goto err;
 	}
 	LOG_PRINT(LOG_INFO, "Image Remove Color Finish!");
@@ -593,13 +1301,13 @@ convert:
 	    status = MagickSetImageFormat(magick_wand, "JPEG");
 	    if(status == MagickFalse)
 	    {
-		LOG_PRINT(LOG_WARNING, "Image[%s] Convert Format Failed!", orig_path);
+		LOG_PRINT(LOG_WARNING, "Image[%s] Convert Format Failed!", req->md5);
 	    }
 	    LOG_PRINT(LOG_INFO, "Compress Image with JPEGCompression");
 	    status = MagickSetImageCompression(magick_wand, JPEGCompression);
 	    if(status == MagickFalse)
 	    {
-		LOG_PRINT(LOG_WARNING, "Image[%s] Compression Failed!", orig_path);
+		LOG_PRINT(LOG_WARNING, "Image[%s] Compression Failed!", req->md5);
 	    }
 	}
 	size_t quality = MagickGetImageCompressionQuality(magick_wand) * 0.75;
@@ -623,6 +1331,8 @@ convert:
 	    LOG_PRINT(LOG_WARNING, "Remove Exif Infomation of the ImageFailed!");
 	}
     }
+    //the encoder's buffer is returned as it is, caller must release it by release_img_buff()
+    req->buff_type = BUFF_TYPE_MAGICK;
     *buff_ptr = (char *)MagickGetImageBlob(magick_wand, img_size);
     if(*buff_ptr == NULL)
     {
@@ -632,7 +1342,7 @@ convert:
 
 
 done:
-    if(*img_size < CACHE_MAX_SIZE)
+    if(*buff_ptr != NULL && *img_size < CACHE_MAX_SIZE)
     {
 	// to gen cache_key like this: rsp_path-/926ee2f570dc50b2575e35a6712b08ce
 	sprintf(cache_key, "img:%s:%d:%d:%d:%d", req->md5, req->width, req->height, req->proportion, req->gray);
@@ -644,28 +1354,20 @@ done:
     result = 1;
     if(got_rsp == false)
     {
-	LOG_PRINT(LOG_INFO, "Image[%s] is Not Existed. Begin to Save it.", rsp_path);
+	LOG_PRINT(LOG_INFO, "Image[%s/%s] is Not Existed. Begin to Save it.", req->md5, name);
 	result = 2;
     }
     else
-	LOG_PRINT(LOG_INFO, "Image Needn't to Storage.", rsp_path);
+	LOG_PRINT(LOG_INFO, "Image[%s/%s] Needn't to Storage.", req->md5, name);
 
 err:
     if(fd != -1)
 	close(fd);
-    req->rsp_path = rsp_path;
-    if(magick_wand)
-    {
-	magick_wand=DestroyMagickWand(magick_wand);
-    }
+    //the wand goes back to the pool of this thread, cleared for the next request
+    put_magick_wand(magick_wand);
     if(img_format)
 	free(img_format);
     if(cache_key)
 	free(cache_key);
-    if (orig_path)
-	free(orig_path);
-    if (whole_path)
-	free(whole_path);
     return result;
 }
-
@@ -23,17 +23,36 @@
 #define ZIMG_H
 
 
+#include <sys/types.h>
 #include "zcommon.h"
 
 #define MagickString(magic)  (const char *) (magic), sizeof(magic)-1
 
+/* size of the images of phone numbers */
+#define PHONE_HEIGHT 18
+#define PHONE_GLYPH_WIDTH 11
+#define PHONE_MAX_LEN 32
+
+/* bytes needed by get_img_format() */
+#define IMG_MAGIC_LEN 8
+
+/* where a buffer returned by get_img() comes from */
+#define BUFF_TYPE_MALLOC 0      /* malloc()ed, such as memcached_get() */
+#define BUFF_TYPE_MAGICK 1      /* MagickGetImageBlob() */
+
+#define IMG_NOT_STORED 3        /* get_img() of stored_only, the variant must be rendered */
+
 typedef struct zimg_req_s {
     char *md5;
     int width;
     int height;
     bool proportion;
     bool gray;
-	char *rsp_path;
+    char rsp_name[128];         /* name of the variant, such as 100*100p */
+    int buff_type;
+    int rsp_fd;
+    off_t rsp_off;              /* offset of the image in rsp_fd */
+    bool stored_only;           /* do not render a variant which is not stored */
 } zimg_req_t;
 
 struct MagicInfo{  
@@ -51,10 +70,25 @@ static const struct MagicInfo magicInfoTable[] =
 };
 
 
+const char *get_img_format(const char *buff);
+void md5_to_str(const unsigned char *md_value, char *md5sum);
 int save_img(const char *buff, const int len, char *md5sum);
-int new_img(const char *buff, const size_t len, const char *save_name);
+int save_img_with_md5(const char *buff, const int len, const char *md5sum);
+int save_img_file(const char *tmp_path, const char *md5sum);
+int exist_img(const char *md5, const char *name);
+int open_img(const char *md5, const char *name, int *fd, off_t *off, size_t *len);
+int read_img(const char *md5, const char *name, char **buff, size_t *len);
+int read_cold_img(const char *md5, const char *name, char **buff, size_t *len);
+int new_img(const char *md5, const char *name, const char *buff, const size_t len);
+int new_img_async(const char *md5, const char *name, const char *buff, const size_t len,
+        void (*cb)(int ret, void *arg), void *arg);
+int new_img_file(const char *md5, const char *name, const char *tmp_path);
+int del_img(const char *md5, const char *name);
+void img_name(zimg_req_t *req);
 int get_img(zimg_req_t *req, char **buff_ptr, size_t *img_size);
-char *get_phone_img(const char *phone_str, size_t *img_size);
+void release_img_buff(const void *data, size_t len, void *arg);
+int phone_atlas_init(void);
+char *get_phone_img(const char *phone_str, size_t *img_size, int *buff_type);
 
 
 #endif
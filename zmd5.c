@@ -19,17 +19,59 @@
  * @date 2013-07-19
  */
 
+#include <string.h>
 #include "zmd5.h"
 
-static void md5_process(md5_state_t *pms, const md5_byte_t *data /*[64]*/);
-void md5_init(md5_state_t *pms);
-void md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes);
-void md5_finish(md5_state_t *pms, md5_byte_t digest[16]);
 
+#ifdef HAVE_SSL
 
-#ifndef HAVE_SSL /* only if we do not use OpenSSL provided implementation */
+int
+md5_init(md5_state_t *pms)
+{
+    pms->ctx = EVP_MD_CTX_new();
+    if (pms->ctx == NULL)
+	return -1;
+    if (EVP_DigestInit_ex(pms->ctx, EVP_md5(), NULL) != 1) {
+	md5_free(pms);
+	return -1;
+    }
+    return 0;
+}
+
+void
+md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes)
+{
+    if (pms->ctx != NULL && nbytes > 0 && EVP_DigestUpdate(pms->ctx, data, nbytes) != 1)
+	md5_free(pms);
+}
+
+/* it fails if any step of the message failed, the digest is not set then */
+int
+md5_finish(md5_state_t *pms, md5_byte_t digest[16])
+{
+    int ret = -1;
+
+    if (pms->ctx != NULL && EVP_DigestFinal_ex(pms->ctx, digest, NULL) == 1)
+	ret = 0;
+    md5_free(pms);
+    return ret;
+}
+
+void
+md5_free(md5_state_t *pms)
+{
+    if (pms->ctx != NULL)
+	EVP_MD_CTX_free(pms->ctx);
+    pms->ctx = NULL;
+}
+
+#else /* only if we do not use OpenSSL provided implementation */
+
+static void md5_process(md5_state_t *pms, const md5_byte_t *data /*[64]*/);
+int md5_init(md5_state_t *pms);
+void md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes);
+int md5_finish(md5_state_t *pms, md5_byte_t digest[16]);
 
-#include <string.h>
 
 #undef BYTE_ORDER	/* 1 = big-endian, -1 = little-endian, 0 = unknown */
 #ifdef ARCH_IS_BIG_ENDIAN
@@ -286,7 +328,7 @@ md5_process(md5_state_t *pms, const md5_byte_t *data /*[64]*/)
     pms->abcd[3] += d;
 }
 
-void
+int
 md5_init(md5_state_t *pms)
 {
     pms->count[0] = pms->count[1] = 0;
@@ -294,6 +336,7 @@ md5_init(md5_state_t *pms)
     pms->abcd[1] = /*0xefcdab89*/ T_MASK ^ 0x10325476;
     pms->abcd[2] = /*0x98badcfe*/ T_MASK ^ 0x67452301;
     pms->abcd[3] = 0x10325476;
+    return 0;
 }
 
 void
@@ -334,7 +377,7 @@ md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes)
 	memcpy(pms->buf, p, left);
 }
 
-void
+int
 md5_finish(md5_state_t *pms, md5_byte_t digest[16])
 {
     static const md5_byte_t pad[64] = {
@@ -355,5 +398,12 @@ md5_finish(md5_state_t *pms, md5_byte_t digest[16])
     md5_append(pms, data, 8);
     for (i = 0; i < 16; ++i)
 	digest[i] = (md5_byte_t)(pms->abcd[i >> 2] >> ((i & 3) << 3));
+    return 0;
+}
+
+void
+md5_free(md5_state_t *pms)
+{
+    (void)pms;
 }
 #endif /* HAVE_SSL */
@@ -24,14 +24,19 @@
 
 #include <stdint.h>
 
-/* use OpenSSL functions when available */
+/* use OpenSSL functions when available, they are optimized by assembly
+ * code. It is selected by the USE_OPENSSL_MD5 option of cmake. The EVP
+ * interface is used, the MD5_* one is deprecated since OpenSSL 3.0. */
 #ifdef HAVE_SSL
-#include <openssl/md5.h>
+#include <openssl/evp.h>
 
-#define md5_state_t MD5_CTX
-#define md5_init(c) MD5_Init(c)
-#define md5_append(c, data, len) MD5_Update(c, data, len);
-#define md5_finish(c, md) MD5_Final(md, c)
+typedef unsigned char md5_byte_t;
+
+/* The context is allocated by md5_init() and freed by md5_finish(), or by
+ * md5_free() if the message is dropped. */
+typedef struct md5_state_s {
+    EVP_MD_CTX *ctx;
+} md5_state_t;
 
 #else
 /*
@@ -54,24 +59,28 @@ typedef struct md5_state_s {
     md5_byte_t buf[64];		/* accumulate block */
 } md5_state_t;
 
+#endif /* HAVE_SSL */
+
 #ifdef __cplusplus
 extern "C" 
 {
 #endif
 
-/* Initialize the algorithm. */
-void md5_init(md5_state_t *pms);
+/* Initialize the algorithm, 0 for success and -1 for fail. */
+int md5_init(md5_state_t *pms);
 
 /* Append a string to the message. */
 void md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes);
 
-/* Finish the message and return the digest. */
-void md5_finish(md5_state_t *pms, md5_byte_t digest[16]);
+/* Finish the message and return the digest, 0 for success and -1 if the
+ * message failed, then the digest is not set. */
+int md5_finish(md5_state_t *pms, md5_byte_t digest[16]);
+
+/* Drop a message which is not finished. */
+void md5_free(md5_state_t *pms);
 
 #ifdef __cplusplus
 }  /* end extern "C" */
 #endif
 
-#endif /* md5_INCLUDED */
-
-#endif /* HAVE_SSL */
+#endif /* ZMD5_H */
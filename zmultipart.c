@@ -0,0 +1,229 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zmultipart.c
+ * @brief Incremental multipart/form-data parser. It is fed with the chunks
+ * of a body as they are received and never needs the whole body. It is
+ * binary safe, only the headers of parts are handled as strings.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include "zmultipart.h"
+#include "zlog.h"
+
+static int emit(multipart_parser_t *p, const char *data, size_t len);
+static int find_delim(multipart_parser_t *p, const char *data, size_t len, size_t *used);
+
+
+/**
+ * @brief multipart_init Init a parser.
+ *
+ * @param p The parser.
+ * @param boundary The boundary from the Content-Type header.
+ * @param cbs The callbacks of parts.
+ * @param arg The user data, it is p->arg in callbacks.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int multipart_init(multipart_parser_t *p, const char *boundary, const multipart_cbs_t *cbs, void *arg)
+{
+    memset(p, 0, sizeof(multipart_parser_t));
+    p->dlen = strlen(boundary) + 4;
+    p->delim = (char *)malloc(p->dlen + 1);
+    if(p->delim == NULL)
+    {
+        p->state = MP_ERR;
+        return ZIMG_ERR;
+    }
+    sprintf(p->delim, "\r\n--%s", boundary);
+    finder_init(&p->finder, p->delim, p->dlen);
+
+    //the body begins with "--boundary", act as if a "\r\n" has been matched
+    p->carry = 2;
+    p->state = MP_PREAMBLE;
+    p->cbs = cbs;
+    p->arg = arg;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief multipart_free Free the resource of a parser.
+ *
+ * @param p The parser.
+ */
+void multipart_free(multipart_parser_t *p)
+{
+    if(p->delim)
+    {
+        free(p->delim);
+        p->delim = NULL;
+    }
+}
+
+/**
+ * @brief emit Pass data to the part callback, data out of parts is dropped.
+ *
+ * @return 0 to go on and -1 to stop.
+ */
+static int emit(multipart_parser_t *p, const char *data, size_t len)
+{
+    if(p->state != MP_DATA || len == 0 || p->cbs->on_part_data == NULL)
+        return 0;
+    return p->cbs->on_part_data(p, data, len);
+}
+
+/**
+ * @brief find_delim Search the delimiter in a chunk and emit the data before
+ * it. The tail of the chunk which may be the beginning of a delimiter is
+ * held in p->carry until the next chunk comes.
+ *
+ * @param p The parser.
+ * @param data The chunk.
+ * @param len The length of the chunk.
+ * @param used It returns the bytes consumed.
+ *
+ * @return 1 for the delimiter is found, 0 for not found and -1 for stop.
+ */
+static int find_delim(multipart_parser_t *p, const char *data, size_t len, size_t *used)
+{
+    size_t j, k;
+    ssize_t m;
+
+    if(p->carry > 0)
+    {
+        k = p->dlen - p->carry;
+        if(k > len)
+            k = len;
+        if(memcmp(p->delim + p->carry, data, k) == 0)
+        {
+            p->carry += k;
+            *used = k;
+            if(p->carry < p->dlen)
+                return 0;
+            p->carry = 0;
+            return 1;
+        }
+        //the held bytes are data. A delimiter can not start inside them,
+        //because '\r' is only at the head of the delimiter.
+        if(emit(p, p->delim, p->carry) == -1)
+            return -1;
+        p->carry = 0;
+    }
+
+    m = finder_find(&p->finder, data, len);
+    if(m >= 0)
+    {
+        *used = m + p->dlen;
+        return emit(p, data, m) == -1 ? -1 : 1;
+    }
+
+    j = len > p->dlen - 1 ? len - (p->dlen - 1) : 0;
+    for(; j < len; j++)
+    {
+        if(data[j] == '\r' && memcmp(data + j, p->delim, len - j) == 0)
+            break;
+    }
+    *used = len;
+    p->carry = len - j;
+    return emit(p, data, j) == -1 ? -1 : 0;
+}
+
+/**
+ * @brief multipart_parse Parse a chunk of the body.
+ *
+ * @param p The parser.
+ * @param data The chunk.
+ * @param len The length of the chunk.
+ *
+ * @return The state of the parser, MP_ERR for a bad body or stopped by a
+ * callback.
+ */
+int multipart_parse(multipart_parser_t *p, const char *data, size_t len)
+{
+    size_t used;
+    int rst;
+
+    while(len > 0 && p->state != MP_ERR && p->state != MP_END)
+    {
+        switch(p->state)
+        {
+            case MP_PREAMBLE:
+            case MP_DATA:
+                rst = find_delim(p, data, len, &used);
+                data += used;
+                len -= used;
+                if(rst == -1)
+                {
+                    p->state = MP_ERR;
+                }
+                else if(rst == 1)
+                {
+                    if(p->state == MP_DATA && p->cbs->on_part_end && p->cbs->on_part_end(p) == -1)
+                        p->state = MP_ERR;
+                    else
+                    {
+                        p->state = MP_DELIM;
+                        p->elen = 0;
+                    }
+                }
+                break;
+
+            case MP_DELIM:
+                p->ending[p->elen++] = *data;
+                data++;
+                len--;
+                if(p->elen < 2)
+                    break;
+                if(p->ending[0] == '-' && p->ending[1] == '-')
+                {
+                    p->state = MP_END;
+                }
+                else if(p->ending[0] == '\r' && p->ending[1] == '\n')
+                {
+                    p->state = MP_HEADERS;
+                    p->hlen = 0;
+                }
+                else
+                {
+                    LOG_PRINT(LOG_ERROR, "Bad Chars After Boundary!");
+                    p->state = MP_ERR;
+                }
+                break;
+
+            case MP_HEADERS:
+                if(p->hlen == MP_HEAD_MAX)
+                {
+                    LOG_PRINT(LOG_ERROR, "Headers of Part Too Long!");
+                    p->state = MP_ERR;
+                    break;
+                }
+                p->head[p->hlen++] = *data;
+                data++;
+                len--;
+                if(p->hlen >= 4 && memcmp(p->head + p->hlen - 4, "\r\n\r\n", 4) == 0)
+                {
+                    p->head[p->hlen] = '\0';
+                    if(p->cbs->on_part_begin && p->cbs->on_part_begin(p, p->head, p->hlen) == -1)
+                        p->state = MP_ERR;
+                    else
+                        p->state = MP_DATA;
+                }
+                break;
+        }
+    }
+
+    return p->state;
+}
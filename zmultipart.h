@@ -0,0 +1,64 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+/**
+ * @file zmultipart.h
+ * @brief Incremental multipart/form-data parser header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZMULTIPART_H
+#define ZMULTIPART_H
+
+#include "zcommon.h"
+#include "zutil.h"
+
+#define MP_HEAD_MAX 4096        /* max length of the headers of one part */
+
+#define MP_ERR -1
+#define MP_PREAMBLE 0           /* before the first boundary */
+#define MP_DELIM 1              /* after a boundary, "--" or "\r\n" follows */
+#define MP_HEADERS 2            /* headers of a part */
+#define MP_DATA 3               /* body of a part */
+#define MP_END 4                /* after the last boundary */
+
+typedef struct multipart_parser_s multipart_parser_t;
+
+/* Callbacks return 0 to go on and -1 to stop parsing. */
+typedef struct multipart_cbs_s {
+    int (*on_part_begin)(multipart_parser_t *p, const char *head, size_t len);
+    int (*on_part_data)(multipart_parser_t *p, const char *data, size_t len);
+    int (*on_part_end)(multipart_parser_t *p);
+} multipart_cbs_t;
+
+struct multipart_parser_s {
+    int state;
+    char *delim;                /* "\r\n--" and the boundary */
+    size_t dlen;
+    zfinder_t finder;           /* search state of delim */
+    size_t carry;               /* length of delim prefix matched at the end of last chunk */
+    char ending[2];             /* the two chars after a boundary */
+    size_t elen;
+    char head[MP_HEAD_MAX + 1];
+    size_t hlen;
+    const multipart_cbs_t *cbs;
+    void *arg;
+};
+
+int multipart_init(multipart_parser_t *p, const char *boundary, const multipart_cbs_t *cbs, void *arg);
+void multipart_free(multipart_parser_t *p);
+int multipart_parse(multipart_parser_t *p, const char *data, size_t len);
+
+#endif
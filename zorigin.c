@@ -0,0 +1,374 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zorigin.c
+ * @brief Read-through of original images from an origin server, such as
+ * another zimg or a static file server having a file for each md5. An
+ * original missing here is got from url/md5 by libevent's HTTP client,
+ * checked by its md5 and stored, then it is used like any stored one. A
+ * fetch runs on a thread of its own pool, and the misses of an image coming
+ * at the same time are waiters of a single fetch, each called back in the
+ * thread of its request. The originals got are tracked by zvariant, so they
+ * are removed by the disk budget like the variants.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include "zorigin.h"
+#include "zimg.h"
+#include "zmd5.h"
+#include "zaio.h"
+#include "zthread.h"
+#include "zvariant.h"
+#include "zlog.h"
+
+/* a miss waiting for a fetch */
+typedef struct origin_waiter_s {
+    aio_loop_t *loop;
+    origin_cb cb;
+    void *arg;
+    int ret;
+    struct origin_waiter_s *next;
+} origin_waiter_t;
+
+/* a fetch of an original, the misses of the same image share it */
+typedef struct origin_fetch_s {
+    char md5[33];
+    origin_waiter_t *waiters;
+    struct origin_fetch_s *next;
+} origin_fetch_t;
+
+/* the reply of the origin */
+typedef struct origin_reply_s {
+    struct event_base *base;
+    int status;
+    char *buff;
+    size_t len;
+} origin_reply_t;
+
+static char origin_host[256];
+static int origin_port = 0;
+static char origin_path[512];           /* the prefix of the paths, without the last '/' */
+static bool origin_started = false;
+static thread_pool_t *origin_pool = NULL;
+static pthread_mutex_t origin_lock = PTHREAD_MUTEX_INITIALIZER;
+static origin_fetch_t *fetching = NULL;
+/* guarded by origin_lock */
+static uint64_t nfetches = 0;
+static uint64_t ncoalesced = 0;
+static uint64_t nfailed = 0;
+static uint64_t nbytes = 0;
+static int ninflight = 0;
+
+static void reply_cb(struct evhttp_request *req, void *arg);
+static int origin_get(const char *md5, char **buff, size_t *len);
+static int fetch_store(const char *md5);
+static void fetch_job(void *arg);
+static void waiter_run(void *arg);
+
+
+/**
+ * @brief origin_init Set the origin of the original images.
+ *
+ * @param url The url of the origin such as http://host:port/path, the
+ * original of md5 is got from http://host:port/path/md5. Empty for no origin.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int origin_init(const char *url)
+{
+    struct evhttp_uri *uri;
+    const char *host, *path;
+    size_t n;
+
+    origin_started = false;
+    if(url == NULL || url[0] == '\0')
+        return ZIMG_OK;
+    if((uri = evhttp_uri_parse(url)) == NULL || (host = evhttp_uri_get_host(uri)) == NULL)
+    {
+        LOG_PRINT(LOG_ERROR, "Origin[%s] is Not a URL!", url);
+        if(uri)
+            evhttp_uri_free(uri);
+        return ZIMG_ERR;
+    }
+    snprintf(origin_host, sizeof(origin_host), "%s", host);
+    origin_port = evhttp_uri_get_port(uri) > 0 ? evhttp_uri_get_port(uri) : 80;
+    path = evhttp_uri_get_path(uri);
+    snprintf(origin_path, sizeof(origin_path), "%s", path ? path : "");
+    n = strlen(origin_path);
+    while(n > 0 && origin_path[n - 1] == '/')
+        origin_path[--n] = '\0';
+    evhttp_uri_free(uri);
+    if((origin_pool = thread_pool_new(ORIGIN_THREADS)) == NULL)
+        return ZIMG_ERR;
+    origin_started = true;
+    LOG_PRINT(LOG_INFO, "Originals Are Read Through from http://%s:%d%s/.", origin_host, origin_port, origin_path);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief origin_destroy Stop the fetch threads after their fetches are done.
+ */
+void origin_destroy(void)
+{
+    if(origin_pool == NULL)
+        return;
+    thread_pool_free(origin_pool);
+    origin_pool = NULL;
+    origin_started = false;
+}
+
+/**
+ * @brief origin_on Check original images are got from an origin.
+ */
+bool origin_on(void)
+{
+    return origin_started;
+}
+
+static void reply_cb(struct evhttp_request *req, void *arg)
+{
+    origin_reply_t *r = (origin_reply_t *)arg;
+    struct evbuffer *body;
+
+    r->status = req ? evhttp_request_get_response_code(req) : 0;
+    if(r->status == 200)
+    {
+        body = evhttp_request_get_input_buffer(req);
+        r->len = evbuffer_get_length(body);
+        if(r->len > 0 && (r->buff = (char *)malloc(r->len)) != NULL)
+            evbuffer_remove(body, r->buff, r->len);
+    }
+    event_base_loopexit(r->base, NULL);
+}
+
+/**
+ * @brief origin_get Get an original from the origin, the calling thread is
+ * blocked until the reply or ORIGIN_TIMEOUT, so it is only called by the
+ * fetch threads.
+ *
+ * @param md5 The md5 of the image.
+ * @param buff It gets the image, it must be freed by caller.
+ * @param len It gets the length of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int origin_get(const char *md5, char **buff, size_t *len)
+{
+    struct evhttp_connection *conn = NULL;
+    struct evhttp_request *req;
+    origin_reply_t r;
+    char path[600];
+    int ret = ZIMG_ERR;
+
+    memset(&r, 0, sizeof(r));
+    snprintf(path, sizeof(path), "%s/%s", origin_path, md5);
+    if((r.base = event_base_new()) == NULL)
+        return ZIMG_ERR;
+    if((conn = evhttp_connection_base_new(r.base, NULL, origin_host, origin_port)) == NULL)
+        goto done;
+    evhttp_connection_set_timeout(conn, ORIGIN_TIMEOUT);
+    evhttp_connection_set_max_body_size(conn, ORIGIN_MAX_SIZE);
+    if((req = evhttp_request_new(reply_cb, &r)) == NULL)
+        goto done;
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Host", origin_host);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Connection", "close");
+    if(evhttp_make_request(conn, req, EVHTTP_REQ_GET, path) == -1)
+        goto done;
+    event_base_dispatch(r.base);
+
+    if(r.status != 200 || r.buff == NULL)
+    {
+        LOG_PRINT(LOG_WARNING, "Origin Replied %d for Image[%s].", r.status, md5);
+        free(r.buff);
+        goto done;
+    }
+    *buff = r.buff;
+    *len = r.len;
+    ret = ZIMG_OK;
+
+done:
+    if(conn)
+        evhttp_connection_free(conn);
+    event_base_free(r.base);
+    return ret;
+}
+
+/**
+ * @brief fetch_store Get an original from the origin and store it.
+ *
+ * @param md5 The md5 of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int fetch_store(const char *md5)
+{
+    md5_state_t state;
+    md5_byte_t md_value[16];
+    char md5sum[33];
+    char *buff = NULL;
+    size_t len = 0;
+    int ret = ZIMG_ERR;
+
+    if(origin_get(md5, &buff, &len) == ZIMG_ERR)
+        return ZIMG_ERR;
+    //the origin is not trusted to send the image asked
+    if(md5_init(&state) == -1)
+        goto done;
+    md5_append(&state, (const md5_byte_t *)buff, len);
+    if(md5_finish(&state, md_value) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "MD5 of Image[%s] from Origin Failed!", md5);
+        goto done;
+    }
+    md5_to_str(md_value, md5sum);
+    if(strcmp(md5sum, md5) != 0)
+    {
+        LOG_PRINT(LOG_ERROR, "Origin Sent Image[%s] for Image[%s]!", md5sum, md5);
+        goto done;
+    }
+    if(new_img(md5, "0*0p", buff, len) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Image[%s] from Origin Save Failed!", md5);
+        goto done;
+    }
+    variant_add(md5, "0*0p", len);
+    pthread_mutex_lock(&origin_lock);
+    nbytes += len;
+    pthread_mutex_unlock(&origin_lock);
+    LOG_PRINT(LOG_INFO, "Image[%s] Got from Origin, len: %lu.", md5, (unsigned long)len);
+    ret = ZIMG_OK;
+
+done:
+    free(buff);
+    return ret;
+}
+
+/* on a fetch thread, the waiters are called back when it is done */
+static void fetch_job(void *arg)
+{
+    origin_fetch_t *f = (origin_fetch_t *)arg;
+    origin_fetch_t **pp;
+    origin_waiter_t *w, *next;
+    int ret;
+
+    ret = fetch_store(f->md5);
+
+    //a miss coming later finds the image stored, or starts a new fetch
+    pthread_mutex_lock(&origin_lock);
+    ninflight--;
+    if(ret == ZIMG_ERR)
+        nfailed++;
+    for(pp = &fetching; *pp != f; pp = &(*pp)->next);
+    *pp = f->next;
+    pthread_mutex_unlock(&origin_lock);
+
+    for(w = f->waiters; w != NULL; w = next)
+    {
+        next = w->next;
+        w->ret = ret;
+        if(aio_loop_post(w->loop, waiter_run, w) == ZIMG_ERR)
+        {
+            LOG_PRINT(LOG_ERROR, "Post Image[%s] from Origin to Loop Failed!", f->md5);
+            free(w);
+        }
+    }
+    free(f);
+}
+
+static void waiter_run(void *arg)
+{
+    origin_waiter_t *w = (origin_waiter_t *)arg;
+
+    w->cb(w->ret, w->arg);
+    free(w);
+}
+
+/**
+ * @brief origin_fetch Store an original got from the origin by a fetch
+ * thread. If it is being fetched for another miss, the caller waits for
+ * that fetch.
+ *
+ * @param md5 The md5 of the image.
+ * @param loop The loop of the thread of the caller, from aio_loop_get().
+ * @param cb It is called in the thread of loop when the fetch is done.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for started and ZIMG_ERR for fail, then cb is not called.
+ */
+int origin_fetch(const char *md5, aio_loop_t *loop, origin_cb cb, void *arg)
+{
+    origin_fetch_t *f;
+    origin_waiter_t *w;
+
+    if(!origin_started || loop == NULL)
+        return ZIMG_ERR;
+    if((w = (origin_waiter_t *)calloc(1, sizeof(origin_waiter_t))) == NULL)
+        return ZIMG_ERR;
+    w->loop = loop;
+    w->cb = cb;
+    w->arg = arg;
+
+    pthread_mutex_lock(&origin_lock);
+    for(f = fetching; f != NULL && strcmp(f->md5, md5) != 0; f = f->next);
+    if(f != NULL)
+    {
+        w->next = f->waiters;
+        f->waiters = w;
+        ncoalesced++;
+        pthread_mutex_unlock(&origin_lock);
+        return ZIMG_OK;
+    }
+    if((f = (origin_fetch_t *)calloc(1, sizeof(origin_fetch_t))) == NULL)
+    {
+        pthread_mutex_unlock(&origin_lock);
+        free(w);
+        return ZIMG_ERR;
+    }
+    snprintf(f->md5, sizeof(f->md5), "%s", md5);
+    f->waiters = w;
+    //the job is added under the lock, so no miss joins a fetch never run
+    if(thread_pool_add(origin_pool, fetch_job, f) == ZIMG_ERR)
+    {
+        pthread_mutex_unlock(&origin_lock);
+        free(f);
+        free(w);
+        return ZIMG_ERR;
+    }
+    f->next = fetching;
+    fetching = f;
+    nfetches++;
+    ninflight++;
+    pthread_mutex_unlock(&origin_lock);
+    return ZIMG_OK;
+}
+
+void origin_stats(origin_stats_t *st)
+{
+    pthread_mutex_lock(&origin_lock);
+    st->fetches = nfetches;
+    st->coalesced = ncoalesced;
+    st->failed = nfailed;
+    st->bytes = nbytes;
+    st->inflight = ninflight;
+    pthread_mutex_unlock(&origin_lock);
+}
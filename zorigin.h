@@ -0,0 +1,53 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zorigin.h
+ * @brief Origin read-through header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZORIGIN_H
+#define ZORIGIN_H
+
+#include <stdint.h>
+#include "zcommon.h"
+
+#define ORIGIN_TIMEOUT 10               /* seconds to wait for the origin at most */
+#define ORIGIN_CACHE_SIZE 10240         /* MB of disk for the originals got and the variants, if -B is not set */
+#define ORIGIN_MAX_SIZE (64 * 1024 * 1024)      /* bytes of an original at most */
+#define ORIGIN_THREADS 8                /* fetches at the same time at most */
+
+struct aio_loop_s;
+
+/* called in the thread of the loop of the miss, ret is ZIMG_OK for stored */
+typedef void (*origin_cb)(int ret, void *arg);
+
+typedef struct origin_stats_s {
+    uint64_t fetches;                   /* requests sent to the origin */
+    uint64_t coalesced;                 /* misses waiting for a fetch of another one */
+    uint64_t failed;
+    uint64_t bytes;
+    int inflight;
+} origin_stats_t;
+
+int origin_init(const char *url);
+void origin_destroy(void);
+bool origin_on(void);
+int origin_fetch(const char *md5, struct aio_loop_s *loop, origin_cb cb, void *arg);
+void origin_stats(origin_stats_t *st);
+
+#endif
@@ -0,0 +1,190 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zrender.c
+ * @brief Admission of renders by a bounded queue. Images which must be
+ * resized are rendered by a pool of limit threads instead of the workers, so
+ * a burst of misses cannot take all the CPU. At most queue_max renders wait,
+ * the others are shed at once, and one which waited more than wait_ms is
+ * shed when its turn comes, as its client has likely given up. Images in the
+ * cache or on disk never come here.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "zrender.h"
+#include "zthread.h"
+#include "zlog.h"
+
+typedef struct render_job_s {
+    render_cb cb;
+    void *arg;
+    uint64_t queued_us;
+} render_job_t;
+
+static thread_pool_t *render_pool = NULL;
+static int render_limit = 0;
+static int render_queue_max = 0;
+static int render_wait_ms = 0;
+static int npending = 0;                /* queued and running */
+static int nrunning = 0;
+static uint64_t nrendered = 0;
+static uint64_t nrejected = 0;
+static uint64_t nexpired = 0;
+
+static uint64_t now_us(void);
+static void render_job(void *arg);
+
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief render_init Start the render threads.
+ *
+ * @param limit The number of renders at the same time.
+ * @param queue_max The number of renders waiting at most.
+ * @param wait_ms The time a render may wait, 0 for no limit.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int render_init(int limit, int queue_max, int wait_ms)
+{
+    if(limit <= 0 || queue_max < 0 || (render_pool = thread_pool_new(limit)) == NULL)
+        return ZIMG_ERR;
+    render_limit = limit;
+    render_queue_max = queue_max;
+    render_wait_ms = wait_ms;
+    LOG_PRINT(LOG_INFO, "Render %d Images at Most, %d Wait for %d ms at Most.", limit, queue_max, wait_ms);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief render_destroy Stop the render threads after their jobs are done.
+ */
+void render_destroy(void)
+{
+    if(render_pool == NULL)
+        return;
+    thread_pool_free(render_pool);
+    render_pool = NULL;
+}
+
+/**
+ * @brief render_on Check renders are admitted by the queue.
+ */
+bool render_on(void)
+{
+    return render_pool != NULL;
+}
+
+/**
+ * @brief render_wait Get the time in ms a render may wait in the queue, 0
+ * for no limit.
+ */
+int render_wait(void)
+{
+    return render_wait_ms;
+}
+
+/**
+ * @brief render_retry_after Get the seconds a shed client should wait
+ * before it asks again, about the time a full queue takes.
+ */
+int render_retry_after(void)
+{
+    return render_wait_ms > 1000 ? (render_wait_ms + 999) / 1000 : 1;
+}
+
+static void render_job(void *arg)
+{
+    render_job_t *job = (render_job_t *)arg;
+
+    //the caller times the wait itself, this is the last check
+    if(render_wait_ms > 0 && now_us() - job->queued_us > (uint64_t)render_wait_ms * 1000)
+    {
+        __sync_add_and_fetch(&nexpired, 1);
+        job->cb(true, job->arg);
+    }
+    else
+    {
+        __sync_add_and_fetch(&nrunning, 1);
+        job->cb(false, job->arg);
+        __sync_sub_and_fetch(&nrunning, 1);
+        __sync_add_and_fetch(&nrendered, 1);
+    }
+    __sync_sub_and_fetch(&npending, 1);
+    free(job);
+}
+
+/**
+ * @brief render_submit Queue a render.
+ *
+ * @param cb It renders the image, or answers the request if expired.
+ * @param arg The arg of cb.
+ *
+ * @return ZIMG_OK for queued and ZIMG_ERR if it is shed.
+ */
+int render_submit(render_cb cb, void *arg)
+{
+    render_job_t *job;
+
+    if(render_pool == NULL)
+        return ZIMG_ERR;
+    //the slot is taken before the job is added, so no more than queue_max
+    //jobs wait behind the running ones
+    if(__sync_add_and_fetch(&npending, 1) > render_limit + render_queue_max)
+    {
+        __sync_sub_and_fetch(&npending, 1);
+        __sync_add_and_fetch(&nrejected, 1);
+        return ZIMG_ERR;
+    }
+    if((job = (render_job_t *)malloc(sizeof(render_job_t))) == NULL)
+        goto err;
+    job->cb = cb;
+    job->arg = arg;
+    job->queued_us = now_us();
+    if(thread_pool_add(render_pool, render_job, job) == ZIMG_ERR)
+    {
+        free(job);
+        goto err;
+    }
+    return ZIMG_OK;
+
+err:
+    __sync_sub_and_fetch(&npending, 1);
+    __sync_add_and_fetch(&nrejected, 1);
+    return ZIMG_ERR;
+}
+
+void render_stats(render_stats_t *st)
+{
+    st->limit = render_limit;
+    st->queue_max = render_queue_max;
+    st->wait_ms = render_wait_ms;
+    st->running = __sync_add_and_fetch(&nrunning, 0);
+    st->queued = __sync_add_and_fetch(&npending, 0) - st->running;
+    if(st->queued < 0)
+        st->queued = 0;
+    st->rendered = __sync_add_and_fetch(&nrendered, 0);
+    st->rejected = __sync_add_and_fetch(&nrejected, 0);
+    st->expired = __sync_add_and_fetch(&nexpired, 0);
+}
@@ -0,0 +1,51 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zrender.h
+ * @brief Admission of renders by a bounded queue header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZRENDER_H
+#define ZRENDER_H
+
+#include <stdint.h>
+#include "zcommon.h"
+
+/* called in a render thread, expired if the job waited past the deadline */
+typedef void (*render_cb)(bool expired, void *arg);
+
+typedef struct render_stats_s {
+    int limit;                          /* renders at the same time at most */
+    int queue_max;
+    int wait_ms;
+    int queued;
+    int running;
+    uint64_t rendered;
+    uint64_t rejected;                  /* shed as the queue is full */
+    uint64_t expired;                   /* shed as they waited too long */
+} render_stats_t;
+
+int render_init(int limit, int queue_max, int wait_ms);
+void render_destroy(void);
+bool render_on(void);
+int render_wait(void);
+int render_retry_after(void);
+int render_submit(render_cb cb, void *arg);
+void render_stats(render_stats_t *st);
+
+#endif
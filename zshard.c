@@ -0,0 +1,217 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zshard.c
+ * @brief Listeners sharded by SO_REUSEPORT. Every shard has its own socket
+ * bound to the port, its own event_base and evhtp, and a thread running
+ * them, so the kernel spreads the new connections over the sockets and no
+ * accept queue is shared. A connection stays in the thread which accepted
+ * it. The first shard runs on the event_base of the caller.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "zshard.h"
+#include "zlog.h"
+
+typedef struct shard_s {
+    struct event_base *base;
+    evhtp_t *htp;
+    pthread_t tid;
+    bool own_base;              /* the base is made and run by the shard */
+    bool bound;
+    bool running;
+    uint64_t accepted;
+} shard_t;
+
+static shard_t *shards = NULL;
+static int nshards = 0;
+
+static int listen_socket(int port, int backlog);
+static evhtp_res shard_accept_cb(evhtp_connection_t *conn, void *arg);
+static void *shard_run(void *arg);
+
+
+/**
+ * @brief listen_socket Make a listening socket of the port which other
+ * sockets may bind too.
+ *
+ * @param port The port.
+ * @param backlog The backlog of the socket.
+ *
+ * @return The socket or -1 for fail.
+ */
+static int listen_socket(int port, int backlog)
+{
+    struct sockaddr_in sin;
+    int fd, on = 1;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+            || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1
+            || evutil_make_socket_nonblocking(fd) == -1
+            || evutil_make_socket_closeonexec(fd) == -1
+            || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1
+            || listen(fd, backlog) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static evhtp_res shard_accept_cb(evhtp_connection_t *conn, void *arg)
+{
+    __sync_fetch_and_add(&((shard_t *)arg)->accepted, 1);
+    return EVHTP_RES_OK;
+}
+
+static void *shard_run(void *arg)
+{
+    shard_t *sh = (shard_t *)arg;
+
+    event_base_loop(sh->base, 0);
+    return NULL;
+}
+
+/**
+ * @brief shard_start Start the shards listening on a port. The bases are
+ * woken by shard_stop() from another thread, so main() calls
+ * evthread_use_pthreads() before any of them is made.
+ *
+ * @param base The event_base of the caller, the first shard runs on it when
+ * the caller runs it.
+ * @param num The number of shards.
+ * @param port The port.
+ * @param backlog The backlog of each socket.
+ * @param setup It sets the callbacks and options of the evhtp of each shard.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail, then nothing listens.
+ */
+int shard_start(struct event_base *base, int num, int port, int backlog, shard_setup_cb setup)
+{
+#if defined(SO_REUSEPORT) && !defined(NO_EVHTP_ACCEPT_SOCKET) && !defined(EVHTP_DISABLE_EVTHR)
+    shard_t *sh;
+    int i, fd;
+
+    if(num < 1 || num > SHARD_MAX)
+    {
+        LOG_PRINT(LOG_ERROR, "Shards[%d] Must Be 1 to %d!", num, SHARD_MAX);
+        return ZIMG_ERR;
+    }
+    if((shards = (shard_t *)calloc(num, sizeof(shard_t))) == NULL)
+        return ZIMG_ERR;
+    for(i = 0; i < num; i++)
+    {
+        sh = &shards[i];
+        sh->own_base = i > 0;
+        if((sh->base = i > 0 ? event_base_new() : base) == NULL)
+            goto err;
+        if((sh->htp = evhtp_new(sh->base, NULL)) == NULL)
+        {
+            if(sh->own_base)
+                event_base_free(sh->base);
+            goto err;
+        }
+        nshards++;
+        setup(sh->htp);
+        evhtp_set_post_accept_cb(sh->htp, shard_accept_cb, sh);
+        if((fd = listen_socket(port, backlog)) == -1)
+        {
+            LOG_PRINT(LOG_ERROR, "Shard[%d] Bind Port[%d] Failed!", i, port);
+            goto err;
+        }
+        if(evhtp_accept_socket(sh->htp, fd, backlog) != 0)
+        {
+            close(fd);
+            goto err;
+        }
+        sh->bound = true;
+    }
+    //the sockets of all shards are bound before any connection is accepted
+    for(i = 1; i < num; i++)
+    {
+        if(pthread_create(&shards[i].tid, NULL, shard_run, &shards[i]) != 0)
+        {
+            LOG_PRINT(LOG_ERROR, "Shard[%d] Thread Start Failed!", i);
+            goto err;
+        }
+        shards[i].running = true;
+    }
+    LOG_PRINT(LOG_INFO, "%d Shards Listen on Port[%d].", num, port);
+    return ZIMG_OK;
+
+err:
+    shard_stop();
+    return ZIMG_ERR;
+#else
+    LOG_PRINT(LOG_ERROR, "Shards Need SO_REUSEPORT, Threads and evhtp_accept_socket()!");
+    return ZIMG_ERR;
+#endif
+}
+
+/**
+ * @brief shard_stop Stop the threads of the shards and free them. The
+ * event_base of the caller is not freed.
+ */
+void shard_stop(void)
+{
+    int i;
+
+    for(i = 1; i < nshards; i++)
+    {
+        if(shards[i].running)
+        {
+            event_base_loopexit(shards[i].base, NULL);
+            pthread_join(shards[i].tid, NULL);
+        }
+    }
+    for(i = 0; i < nshards; i++)
+    {
+        if(shards[i].bound)
+            evhtp_unbind_socket(shards[i].htp);
+        evhtp_free(shards[i].htp);
+        if(shards[i].own_base)
+            event_base_free(shards[i].base);
+    }
+    free(shards);
+    shards = NULL;
+    nshards = 0;
+}
+
+int shard_count(void)
+{
+    return nshards;
+}
+
+/**
+ * @brief shard_accepted Get the number of connections a shard accepted.
+ */
+uint64_t shard_accepted(int i)
+{
+    return __sync_add_and_fetch(&shards[i].accepted, 0);
+}
@@ -0,0 +1,40 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zshard.h
+ * @brief Listeners sharded by SO_REUSEPORT header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZSHARD_H
+#define ZSHARD_H
+
+#include <stdint.h>
+#include <evhtp.h>
+#include "zcommon.h"
+
+#define SHARD_MAX 256
+
+/* sets the callbacks and options of the evhtp of a shard */
+typedef void (*shard_setup_cb)(evhtp_t *htp);
+
+int shard_start(struct event_base *base, int num, int port, int backlog, shard_setup_cb setup);
+void shard_stop(void);
+int shard_count(void);
+uint64_t shard_accepted(int i);
+
+#endif
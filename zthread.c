@@ -0,0 +1,169 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zthread.c
+ * @brief A pool of worker threads, they run jobs in the order of adding.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include "zthread.h"
+#include "zlog.h"
+
+static void *worker(void *arg);
+
+
+/**
+ * @brief worker The loop of a worker thread. It exits when the pool is
+ * stopped and no job is left.
+ *
+ * @param arg The pool.
+ *
+ * @return NULL.
+ */
+static void *worker(void *arg)
+{
+    thread_pool_t *pool = (thread_pool_t *)arg;
+    thread_job_t *job;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->head == NULL && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        job = pool->head;
+        if(job == NULL)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pool->head = job->next;
+        if(pool->head == NULL)
+            pool->tail = NULL;
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->cb(job->arg);
+        free(job);
+    }
+    return NULL;
+}
+
+/**
+ * @brief thread_pool_new Create a pool and start its threads.
+ *
+ * @param num_threads The number of threads.
+ *
+ * @return The pool or NULL for fail.
+ */
+thread_pool_t *thread_pool_new(int num_threads)
+{
+    int i;
+
+    if(num_threads <= 0)
+        return NULL;
+
+    thread_pool_t *pool = (thread_pool_t *)calloc(1, sizeof(thread_pool_t));
+    if(pool == NULL)
+        return NULL;
+    pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+    if(pool->threads == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for(i = 0; i < num_threads; i++)
+    {
+        if(pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+        {
+            LOG_PRINT(LOG_ERROR, "Worker Thread Create Failed!");
+            break;
+        }
+        pool->num_threads++;
+    }
+
+    if(pool->num_threads == 0)
+    {
+        thread_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+ * @brief thread_pool_add Add a job to the pool.
+ *
+ * @param pool The pool.
+ * @param cb The job, it is called in a worker thread.
+ * @param arg The arg of cb.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int thread_pool_add(thread_pool_t *pool, thread_job_cb cb, void *arg)
+{
+    thread_job_t *job = (thread_job_t *)malloc(sizeof(thread_job_t));
+    if(job == NULL)
+        return ZIMG_ERR;
+    job->cb = cb;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->stop)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        free(job);
+        return ZIMG_ERR;
+    }
+    if(pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->queued++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief thread_pool_free Stop the pool after the queued jobs are done and
+ * free it.
+ *
+ * @param pool The pool.
+ */
+void thread_pool_free(thread_pool_t *pool)
+{
+    int i;
+
+    if(pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,52 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zthread.h
+ * @brief A pool of worker threads header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZTHREAD_H
+#define ZTHREAD_H
+
+#include <pthread.h>
+#include "zcommon.h"
+
+typedef void (*thread_job_cb)(void *arg);
+
+typedef struct thread_job_s {
+    thread_job_cb cb;
+    void *arg;
+    struct thread_job_s *next;
+} thread_job_t;
+
+typedef struct thread_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    thread_job_t *head;         /* jobs waiting for a thread */
+    thread_job_t *tail;
+    int queued;
+    bool stop;
+    int num_threads;
+    pthread_t *threads;
+} thread_pool_t;
+
+thread_pool_t *thread_pool_new(int num_threads);
+int thread_pool_add(thread_pool_t *pool, thread_job_cb cb, void *arg);
+void thread_pool_free(thread_pool_t *pool);
+
+#endif
@@ -0,0 +1,629 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file ztier.c
+ * @brief Hot tier of images on fast media, such as NVMe or tmpfs. The slow
+ * img_path keeps every image, the fast root keeps copies of the hot ones in
+ * the same lvl1/lvl2/md5 fan-out. Disk hits are counted, an image hit often
+ * enough is copied to the fast root by a background thread, and the hits are
+ * halved every interval. When the copies take more than the budget, the ones
+ * with the fewest hits are removed from the fast root.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ztier.h"
+#include "zdir.h"
+#include "zimg.h"
+#include "zvolume.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define TIER_COLD 0                     /* only its hits are counted */
+#define TIER_QUEUED 1                   /* waiting to be promoted */
+#define TIER_HOT 2                      /* copied to the fast root */
+
+typedef struct tier_entry_s {
+    char *key;                          /* md5/name */
+    uint32_t hits;
+    int state;
+    uint64_t size;
+    struct tier_entry_s *hnext;
+} tier_entry_t;
+
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_cond = PTHREAD_COND_INITIALIZER;
+static tier_entry_t **buckets = NULL;
+static size_t nbuckets = 0;
+static size_t nentries = 0;
+static char *queue[TIER_QUEUE_MAX];     /* keys to promote */
+static int qhead = 0;
+static int qlen = 0;
+static int fast_root = -1;
+static uint64_t tier_budget = 0;
+static uint64_t hot_count = 0;
+static uint64_t hot_bytes = 0;
+static uint64_t promotions = 0;
+static uint64_t demotions = 0;
+static uint64_t fast_hits = 0;
+static uint64_t slow_hits = 0;
+static bool tier_started = false;
+static volatile bool tier_stop = false;
+static pthread_t tier_tid;
+
+static uint32_t key_hash(const char *key);
+static tier_entry_t *entry_find(const char *key);
+static tier_entry_t *entry_insert(const char *key);
+static void entry_remove(tier_entry_t *e);
+static int promote(const char *key);
+static int hits_cmp(const void *a, const void *b);
+static void demote(void);
+static void decay(void);
+static void scan_fast(int fd, int depth, const char *md5);
+static void *tier_thread(void *arg);
+
+
+/* FNV-1a */
+static uint32_t key_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+    while(*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief entry_find Find the entry of an image, tier_lock must be held.
+ */
+static tier_entry_t *entry_find(const char *key)
+{
+    tier_entry_t *e;
+    if(nbuckets == 0)
+        return NULL;
+    for(e = buckets[key_hash(key) % nbuckets]; e != NULL; e = e->hnext)
+    {
+        if(strcmp(e->key, key) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief entry_insert Add a cold entry of an image, tier_lock must be held.
+ *
+ * @param key The key of the image.
+ *
+ * @return The entry or NULL for fail.
+ */
+static tier_entry_t *entry_insert(const char *key)
+{
+    tier_entry_t *e;
+    size_t i;
+
+    if(nentries >= nbuckets)
+    {
+        size_t n = nbuckets ? nbuckets * 2 : 1024;
+        tier_entry_t **nb = (tier_entry_t **)calloc(n, sizeof(tier_entry_t *));
+        if(nb == NULL)
+            return NULL;
+        for(i = 0; i < nbuckets; i++)
+        {
+            while((e = buckets[i]) != NULL)
+            {
+                buckets[i] = e->hnext;
+                e->hnext = nb[key_hash(e->key) % n];
+                nb[key_hash(e->key) % n] = e;
+            }
+        }
+        free(buckets);
+        buckets = nb;
+        nbuckets = n;
+    }
+
+    e = (tier_entry_t *)calloc(1, sizeof(tier_entry_t));
+    if(e == NULL || (e->key = strdup(key)) == NULL)
+    {
+        free(e);
+        return NULL;
+    }
+    e->state = TIER_COLD;
+    e->hnext = buckets[key_hash(key) % nbuckets];
+    buckets[key_hash(key) % nbuckets] = e;
+    nentries++;
+    return e;
+}
+
+/**
+ * @brief entry_remove Remove an entry from the hash and free it, tier_lock
+ * must be held.
+ */
+static void entry_remove(tier_entry_t *e)
+{
+    tier_entry_t **pe = &buckets[key_hash(e->key) % nbuckets];
+    while(*pe != e)
+        pe = &(*pe)->hnext;
+    *pe = e->hnext;
+    if(e->state == TIER_HOT)
+    {
+        hot_count--;
+        hot_bytes -= e->size;
+    }
+    nentries--;
+    free(e->key);
+    free(e);
+}
+
+/**
+ * @brief promote Copy an image from the slow tier to the fast root. The copy
+ * is written to a temp file and renamed, so a partial one is never read.
+ *
+ * @param key The key of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int promote(const char *key)
+{
+    const char *name = strchr(key, '/') + 1;
+    char md5[40], tmp[512];
+    char *buff = NULL;
+    size_t len = 0;
+    tier_entry_t *e;
+    zdir_t dir;
+    int fd = -1, ret = ZIMG_ERR;
+
+    snprintf(md5, sizeof(md5), "%.*s", (int)(name - 1 - key), key);
+    if(read_cold_img(md5, name, &buff, &len) == ZIMG_ERR)
+        goto done;
+    if(dir_open_root(fast_root, md5, true, &dir) == ZIMG_ERR)
+        goto done;
+    snprintf(tmp, sizeof(tmp), "%s/.%s.tier", md5, name);
+    if((mkdirat(dir.fd, md5, 00755) == 0 || errno == EEXIST)
+            && (fd = openat(dir.fd, tmp, O_WRONLY | O_TRUNC | O_CREAT, 00644)) != -1
+            && write_all(fd, buff, len) == ZIMG_OK
+            && renameat(dir.fd, tmp, dir.fd, key) == 0)
+        ret = ZIMG_OK;
+    if(fd != -1)
+        close(fd);
+    if(ret == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_WARNING, "Image[%s] Promote Failed!", key);
+        unlinkat(dir.fd, tmp, 0);
+    }
+
+    pthread_mutex_lock(&tier_lock);
+    e = entry_find(key);
+    if(ret == ZIMG_OK && e == NULL)
+    {
+        //removed meanwhile
+        unlinkat(dir.fd, key, 0);
+        ret = ZIMG_ERR;
+    }
+    else if(e != NULL && e->state == TIER_QUEUED)
+    {
+        e->state = ret == ZIMG_OK ? TIER_HOT : TIER_COLD;
+        if(ret == ZIMG_OK)
+        {
+            e->size = len;
+            hot_count++;
+            hot_bytes += len;
+            promotions++;
+        }
+    }
+    pthread_mutex_unlock(&tier_lock);
+    dir_close(&dir);
+
+done:
+    free(buff);
+    return ret;
+}
+
+/* the fewest hits first */
+static int hits_cmp(const void *a, const void *b)
+{
+    uint32_t ha = (*(tier_entry_t * const *)a)->hits;
+    uint32_t hb = (*(tier_entry_t * const *)b)->hits;
+    return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+/**
+ * @brief demote Remove the copies with the fewest hits from the fast root
+ * until they take no more than TIER_LOW_MARK percent of the budget. tier_lock
+ * must be held, it is released while files are removed.
+ */
+static void demote(void)
+{
+    uint64_t low = tier_budget / 100 * TIER_LOW_MARK;
+    tier_entry_t **hot, *e;
+    char **keys;
+    size_t i, n = 0, k = 0;
+    char md5[40];
+    zdir_t dir;
+
+    hot = (tier_entry_t **)malloc(hot_count * sizeof(tier_entry_t *));
+    keys = (char **)malloc(hot_count * sizeof(char *));
+    if(hot == NULL || keys == NULL)
+        goto done;
+    for(i = 0; i < nbuckets; i++)
+    {
+        for(e = buckets[i]; e != NULL; e = e->hnext)
+        {
+            if(e->state == TIER_HOT)
+                hot[n++] = e;
+        }
+    }
+    qsort(hot, n, sizeof(tier_entry_t *), hits_cmp);
+    for(i = 0; i < n && hot_bytes > low; i++)
+    {
+        if((keys[k] = strdup(hot[i]->key)) == NULL)
+            break;
+        k++;
+        entry_remove(hot[i]);
+        demotions++;
+    }
+    pthread_mutex_unlock(&tier_lock);
+
+    for(i = 0; i < k; i++)
+    {
+        snprintf(md5, sizeof(md5), "%.*s", (int)(strchr(keys[i], '/') - keys[i]), keys[i]);
+        if(dir_open_root(fast_root, md5, false, &dir) == ZIMG_OK)
+        {
+            unlinkat(dir.fd, keys[i], 0);
+            dir_close(&dir);
+        }
+        free(keys[i]);
+    }
+    LOG_PRINT(LOG_INFO, "Images Demoted: %lu, hot: %llu bytes: %llu.", (unsigned long)k,
+            (unsigned long long)hot_count, (unsigned long long)hot_bytes);
+    pthread_mutex_lock(&tier_lock);
+
+done:
+    free(hot);
+    free(keys);
+}
+
+/**
+ * @brief decay Halve the hits of all images, the cold ones without hits are
+ * forgotten. tier_lock must be held.
+ */
+static void decay(void)
+{
+    tier_entry_t *e, *next;
+    size_t i;
+
+    for(i = 0; i < nbuckets; i++)
+    {
+        for(e = buckets[i]; e != NULL; e = next)
+        {
+            next = e->hnext;
+            e->hits >>= 1;
+            if(e->hits == 0 && e->state == TIER_COLD)
+                entry_remove(e);
+        }
+    }
+}
+
+/**
+ * @brief scan_fast Load the copies left in the fast root by the last run,
+ * they have no hits yet.
+ *
+ * @param fd The fd of a directory, it is closed.
+ * @param depth 0 for the fast root, 3 for a md5 directory.
+ * @param md5 The md5 of the directory at depth 3.
+ */
+static void scan_fast(int fd, int depth, const char *md5)
+{
+    char key[VOLUME_KEY_MAX];
+    struct dirent *ent;
+    struct stat st;
+    tier_entry_t *e;
+    DIR *d;
+    int sub;
+
+    if((d = fdopendir(fd)) == NULL)
+    {
+        close(fd);
+        return;
+    }
+    while(!tier_stop && (ent = readdir(d)) != NULL)
+    {
+        if(ent->d_name[0] == '.')
+        {
+            //a promotion broken by the last run
+            if(depth == 3 && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+                unlinkat(dirfd(d), ent->d_name, 0);
+            continue;
+        }
+        if(depth == 3)
+        {
+            if(fstatat(dirfd(d), ent->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+                continue;
+            snprintf(key, sizeof(key), "%s/%s", md5, ent->d_name);
+            pthread_mutex_lock(&tier_lock);
+            if((e = entry_find(key)) == NULL)
+                e = entry_insert(key);
+            if(e != NULL && e->state != TIER_HOT)
+            {
+                e->state = TIER_HOT;
+                e->size = st.st_size;
+                hot_count++;
+                hot_bytes += st.st_size;
+            }
+            pthread_mutex_unlock(&tier_lock);
+        }
+        else if((depth < 2 && strspn(ent->d_name, "0123456789") == strlen(ent->d_name))
+                || (depth == 2 && strlen(ent->d_name) == 32))
+        {
+            if((sub = openat(dirfd(d), ent->d_name, O_RDONLY | O_DIRECTORY)) != -1)
+                scan_fast(sub, depth + 1, ent->d_name);
+        }
+    }
+    closedir(d);
+}
+
+static void *tier_thread(void *arg)
+{
+    const char *path = (const char *)arg;
+    struct timespec ts;
+    time_t next;
+    char *key;
+    int fd;
+
+    if((fd = open(path, O_RDONLY | O_DIRECTORY)) != -1)
+        scan_fast(fd, 0, NULL);
+
+    pthread_mutex_lock(&tier_lock);
+    LOG_PRINT(LOG_INFO, "Fast Tier Loaded, hot: %llu bytes: %llu.",
+            (unsigned long long)hot_count, (unsigned long long)hot_bytes);
+    next = time(NULL) + TIER_INTERVAL;
+    while(!tier_stop)
+    {
+        while(qlen > 0 && !tier_stop)
+        {
+            key = queue[qhead];
+            qhead = (qhead + 1) % TIER_QUEUE_MAX;
+            qlen--;
+            pthread_mutex_unlock(&tier_lock);
+            promote(key);
+            free(key);
+            pthread_mutex_lock(&tier_lock);
+        }
+        if(hot_bytes > tier_budget)
+            demote();
+        if(time(NULL) >= next)
+        {
+            decay();
+            next = time(NULL) + TIER_INTERVAL;
+        }
+        if(tier_stop || qlen > 0)
+            continue;
+        ts.tv_sec = next;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&tier_cond, &tier_lock, &ts);
+    }
+    pthread_mutex_unlock(&tier_lock);
+    return NULL;
+}
+
+/**
+ * @brief tier_init Add the fast root and start the thread promoting and
+ * demoting images. The copies left by the last run are loaded in the
+ * background.
+ *
+ * @param path The fast root, it must not be under img_path.
+ * @param budget Bytes the copies may take in the fast root.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int tier_init(const char *path, uint64_t budget)
+{
+    static char fast_path[512];
+
+    if((fast_root = dir_root_add(path)) == ZIMG_ERR)
+        return ZIMG_ERR;
+    snprintf(fast_path, sizeof(fast_path), "%s", path);
+    tier_budget = budget;
+    tier_stop = false;
+    tier_started = true;
+    if(pthread_create(&tier_tid, NULL, tier_thread, fast_path) != 0)
+    {
+        LOG_PRINT(LOG_ERROR, "Tier Thread Create Failed!");
+        tier_started = false;
+        return ZIMG_ERR;
+    }
+    LOG_PRINT(LOG_INFO, "Fast Tier[%s] Init, budget: %llu.", path, (unsigned long long)budget);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief tier_destroy Stop the thread and forget the hits. The copies are
+ * kept for the next run.
+ */
+void tier_destroy(void)
+{
+    tier_entry_t *e;
+    size_t i;
+
+    if(!tier_started)
+        return;
+    pthread_mutex_lock(&tier_lock);
+    tier_stop = true;
+    pthread_cond_signal(&tier_cond);
+    pthread_mutex_unlock(&tier_lock);
+    pthread_join(tier_tid, NULL);
+    tier_started = false;
+
+    for(; qlen > 0; qlen--)
+    {
+        free(queue[qhead]);
+        qhead = (qhead + 1) % TIER_QUEUE_MAX;
+    }
+    for(i = 0; i < nbuckets; i++)
+    {
+        while((e = buckets[i]) != NULL)
+        {
+            buckets[i] = e->hnext;
+            free(e->key);
+            free(e);
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    nbuckets = nentries = 0;
+    hot_count = hot_bytes = 0;
+    promotions = demotions = fast_hits = slow_hits = 0;
+}
+
+/**
+ * @brief tier_on Check the fast tier is used.
+ *
+ * @return true for used.
+ */
+bool tier_on(void)
+{
+    return tier_started;
+}
+
+/**
+ * @brief tier_open Open the copy of an image in the fast root.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the image.
+ * @param fd It gets the fd, the caller must close it.
+ * @param len It gets the length of the image.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found.
+ */
+int tier_open(const char *md5, const char *name, int *fd, size_t *len)
+{
+    char path[512];
+    struct stat st;
+    zdir_t dir;
+
+    if(!tier_started || dir_open_root(fast_root, md5, false, &dir) == ZIMG_ERR)
+        return ZIMG_ERR;
+    snprintf(path, sizeof(path), "%s/%s", md5, name);
+    *fd = openat(dir.fd, path, O_RDONLY);
+    dir_close(&dir);
+    if(*fd == -1)
+        return ZIMG_ERR;
+    if(fstat(*fd, &st) == -1)
+    {
+        close(*fd);
+        *fd = -1;
+        return ZIMG_ERR;
+    }
+    *len = st.st_size;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief tier_touch Count a disk hit of an image. It is queued to be
+ * promoted when it is hit often enough.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the image.
+ * @param size The length of the image.
+ */
+void tier_touch(const char *md5, const char *name, uint64_t size)
+{
+    char key[VOLUME_KEY_MAX];
+    tier_entry_t *e;
+    char *k;
+
+    if(!tier_started)
+        return;
+    snprintf(key, sizeof(key), "%s/%s", md5, name);
+    pthread_mutex_lock(&tier_lock);
+    if((e = entry_find(key)) == NULL && (e = entry_insert(key)) == NULL)
+    {
+        pthread_mutex_unlock(&tier_lock);
+        return;
+    }
+    if(e->hits < UINT32_MAX)
+        e->hits++;
+    if(e->state == TIER_HOT)
+    {
+        fast_hits++;
+    }
+    else
+    {
+        slow_hits++;
+        if(e->state == TIER_COLD && e->hits >= TIER_PROMOTE_HITS && size <= tier_budget / 100 * TIER_LOW_MARK
+                && qlen < TIER_QUEUE_MAX && (k = strdup(key)) != NULL)
+        {
+            queue[(qhead + qlen) % TIER_QUEUE_MAX] = k;
+            qlen++;
+            e->state = TIER_QUEUED;
+            pthread_cond_signal(&tier_cond);
+        }
+    }
+    pthread_mutex_unlock(&tier_lock);
+}
+
+/**
+ * @brief tier_del Remove the copy of an image from the fast root, called
+ * when the image is removed.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the image.
+ */
+void tier_del(const char *md5, const char *name)
+{
+    char path[512];
+    tier_entry_t *e;
+    zdir_t dir;
+
+    if(!tier_started)
+        return;
+    snprintf(path, sizeof(path), "%s/%s", md5, name);
+    pthread_mutex_lock(&tier_lock);
+    if((e = entry_find(path)) != NULL)
+        entry_remove(e);
+    pthread_mutex_unlock(&tier_lock);
+    if(dir_open_root(fast_root, md5, false, &dir) == ZIMG_OK)
+    {
+        unlinkat(dir.fd, path, 0);
+        dir_close(&dir);
+    }
+}
+
+/**
+ * @brief tier_stats Get the usage of the fast tier.
+ *
+ * @param st It gets the stats.
+ */
+void tier_stats(tier_stats_t *st)
+{
+    pthread_mutex_lock(&tier_lock);
+    st->budget = tier_budget;
+    st->hot = hot_count;
+    st->bytes = hot_bytes;
+    st->queued = qlen;
+    st->promotions = promotions;
+    st->demotions = demotions;
+    st->fast_hits = fast_hits;
+    st->slow_hits = slow_hits;
+    pthread_mutex_unlock(&tier_lock);
+}
@@ -0,0 +1,54 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file ztier.h
+ * @brief Hot tier of images on fast media header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZTIER_H
+#define ZTIER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "zcommon.h"
+
+#define TIER_PROMOTE_HITS 3             /* disk hits in an interval to be promoted */
+#define TIER_INTERVAL 10                /* seconds between decays of hits and checks of the budget */
+#define TIER_LOW_MARK 90                /* percent of the budget left after demotion */
+#define TIER_QUEUE_MAX 1024             /* promotions waiting at most */
+
+typedef struct tier_stats_s {
+    uint64_t budget;
+    uint64_t hot;                       /* images in the fast tier */
+    uint64_t bytes;
+    uint64_t queued;
+    uint64_t promotions;
+    uint64_t demotions;
+    uint64_t fast_hits;
+    uint64_t slow_hits;
+} tier_stats_t;
+
+int tier_init(const char *path, uint64_t budget);
+void tier_destroy(void);
+bool tier_on(void);
+int tier_open(const char *md5, const char *name, int *fd, size_t *len);
+void tier_touch(const char *md5, const char *name, uint64_t size);
+void tier_del(const char *md5, const char *name);
+void tier_stats(tier_stats_t *st);
+
+#endif
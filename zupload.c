@@ -0,0 +1,961 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zupload.c
+ * @brief Receive uploaded images chunk by chunk. The form is parsed while
+ * the body is received, the md5 of the image is caculated at the same time
+ * and large images are written to a temp file, so the memory used by an
+ * upload is bounded. A body of application/octet-stream is the image
+ * itself and is stored without parsing. The files of a batch upload are saved by a pool of
+ * worker threads while the rest of the form is still being received.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <unistd.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "zupload.h"
+#include "zthread.h"
+#include "zutil.h"
+#include "zlog.h"
+#include "zorigin.h"
+#include "zcommit.h"
+
+extern struct setting settings;
+
+static thread_pool_t *upload_pool = NULL;
+
+static upload_file_t *file_new(upload_ctx_t *ctx);
+static void file_release(upload_file_t *file);
+static int file_fail(upload_file_t *file);
+static int file_save(upload_file_t *file);
+static void save_job(void *arg);
+static void save_end(upload_ctx_t *ctx);
+static void upload_resume(void *arg);
+static void ctx_release(upload_ctx_t *ctx);
+static int check_magic(upload_file_t *file);
+static int spill_file(upload_file_t *file);
+static int file_append(upload_file_t *file, const char *data, size_t len);
+static int file_end(upload_file_t *file);
+static int on_part_begin(multipart_parser_t *p, const char *head, size_t len);
+static int on_part_data(multipart_parser_t *p, const char *data, size_t len);
+static int on_part_end(multipart_parser_t *p);
+static evhtp_res upload_read_cb(evhtp_request_t *req, evbuf_t *buf, void *arg);
+static evhtp_res upload_fini_cb(evhtp_request_t *req, void *arg);
+static evhtp_res set_upload_hooks(evhtp_request_t *req, bool batch);
+
+static const multipart_cbs_t upload_cbs = {
+    on_part_begin,
+    on_part_data,
+    on_part_end
+};
+
+
+/**
+ * @brief upload_pool_init Start the worker threads which save the files of
+ * batch uploads.
+ *
+ * @param num_threads The number of threads.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int upload_pool_init(int num_threads)
+{
+    upload_pool = thread_pool_new(num_threads);
+    return upload_pool ? ZIMG_OK : ZIMG_ERR;
+}
+
+/**
+ * @brief upload_pool_destroy Stop the worker threads after their jobs are
+ * done.
+ */
+void upload_pool_destroy(void)
+{
+    thread_pool_free(upload_pool);
+    upload_pool = NULL;
+}
+
+/**
+ * @brief upload_ctx_new Create the context of a multipart upload request.
+ *
+ * @param req The request, its Content-Type must have a boundary.
+ * @param batch Take all files of the form or only the first one.
+ *
+ * @return The context or NULL for fail.
+ */
+upload_ctx_t *upload_ctx_new(evhtp_request_t *req, bool batch)
+{
+    const char *p = evhtp_header_find(req->headers_in, "Content-Type");
+    if(p == NULL)
+    {
+        LOG_PRINT(LOG_ERROR, "Content-Type error!");
+        return NULL;
+    }
+
+    //the body is the image itself, no form to parse
+    if(strncasecmp(p, "application/octet-stream", 24) == 0)
+    {
+        if(batch)
+        {
+            LOG_PRINT(LOG_ERROR, "Raw Body Can Not Be a Batch!");
+            return NULL;
+        }
+        return upload_ctx_new_raw();
+    }
+
+    if(strstr(p, "multipart/form-data") == 0)
+    {
+        LOG_PRINT(LOG_ERROR, "POST form error!");
+        return NULL;
+    }
+
+    p = strstr(p, "boundary=");
+    if(p == 0)
+    {
+        LOG_PRINT(LOG_ERROR, "boundary NOT found!");
+        return NULL;
+    }
+
+    //find the boundary
+    p += 9;
+    if(strlen(p) <= 0)
+    {
+        LOG_PRINT(LOG_ERROR, "boundary length error!");
+        return NULL;
+    }
+
+    upload_ctx_t *ctx = (upload_ctx_t *)calloc(1, sizeof(upload_ctx_t));
+    if(ctx == NULL)
+        return NULL;
+    ctx->batch = batch;
+    ctx->tail = &ctx->files;
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    if(multipart_init(&ctx->mp, p, &upload_cbs, ctx) == ZIMG_ERR)
+    {
+        upload_ctx_free(ctx);
+        return NULL;
+    }
+    LOG_PRINT(LOG_INFO, "boundary Find: boundary=%s", p);
+
+    ctx->state = UPLOAD_RECV;
+    return ctx;
+}
+
+/**
+ * @brief upload_ctx_new_raw Create the context of an upload whose body is
+ * the image itself. The body is hashed and stored as it is received without
+ * any parsing.
+ *
+ * @return The context or NULL for fail.
+ */
+upload_ctx_t *upload_ctx_new_raw(void)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)calloc(1, sizeof(upload_ctx_t));
+    if(ctx == NULL)
+        return NULL;
+    ctx->raw = true;
+    ctx->tail = &ctx->files;
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    ctx->file = file_new(ctx);
+    if(ctx->file == NULL)
+    {
+        upload_ctx_free(ctx);
+        return NULL;
+    }
+    strcpy(ctx->file->name, "(raw body)");
+
+    ctx->state = UPLOAD_RECV;
+    return ctx;
+}
+
+/**
+ * @brief upload_ctx_free Free the context of an upload request, the temp
+ * files which are not saved are removed. If files are still being saved by
+ * the pool, it is freed by the last of them, so the caller never waits.
+ *
+ * @param ctx The context.
+ */
+void upload_ctx_free(upload_ctx_t *ctx)
+{
+    bool release;
+
+    if(ctx == NULL)
+        return;
+    pthread_mutex_lock(&ctx->lock);
+    ctx->req = NULL;
+    ctx->freed = true;
+    release = ctx->pending == 0 && ctx->posted == 0;
+    pthread_mutex_unlock(&ctx->lock);
+    if(release)
+        ctx_release(ctx);
+}
+
+/**
+ * @brief ctx_release Free the context when nothing holds it any more.
+ *
+ * @param ctx The context.
+ */
+static void ctx_release(upload_ctx_t *ctx)
+{
+    upload_file_t *file;
+
+    if(!ctx->raw)
+        multipart_free(&ctx->mp);
+    while(ctx->files)
+    {
+        file = ctx->files;
+        ctx->files = file->next;
+        file_release(file);
+        free(file);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+/**
+ * @brief upload_wait_async Get called back in the thread of the request when
+ * all files given to the pool are saved, as they are committed with durable
+ * writes, the thread of the request never waits for them.
+ *
+ * @param ctx The upload context, it must not be freed until cb is called.
+ * @param loop The loop of the thread of the request.
+ * @param cb It is posted to loop.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for posted or waiting and ZIMG_ERR for fail, then cb is
+ * not called.
+ */
+int upload_wait_async(upload_ctx_t *ctx, aio_loop_t *loop, aio_loop_cb cb, void *arg)
+{
+    bool saved;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->loop = loop;
+    saved = ctx->pending == 0;
+    if(!saved)
+    {
+        ctx->done_cb = cb;
+        ctx->done_arg = arg;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return saved ? aio_loop_post(loop, cb, arg) : ZIMG_OK;
+}
+
+/**
+ * @brief upload_detach Tell the upload that its request is answered, a read
+ * paused by the bound of a batch is not resumed by the upload any more.
+ *
+ * @param ctx The upload context.
+ *
+ * @return true if the request is paused by the upload, then the caller
+ * resumes it after the reply.
+ */
+bool upload_detach(upload_ctx_t *ctx)
+{
+    bool paused;
+
+    pthread_mutex_lock(&ctx->lock);
+    paused = ctx->req != NULL && (ctx->paused || ctx->posted > 0);
+    ctx->req = NULL;
+    ctx->paused = false;
+    pthread_mutex_unlock(&ctx->lock);
+    return paused;
+}
+
+/**
+ * @brief file_new Add a file to the upload.
+ *
+ * @param ctx The upload context.
+ *
+ * @return The file or NULL for fail.
+ */
+static upload_file_t *file_new(upload_ctx_t *ctx)
+{
+    upload_file_t *file = (upload_file_t *)calloc(1, sizeof(upload_file_t));
+    if(file == NULL)
+        return NULL;
+    file->status = ZIMG_OK;
+    file->fd = -1;
+    file->ctx = ctx;
+    if(md5_init(&file->md5) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "MD5 Init Failed!");
+        free(file);
+        return NULL;
+    }
+
+    *ctx->tail = file;
+    ctx->tail = &file->next;
+    ctx->nfiles++;
+    return file;
+}
+
+/**
+ * @brief file_release Free the data of a file, the temp file is removed.
+ *
+ * @param file The file.
+ */
+static void file_release(upload_file_t *file)
+{
+    md5_free(&file->md5);
+    if(file->buff)
+    {
+        free(file->buff);
+        file->buff = NULL;
+    }
+    if(file->fd != -1)
+    {
+        close(file->fd);
+        file->fd = -1;
+    }
+    if(file->tmp_path[0] != '\0')
+    {
+        unlink(file->tmp_path);
+        file->tmp_path[0] = '\0';
+    }
+}
+
+/**
+ * @brief file_fail Mark a file failed. A single upload stops, but a batch
+ * goes on with the next file.
+ *
+ * @param file The file.
+ *
+ * @return The return value for the parser callbacks.
+ */
+static int file_fail(upload_file_t *file)
+{
+    file->status = ZIMG_ERR;
+    file_release(file);
+    return file->ctx->batch ? 0 : -1;
+}
+
+/**
+ * @brief file_save Save a received file.
+ *
+ * @param file The file.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int file_save(upload_file_t *file)
+{
+    int ret;
+
+    if(file->fd == -1)
+    {
+        ret = save_img_with_md5(file->buff, file->size, file->md5sum);
+    }
+    else
+    {
+        close(file->fd);
+        file->fd = -1;
+        //the temp file is renamed or removed by save_img_file()
+        ret = save_img_file(file->tmp_path, file->md5sum);
+        file->tmp_path[0] = '\0';
+    }
+    file_release(file);
+    file->status = ret;
+    return ret;
+}
+
+/**
+ * @brief save_job Save a file of a batch in a worker thread.
+ *
+ * @param arg The file.
+ */
+static void save_job(void *arg)
+{
+    upload_file_t *file = (upload_file_t *)arg;
+
+    if(file_save(file) == ZIMG_ERR)
+        LOG_PRINT(LOG_ERROR, "Image[%s] Save Failed!", file->name);
+    save_end(file->ctx);
+}
+
+/**
+ * @brief save_end Account a file of a batch which is saved or failed. The
+ * read paused by the bound is resumed when the pool drains, and the waiter
+ * is called back when all files are saved.
+ *
+ * @param ctx The upload context.
+ */
+static void save_end(upload_ctx_t *ctx)
+{
+    aio_loop_cb done_cb = NULL;
+    void *done_arg = NULL;
+    bool resume = false, release;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->pending--;
+    //resume at half of the bound, so the read is not paused for every file
+    if(ctx->paused && ctx->pending <= UPLOAD_BATCH_INFLIGHT / 2)
+    {
+        ctx->paused = false;
+        ctx->posted++;
+        resume = true;
+    }
+    if(ctx->pending == 0 && ctx->done_cb != NULL)
+    {
+        done_cb = ctx->done_cb;
+        done_arg = ctx->done_arg;
+        ctx->done_cb = NULL;
+    }
+    release = ctx->freed && ctx->pending == 0 && ctx->posted == 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(resume && aio_loop_post(ctx->loop, upload_resume, ctx) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Post Resume of Batch to Loop Failed!");
+        pthread_mutex_lock(&ctx->lock);
+        ctx->posted--;
+        release = ctx->freed && ctx->pending == 0 && ctx->posted == 0;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    //the waiter owns ctx, it is not released before done_cb runs
+    if(done_cb != NULL && aio_loop_post(ctx->loop, done_cb, done_arg) == ZIMG_ERR)
+        LOG_PRINT(LOG_ERROR, "Post End of Batch to Loop Failed!");
+    if(release)
+        ctx_release(ctx);
+}
+
+/**
+ * @brief upload_resume Resume reading a batch after the pool drains, it
+ * runs in the thread of the request.
+ *
+ * @param arg The upload context.
+ */
+static void upload_resume(void *arg)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)arg;
+    evhtp_request_t *req;
+    bool release;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->posted--;
+    req = ctx->paused ? NULL : ctx->req;
+    release = ctx->freed && ctx->pending == 0 && ctx->posted == 0;
+    pthread_mutex_unlock(&ctx->lock);
+    if(req != NULL)
+        evhtp_request_resume(req);
+    if(release)
+        ctx_release(ctx);
+}
+
+/**
+ * @brief check_magic Check the format of the file by its head.
+ *
+ * @param file The file, magic is padded with zero if it is short.
+ *
+ * @return ZIMG_OK for a supported image and ZIMG_ERR for not.
+ */
+static int check_magic(upload_file_t *file)
+{
+    if(get_img_format(file->magic) == NULL)
+    {
+        LOG_PRINT(LOG_ERROR, "File[%s] is Not a Supported Image!", file->name);
+        return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief spill_file Move the data of a file from memory to a temp file in
+ * img_path, so it can be renamed as the image at last.
+ *
+ * @param file The file.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int spill_file(upload_file_t *file)
+{
+    snprintf(file->tmp_path, sizeof(file->tmp_path), "%s/.upload_XXXXXX", settings.img_path);
+    file->fd = mkstemp(file->tmp_path);
+    if(file->fd == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "Temp File[%s] Create Failed!", file->tmp_path);
+        file->tmp_path[0] = '\0';
+        return ZIMG_ERR;
+    }
+    fchmod(file->fd, 00644);
+    LOG_PRINT(LOG_INFO, "Spill Upload to [%s].", file->tmp_path);
+
+    if(write_all(file->fd, file->buff, file->size) == ZIMG_ERR)
+        return ZIMG_ERR;
+    free(file->buff);
+    file->buff = NULL;
+    file->cap = 0;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief on_part_begin Check the headers of a part. The parts with a
+ * filename are the images, the other parts are skipped.
+ */
+static int on_part_begin(multipart_parser_t *p, const char *head, size_t len)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)p->arg;
+    upload_file_t *file = NULL;
+    const char *q = NULL;
+
+    ctx->file = NULL;
+    if(ctx->state != UPLOAD_RECV)
+        return 0;
+
+    //find the fileName
+    head = strstr(head, "filename=");
+    if(head == NULL)
+        return 0;
+
+    if(ctx->nfiles >= UPLOAD_BATCH_MAX)
+    {
+        LOG_PRINT(LOG_ERROR, "Too Many Files in a Batch!");
+        return -1;
+    }
+    file = file_new(ctx);
+    if(file == NULL)
+        return -1;
+    ctx->file = file;
+
+    head += 9;
+    if(head[0] == '\"')
+    {
+        head++;
+        q = strstr(head, "\"");
+    }
+    else
+    {
+        q = strstr(head, "\r\n");
+    }
+
+    if(q == NULL || q - head >= sizeof(file->name))
+    {
+        LOG_PRINT(LOG_ERROR, "quote \" or \\r\\n Not Found!");
+        return file_fail(file);
+    }
+    memcpy(file->name, head, q - head);
+    file->name[q - head] = '\0';
+    LOG_PRINT(LOG_INFO, "fileName = %s", file->name);
+
+    //check file extension
+    char fileExt[sizeof(file->name)];
+    if(get_ext(file->name, fileExt) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "Get Type of File[%s] Failed!", file->name);
+        return file_fail(file);
+    }
+
+    if(is_img(fileExt) != 1)
+    {
+        LOG_PRINT(LOG_ERROR, "fileExt[%s] is Not Supported!", fileExt);
+        return file_fail(file);
+    }
+
+    //check Content-Type in part
+    if(strstr(q, "Content-Type") == NULL)
+    {
+        LOG_PRINT(LOG_ERROR, "Content-Type Not Found!");
+        return file_fail(file);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief file_append Hash and store a piece of data of a file. The file is
+ * rejected as soon as its head is known not to be an image.
+ *
+ * @param file The file.
+ * @param data The data.
+ * @param len The length of data.
+ *
+ * @return The return value for the parser callbacks.
+ */
+static int file_append(upload_file_t *file, const char *data, size_t len)
+{
+    if(file->status == ZIMG_ERR)
+        return 0;
+
+    if(file->mlen < IMG_MAGIC_LEN)
+    {
+        size_t n = IMG_MAGIC_LEN - file->mlen;
+        if(n > len)
+            n = len;
+        memcpy(file->magic + file->mlen, data, n);
+        file->mlen += n;
+        if(file->mlen == IMG_MAGIC_LEN && check_magic(file) == ZIMG_ERR)
+            return file_fail(file);
+    }
+
+    md5_append(&file->md5, (const md5_byte_t *)data, len);
+
+    if(file->fd == -1 && file->size + len > UPLOAD_SPILL_SIZE)
+    {
+        if(spill_file(file) == ZIMG_ERR)
+            return file_fail(file);
+    }
+
+    if(file->fd != -1)
+    {
+        if(write_all(file->fd, data, len) == ZIMG_ERR)
+        {
+            LOG_PRINT(LOG_ERROR, "Temp File[%s] Write Failed!", file->tmp_path);
+            return file_fail(file);
+        }
+    }
+    else
+    {
+        if(file->size + len > file->cap)
+        {
+            size_t cap = file->cap ? file->cap : 64 * 1024;
+            while(cap < file->size + len)
+                cap *= 2;
+            if(cap > UPLOAD_SPILL_SIZE)
+                cap = UPLOAD_SPILL_SIZE;
+            char *buff = (char *)realloc(file->buff, cap);
+            if(buff == NULL)
+            {
+                LOG_PRINT(LOG_ERROR, "buff Malloc Failed!");
+                return file_fail(file);
+            }
+            file->buff = buff;
+            file->cap = cap;
+        }
+        memcpy(file->buff + file->size, data, len);
+    }
+    file->size += len;
+    return 0;
+}
+
+/**
+ * @brief file_end Finish the md5 when all data of a file is received. A
+ * single upload is done with its first file, the files of a batch are given
+ * to the pool to be saved.
+ *
+ * @param file The file.
+ *
+ * @return The return value for the parser callbacks.
+ */
+static int file_end(upload_file_t *file)
+{
+    upload_ctx_t *ctx = file->ctx;
+    evhtp_request_t *req = NULL;
+    md5_byte_t md_value[16];
+
+    if(file->status == ZIMG_ERR)
+        return 0;
+
+    if(file->size == 0)
+    {
+        LOG_PRINT(LOG_ERROR, "Image Size is Zero!");
+        return file_fail(file);
+    }
+    if(file->mlen < IMG_MAGIC_LEN && check_magic(file) == ZIMG_ERR)
+        return file_fail(file);
+
+    //a file without its md5 can not be named, it is never stored
+    if(md5_finish(&file->md5, md_value) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "MD5 of Upload Failed!");
+        return file_fail(file);
+    }
+    md5_to_str(md_value, file->md5sum);
+    LOG_PRINT(LOG_INFO, "Upload Received. size: %lu md5: %s", (unsigned long)file->size, file->md5sum);
+
+    if(!ctx->batch)
+    {
+        ctx->state = UPLOAD_DONE;
+        return 0;
+    }
+
+    //bound the memory held by files waiting to be saved, the read of the
+    //body is paused and resumed by the pool when it drains, so the worker
+    //goes on with other connections meanwhile
+    pthread_mutex_lock(&ctx->lock);
+    ctx->pending++;
+    if(ctx->pending >= UPLOAD_BATCH_INFLIGHT && ctx->req != NULL && !ctx->paused)
+    {
+        ctx->paused = true;
+        req = ctx->req;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    if(req != NULL)
+        evhtp_request_pause(req);
+
+    if(upload_pool == NULL || thread_pool_add(upload_pool, save_job, file) == ZIMG_ERR)
+    {
+        //a durable save waits for the committer, never in this thread
+        if(commit_on())
+        {
+            LOG_PRINT(LOG_ERROR, "Image[%s] Can Not Be Saved by the Pool!", file->name);
+            file_fail(file);
+            save_end(ctx);
+        }
+        else
+            save_job(file);
+    }
+    return 0;
+}
+
+static int on_part_data(multipart_parser_t *p, const char *data, size_t len)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)p->arg;
+    if(ctx->file == NULL)
+        return 0;
+    return file_append(ctx->file, data, len);
+}
+
+static int on_part_end(multipart_parser_t *p)
+{
+    upload_ctx_t *ctx = (upload_ctx_t *)p->arg;
+    upload_file_t *file = ctx->file;
+
+    ctx->file = NULL;
+    if(file == NULL)
+        return 0;
+    return file_end(file);
+}
+
+/**
+ * @brief upload_feed Parse a received chunk. The chunk is drained, nothing
+ * more is kept after the upload fails.
+ *
+ * @param ctx The upload context.
+ * @param buf The chunk.
+ *
+ * @return The state of the upload.
+ */
+int upload_feed(upload_ctx_t *ctx, evbuf_t *buf)
+{
+    struct evbuffer_iovec v[16];
+    int i, n;
+
+    while(ctx->state != UPLOAD_ERR && evbuffer_get_length(buf) > 0)
+    {
+        size_t used = 0;
+        n = evbuffer_peek(buf, -1, NULL, v, 16);
+        if(n > 16)
+            n = 16;
+        for(i = 0; i < n; i++)
+        {
+            if(ctx->raw)
+            {
+                //a raw body is stored as it is, there is no boundary to search
+                if(file_append(ctx->file, v[i].iov_base, v[i].iov_len) == -1)
+                {
+                    ctx->state = UPLOAD_ERR;
+                    break;
+                }
+            }
+            else if(multipart_parse(&ctx->mp, v[i].iov_base, v[i].iov_len) == MP_ERR)
+            {
+                ctx->state = UPLOAD_ERR;
+                break;
+            }
+            used += v[i].iov_len;
+        }
+        evbuffer_drain(buf, used);
+    }
+
+    if(ctx->batch && ctx->state == UPLOAD_RECV && ctx->mp.state == MP_END)
+        ctx->state = UPLOAD_DONE;
+
+    evbuffer_drain(buf, evbuffer_get_length(buf));
+    return ctx->state;
+}
+
+/**
+ * @brief upload_finish Tell the upload that the whole body is received. A
+ * raw body can only know its end here, a form knows it by the boundary.
+ *
+ * @param ctx The upload context.
+ *
+ * @return The state of the upload.
+ */
+int upload_finish(upload_ctx_t *ctx)
+{
+    if(ctx->raw && ctx->state == UPLOAD_RECV)
+    {
+        if(file_end(ctx->file) == -1)
+            ctx->state = UPLOAD_ERR;
+        ctx->file = NULL;
+    }
+    return ctx->state;
+}
+
+/**
+ * @brief upload_save Save the image of a single upload.
+ *
+ * @param ctx The upload context, its state must be UPLOAD_DONE.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int upload_save(upload_ctx_t *ctx)
+{
+    if(ctx->state != UPLOAD_DONE || ctx->batch || ctx->files == NULL)
+        return ZIMG_ERR;
+    return file_save(ctx->files);
+}
+
+/**
+ * @brief upload_body Add the image of a single upload to a buffer, such as
+ * to send it to another node. A spilled file is added by its temp file.
+ *
+ * @param ctx The upload context, its state must be UPLOAD_DONE.
+ * @param body The buffer.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int upload_body(upload_ctx_t *ctx, evbuf_t *body)
+{
+    upload_file_t *file = ctx->files;
+    int fd;
+
+    if(ctx->state != UPLOAD_DONE || ctx->batch || file == NULL)
+        return ZIMG_ERR;
+    if(file->fd == -1)
+        return evbuffer_add(body, file->buff, file->size) == 0 ? ZIMG_OK : ZIMG_ERR;
+    //body closes the dup, it keeps the data after the temp file is removed
+    if((fd = dup(file->fd)) == -1)
+        return ZIMG_ERR;
+    if(evbuffer_add_file(body, fd, 0, file->size) == -1)
+    {
+        close(fd);
+        return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+/* a single upload saved by the pool */
+typedef struct save_async_s {
+    upload_ctx_t *ctx;
+    void (*cb)(int ret, void *arg);
+    void *arg;
+} save_async_t;
+
+static void save_async_job(void *arg)
+{
+    save_async_t *sa = (save_async_t *)arg;
+    int ret = file_save(sa->ctx->files);
+
+    sa->cb(ret, sa->arg);
+    free(sa);
+}
+
+/**
+ * @brief upload_save_async Save the image of a single upload by the pool, so
+ * the worker is not blocked while it is committed.
+ *
+ * @param ctx The upload context, its state must be UPLOAD_DONE. It must not
+ * be freed until cb is called.
+ * @param cb It is called on a thread of the pool when the image is saved.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for started and ZIMG_ERR for fail, then cb is not called.
+ */
+int upload_save_async(upload_ctx_t *ctx, void (*cb)(int ret, void *arg), void *arg)
+{
+    save_async_t *sa;
+
+    if(ctx->state != UPLOAD_DONE || ctx->batch || ctx->files == NULL)
+        return ZIMG_ERR;
+    if((sa = (save_async_t *)malloc(sizeof(save_async_t))) == NULL)
+        return ZIMG_ERR;
+    sa->ctx = ctx;
+    sa->cb = cb;
+    sa->arg = arg;
+    if(upload_pool == NULL || thread_pool_add(upload_pool, save_async_job, sa) == ZIMG_ERR)
+    {
+        free(sa);
+        return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+static evhtp_res upload_read_cb(evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    upload_feed((upload_ctx_t *)arg, buf);
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res upload_fini_cb(evhtp_request_t *req, void *arg)
+{
+    upload_ctx_free((upload_ctx_t *)arg);
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief set_upload_hooks Set the hooks which parse the body chunks while
+ * they are received, and pass the context to the request callback as its arg.
+ *
+ * @param req The request.
+ * @param batch Is it a batch upload.
+ *
+ * @return EVHTP_RES_OK.
+ */
+static evhtp_res set_upload_hooks(evhtp_request_t *req, bool batch)
+{
+    htp_method method = evhtp_request_get_method(req);
+    if(method != htp_method_POST && method != htp_method_PUT)
+        return EVHTP_RES_OK;
+    //nothing is stored while received, the request callback refuses it
+    if(origin_on())
+        return EVHTP_RES_OK;
+
+    //the request callback will report the error if it is not a good form
+    upload_ctx_t *ctx = upload_ctx_new(req, batch);
+    if(ctx == NULL)
+        return EVHTP_RES_OK;
+
+    //a batch received by the hooks is paused while the pool is full, the
+    //files are in req->buffer_in already otherwise
+    if(batch && (ctx->loop = aio_loop_get(req->conn->evbase)) != NULL)
+        ctx->req = req;
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_read, (evhtp_hook)upload_read_cb, ctx);
+    evhtp_set_hook(&req->hooks, evhtp_hook_on_request_fini, (evhtp_hook)upload_fini_cb, ctx);
+    req->cbarg = ctx;
+    return EVHTP_RES_OK;
+}
+
+/**
+ * @brief upload_headers_cb The on_headers hook of /upload requests, the
+ * body is a form or an application/octet-stream image.
+ *
+ * @param req The request.
+ * @param hdrs The headers of the request.
+ * @param arg It is not useful.
+ *
+ * @return EVHTP_RES_OK.
+ */
+evhtp_res upload_headers_cb(evhtp_request_t *req, evhtp_headers_t *hdrs, void *arg)
+{
+    return set_upload_hooks(req, false);
+}
+
+/**
+ * @brief batch_headers_cb The on_headers hook of /batch requests.
+ *
+ * @param req The request.
+ * @param hdrs The headers of the request.
+ * @param arg It is not useful.
+ *
+ * @return EVHTP_RES_OK.
+ */
+evhtp_res batch_headers_cb(evhtp_request_t *req, evhtp_headers_t *hdrs, void *arg)
+{
+    return set_upload_hooks(req, true);
+}
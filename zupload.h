@@ -0,0 +1,94 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zupload.h
+ * @brief Receive uploaded images chunk by chunk header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZUPLOAD_H
+#define ZUPLOAD_H
+
+#include <pthread.h>
+#include <evhtp.h>
+#include "zcommon.h"
+#include "zmd5.h"
+#include "zmultipart.h"
+#include "zimg.h"
+#include "zaio.h"
+
+#define UPLOAD_SPILL_SIZE CACHE_MAX_SIZE    /* larger files are written to a temp file */
+#define UPLOAD_BATCH_MAX 10000                  /* max files of a batch upload */
+#define UPLOAD_BATCH_INFLIGHT 64                /* max files of a batch waiting to be saved */
+
+#define UPLOAD_ERR -1
+#define UPLOAD_RECV 0           /* receiving the form */
+#define UPLOAD_DONE 1           /* got the whole file, or the whole form of a batch */
+
+/* where the data of an uploaded file goes */
+typedef struct upload_file_s {
+    int status;                 /* ZIMG_OK, or ZIMG_ERR after it failed */
+    char name[256];
+    char magic[IMG_MAGIC_LEN];  /* the head of data for get_img_format() */
+    size_t mlen;
+    char *buff;                 /* the data while it is small */
+    size_t cap;
+    size_t size;
+    int fd;                     /* the temp file after it is spilled */
+    char tmp_path[512];
+    md5_state_t md5;
+    char md5sum[33];
+    struct upload_ctx_s *ctx;
+    struct upload_file_s *next;
+} upload_file_t;
+
+typedef struct upload_ctx_s {
+    int state;
+    bool batch;                 /* take all files of the form, not only the first */
+    bool raw;                   /* the body is the image, not a form */
+    multipart_parser_t mp;      /* not used by a raw body */
+    upload_file_t *file;        /* the file being received */
+    upload_file_t *files;       /* all files in the order of the form */
+    upload_file_t **tail;
+    int nfiles;
+    int pending;                /* files being saved by the pool */
+    evhtp_request_t *req;       /* a batch received by the hooks, NULL after it is answered */
+    aio_loop_t *loop;           /* the thread of req */
+    bool paused;                /* reading req is paused until the pool drains */
+    int posted;                 /* resumes posted to the loop and not run yet */
+    bool freed;                 /* upload_ctx_free() is called, the last save frees it */
+    aio_loop_cb done_cb;        /* posted to the loop when the pool has saved all files */
+    void *done_arg;
+    pthread_mutex_t lock;
+} upload_ctx_t;
+
+int upload_pool_init(int num_threads);
+void upload_pool_destroy(void);
+upload_ctx_t *upload_ctx_new(evhtp_request_t *req, bool batch);
+upload_ctx_t *upload_ctx_new_raw(void);
+void upload_ctx_free(upload_ctx_t *ctx);
+int upload_feed(upload_ctx_t *ctx, evbuf_t *buf);
+int upload_finish(upload_ctx_t *ctx);
+int upload_save(upload_ctx_t *ctx);
+int upload_body(upload_ctx_t *ctx, evbuf_t *body);
+int upload_save_async(upload_ctx_t *ctx, void (*cb)(int ret, void *arg), void *arg);
+int upload_wait_async(upload_ctx_t *ctx, aio_loop_t *loop, aio_loop_cb cb, void *arg);
+bool upload_detach(upload_ctx_t *ctx);
+evhtp_res upload_headers_cb(evhtp_request_t *req, evhtp_headers_t *hdrs, void *arg);
+evhtp_res batch_headers_cb(evhtp_request_t *req, evhtp_headers_t *hdrs, void *arg);
+
+#endif
@@ -25,21 +25,26 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "zutil.h"
 #include "zlog.h"
 
 //functions list
 pid_t gettid();
 int get_cpu_cores();
-static void kmp_init(const char *pattern, int pattern_size);
+static void kmp_init(const char *pattern, int pattern_size, int *pi);
 int get_type(const char *filename, char *type);
 static int htoi(char s[]);
 int str_hash(const char *str);
 
 
-// this data is for KMP searching
-static int pi[128];
-
 pid_t gettid()
 {
     return syscall(SYS_gettid);
@@ -51,20 +56,20 @@ int get_cpu_cores()
 }
 
 /* KMP for searching */
-static void kmp_init(const char *pattern, int pattern_size)  // prefix-function
+static void kmp_init(const char *pattern, int pattern_size, int *pi)  // prefix-function
 {
     pi[0] = 0;  // pi[0] always equals to 0 by defination
-    int k = 0;  // an important pointer
+    int k = 0;  // length of the matched prefix
     int q;
     for(q = 1; q < pattern_size; q++)  // find each pi[q] for pattern[q]
     {
-        while(k>0 && pattern[k+1]!=pattern[q])
-            k = pi[k];  // use previous prefixes to match pattern[0..q]
+        while(k>0 && pattern[k]!=pattern[q])
+            k = pi[k-1];  // use previous prefixes to match pattern[0..q]
 
-        if(pattern[k+1] == pattern[q]) // if pattern[0..(k+1)] is a prefix
+        if(pattern[k] == pattern[q]) // if pattern[0..k] is a prefix
             k++;             // let k = k + 1
 
-        pi[q] = k;   // be ware, (0 <= k <= q), and (pi[k] < k)
+        pi[q] = k;   // be ware, (0 <= k <= q), and (pi[k] <= k)
     }
     // The worst-case time complexity of this procedure is O(pattern_size)
 }
@@ -89,11 +94,15 @@ int kmp(const char *matcher, int mlen, const char *pattern, int plen)
 
     if(!mlen || !plen || mlen < plen) // take care of illegal parameters
         return -1;
+    // the prefix table is on the stack, so kmp() is thread-safe
+    int pi[128];
+    if(plen > sizeof(pi) / sizeof(pi[0]))
+        return -1;
 
-    kmp_init(pattern, plen);  // prefix-function
+    kmp_init(pattern, plen, pi);  // prefix-function
 
     int i=0, j=0;
-    while(i < mlen && j < plen)  // don't increase i and j at this level
+    while(i + j < mlen && j < plen)  // don't increase i and j at this level
     {
         if(matcher[i+j] == pattern[j])
             j++;
@@ -113,6 +122,100 @@ int kmp(const char *matcher, int mlen, const char *pattern, int plen)
         return -1;
 }
 
+/**
+ * @brief finder_init Init the state of searching a pattern, such as the
+ * delimiter of a multipart body. Each request keeps its own finder.
+ *
+ * @param f The finder.
+ * @param pattern The pattern, it is not copied and must live as long as f.
+ * @param plen Pattern length.
+ */
+void finder_init(zfinder_t *f, const char *pattern, size_t plen)
+{
+    f->pattern = pattern;
+    f->plen = plen;
+    f->first = (unsigned char)pattern[0];
+    f->last = (unsigned char)pattern[plen - 1];
+}
+
+/**
+ * @brief finder_find Search the pattern in a buffer. Candidates are found by
+ * comparing the first and last bytes of the pattern 16 or 32 positions at a
+ * time with SSE2 or AVX2, and then verified with memcmp(). Without SIMD it
+ * skips to candidates with memchr().
+ *
+ * @param f The finder.
+ * @param buff The buffer.
+ * @param len Buffer length.
+ *
+ * @return The place of pattern in buffer, -1 if not found.
+ */
+ssize_t finder_find(const zfinder_t *f, const char *buff, size_t len)
+{
+    const char *p = f->pattern;
+    size_t plen = f->plen;
+    size_t i = 0;
+    const char *c;
+
+    if(plen == 0 || len < plen)
+        return -1;
+    if(plen == 1)
+    {
+        c = memchr(buff, f->first, len);
+        return c ? c - buff : -1;
+    }
+
+#ifdef __AVX2__
+    const __m256i first32 = _mm256_set1_epi8(f->first);
+    const __m256i last32 = _mm256_set1_epi8(f->last);
+    for(; i + plen + 31 <= len; i += 32)
+    {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(buff + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(buff + i + plen - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+                    _mm256_cmpeq_epi8(bf, first32), _mm256_cmpeq_epi8(bl, last32)));
+        while(mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if(memcmp(buff + i + bit + 1, p + 1, plen - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i first16 = _mm_set1_epi8(f->first);
+    const __m128i last16 = _mm_set1_epi8(f->last);
+    for(; i + plen + 15 <= len; i += 16)
+    {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(buff + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(buff + i + plen - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(bf, first16), _mm_cmpeq_epi8(bl, last16)));
+        while(mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if(memcmp(buff + i + bit + 1, p + 1, plen - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    //the tail, or all of the buffer without SIMD
+    while(i + plen <= len)
+    {
+        c = memchr(buff + i, f->first, len - plen + 1 - i);
+        if(c == NULL)
+            return -1;
+        i = c - buff;
+        if((unsigned char)buff[i + plen - 1] == f->last && memcmp(buff + i + 1, p + 1, plen - 2) == 0)
+            return i;
+        i++;
+    }
+    return -1;
+}
+
 /**
  * @brief get_ext It tell you the type of a file.
  *
@@ -254,26 +357,26 @@ int mk_dirs(const char *dir){
 
     char tmp[512];
     char *p = NULL;
-    memset(tmp, 0, sizeof(tmp));
-    strncpy(tmp, dir, strlen(dir));
-
-    if (tmp[0] == '/' && tmp[1]== '/') 
-        p = strchr(tmp + 2, '/'); 
-    else 
-        p = strchr(tmp, '/');
-    if (p) 
+    if (strlen(dir) >= sizeof(tmp))
+        return ZIMG_ERR;
+    strcpy(tmp, dir);
+
+    //create every level by its full path, the cwd is shared by all threads
+    //and must not be changed
+    p = tmp;
+    while (*p == '/')
+        p++;
+    while ((p = strchr(p, '/')) != NULL)
     {
         *p = '\0';
-        mkdir(tmp,0777);
-        chdir(tmp);
-    } 
-    else 
-    {
-        mkdir(tmp,0777);
-        chdir(tmp);
-        return ZIMG_OK;
+        if (mkdir(tmp, 0777) == -1 && errno != EEXIST)
+            return ZIMG_ERR;
+        *p = '/';
+        while (*p == '/')
+            p++;
     }
-    mk_dirs(p + 1);
+    if (mkdir(tmp, 0777) == -1 && errno != EEXIST)
+        return ZIMG_ERR;
     return ZIMG_OK;
 }
 
@@ -351,3 +454,129 @@ int str_hash(const char *str)
     LOG_PRINT(LOG_INFO, "str(3)/4 = %d.", d);
     return d;
 }
+
+/**
+ * @brief write_all Write the whole buffer to a fd, go on after a short write.
+ *
+ * @param fd The fd.
+ * @param buff The buffer.
+ * @param len The length of buffer.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int write_all(int fd, const char *buff, size_t len)
+{
+    ssize_t n;
+    while(len > 0)
+    {
+        n = write(fd, buff, len);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return ZIMG_ERR;
+        }
+        buff += n;
+        len -= n;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief pwrite_all Write the whole buffer to a fd at an offset.
+ *
+ * @param fd The fd.
+ * @param buff The buffer.
+ * @param len The length of buffer.
+ * @param off The offset in the file.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int pwrite_all(int fd, const char *buff, size_t len, off_t off)
+{
+    ssize_t n;
+    while(len > 0)
+    {
+        n = pwrite(fd, buff, len, off);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return ZIMG_ERR;
+        }
+        buff += n;
+        len -= n;
+        off += n;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief pread_all Read a whole range of a file.
+ *
+ * @param fd The fd.
+ * @param buff The buffer.
+ * @param len The length to read.
+ * @param off The offset in the file.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail or the file is short.
+ */
+int pread_all(int fd, char *buff, size_t len, off_t off)
+{
+    ssize_t n;
+    while(len > 0)
+    {
+        n = pread(fd, buff, len, off);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return ZIMG_ERR;
+        }
+        if(n == 0)
+            return ZIMG_ERR;
+        buff += n;
+        len -= n;
+        off += n;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief copy_all Copy a file to another fd in chunks by sendfile(), so the
+ * data never goes through a buffer as large as the file. A small buffer is
+ * used if the kernel can not send between the fds.
+ *
+ * @param out The fd copied to, at its offset.
+ * @param in The fd copied from, from its start.
+ * @param len The length to copy.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail or the file is short.
+ */
+int copy_all(int out, int in, size_t len)
+{
+    char buff[16384];
+    off_t off = 0;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = sendfile(out, in, &off, len < COPY_CHUNK ? len : COPY_CHUNK);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if(n <= 0)
+            return ZIMG_ERR;
+        len -= n;
+    }
+    while(len > 0)
+    {
+        n = len < sizeof(buff) ? len : sizeof(buff);
+        if(pread_all(in, buff, n, off) == ZIMG_ERR || write_all(out, buff, n) == ZIMG_ERR)
+            return ZIMG_ERR;
+        len -= n;
+        off += n;
+    }
+    return ZIMG_OK;
+}
@@ -24,8 +24,20 @@
 
 #include "zcommon.h"
 
+#define COPY_CHUNK (1024 * 1024)   /* bytes sent at a time by copy_all() */
+
+/* state of searching a pattern, see finder_find() */
+typedef struct zfinder_s {
+    const char *pattern;
+    size_t plen;
+    unsigned char first;
+    unsigned char last;
+} zfinder_t;
+
 pid_t gettid();
 int kmp(const char *matcher, int mlen, const char *pattern, int plen);
+void finder_init(zfinder_t *f, const char *pattern, size_t plen);
+ssize_t finder_find(const zfinder_t *f, const char *buff, size_t len);
 int get_ext(const char *filename, char *type);
 int is_img(const char *filename);
 int is_file(const char *path);
@@ -34,6 +46,10 @@ int mk_dir(const char *path);
 int mk_dirs(const char *dir);
 int is_md5(char *s);
 int str_hash(const char *str);
+int write_all(int fd, const char *buff, size_t len);
+int pwrite_all(int fd, const char *buff, size_t len, off_t off);
+int pread_all(int fd, char *buff, size_t len, off_t off);
+int copy_all(int out, int in, size_t len);
 
 
 #endif
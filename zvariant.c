@@ -0,0 +1,552 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zvariant.c
+ * @brief Disk budget of derived image variants, such as 100*100p. Every
+ * stored variant is kept in a LRU list with its size. When they take more
+ * bytes than the budget, the least recently used ones are removed from disk
+ * by a background thread. Original images are never tracked or removed,
+ * but for those got from an origin server, which can be got again.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "zvariant.h"
+#include "zvolume.h"
+#include "zimg.h"
+#include "zlog.h"
+#include "zdisk.h"
+#include "zorigin.h"
+
+#define VARIANT_EVICT_BATCH 64
+#define VARIANT_LOAD_BATCH 1024
+
+typedef struct variant_s {
+    char *key;                          /* md5/name */
+    uint64_t size;
+    struct variant_s *prev;             /* LRU list, the head is the most recent */
+    struct variant_s *next;
+    struct variant_s *hnext;
+} variant_t;
+
+/* a variant found on disk at start */
+typedef struct variant_found_s {
+    char *key;
+    uint64_t size;
+    uint64_t stamp;                     /* bigger is newer */
+} variant_found_t;
+
+typedef struct variant_list_s {
+    variant_found_t *items;
+    size_t n;
+    size_t cap;
+} variant_list_t;
+
+static pthread_mutex_t var_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t var_cond = PTHREAD_COND_INITIALIZER;
+static variant_t **buckets = NULL;
+static size_t nbuckets = 0;
+static variant_t *lru_head = NULL;
+static variant_t *lru_tail = NULL;
+static uint64_t var_budget = 0;
+static uint64_t var_count = 0;
+static uint64_t var_bytes = 0;
+static uint64_t evictions = 0;
+static uint64_t evicted_bytes = 0;
+static bool scanning = false;
+static volatile bool var_stop = false;
+static bool var_started = false;
+static pthread_t var_tid;
+
+static uint32_t key_hash(const char *key);
+static variant_t *var_find(const char *key);
+static variant_t *var_insert(const char *key, uint64_t size, bool recent);
+static void lru_unlink(variant_t *v);
+static void lru_push(variant_t *v, bool recent);
+static void hash_remove(variant_t *v);
+static int list_add(variant_list_t *l, const char *key, uint64_t size, uint64_t stamp);
+static int found_cmp(const void *a, const void *b);
+static void load_found(variant_list_t *l);
+static void scan_vol_cb(const char *key, uint32_t vol, uint64_t off, uint64_t len, void *arg);
+static void scan_dir(int fd, int depth, const char *md5, variant_list_t *l);
+static void evict(void);
+static void *variant_thread(void *arg);
+
+
+/* FNV-1a */
+static uint32_t key_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+    while(*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief var_find Find a variant, var_lock must be held.
+ */
+static variant_t *var_find(const char *key)
+{
+    variant_t *v;
+    if(nbuckets == 0)
+        return NULL;
+    for(v = buckets[key_hash(key) % nbuckets]; v != NULL; v = v->hnext)
+    {
+        if(strcmp(v->key, key) == 0)
+            return v;
+    }
+    return NULL;
+}
+
+static void lru_unlink(variant_t *v)
+{
+    if(v->prev)
+        v->prev->next = v->next;
+    else
+        lru_head = v->next;
+    if(v->next)
+        v->next->prev = v->prev;
+    else
+        lru_tail = v->prev;
+    v->prev = v->next = NULL;
+}
+
+/**
+ * @brief lru_push Put a variant at the head of the LRU list if it is recent,
+ * or at the tail.
+ */
+static void lru_push(variant_t *v, bool recent)
+{
+    if(recent)
+    {
+        v->prev = NULL;
+        v->next = lru_head;
+        if(lru_head)
+            lru_head->prev = v;
+        else
+            lru_tail = v;
+        lru_head = v;
+    }
+    else
+    {
+        v->next = NULL;
+        v->prev = lru_tail;
+        if(lru_tail)
+            lru_tail->next = v;
+        else
+            lru_head = v;
+        lru_tail = v;
+    }
+}
+
+static void hash_remove(variant_t *v)
+{
+    variant_t **pv = &buckets[key_hash(v->key) % nbuckets];
+    while(*pv != v)
+        pv = &(*pv)->hnext;
+    *pv = v->hnext;
+}
+
+/**
+ * @brief var_insert Add a variant which is not tracked, var_lock must be
+ * held.
+ *
+ * @param key The key of the variant.
+ * @param size Bytes it takes.
+ * @param recent Put it at the head of the LRU list, or at the tail.
+ *
+ * @return The variant or NULL for fail.
+ */
+static variant_t *var_insert(const char *key, uint64_t size, bool recent)
+{
+    variant_t *v;
+    size_t i;
+
+    if(var_count >= nbuckets)
+    {
+        size_t n = nbuckets ? nbuckets * 2 : 1024;
+        variant_t **nb = (variant_t **)calloc(n, sizeof(variant_t *));
+        if(nb == NULL)
+            return NULL;
+        for(i = 0; i < nbuckets; i++)
+        {
+            while((v = buckets[i]) != NULL)
+            {
+                buckets[i] = v->hnext;
+                v->hnext = nb[key_hash(v->key) % n];
+                nb[key_hash(v->key) % n] = v;
+            }
+        }
+        free(buckets);
+        buckets = nb;
+        nbuckets = n;
+    }
+
+    v = (variant_t *)calloc(1, sizeof(variant_t));
+    if(v == NULL || (v->key = strdup(key)) == NULL)
+    {
+        free(v);
+        return NULL;
+    }
+    v->size = size;
+    v->hnext = buckets[key_hash(key) % nbuckets];
+    buckets[key_hash(key) % nbuckets] = v;
+    lru_push(v, recent);
+    var_count++;
+    var_bytes += size;
+    return v;
+}
+
+/**
+ * @brief is_variant Check an image name is a derived variant, which can be
+ * made again from the original one. 0*0p is the original and 0.jpg is only
+ * made when it is uploaded. With an origin server, 0*0p is a variant too,
+ * as it is got again when it is missing.
+ *
+ * @param name The name of the image.
+ *
+ * @return true for a variant.
+ */
+bool is_variant(const char *name)
+{
+    if(strcmp(name, "0*0p") == 0)
+        return origin_on();
+    return strcmp(name, "0.jpg") != 0;
+}
+
+/**
+ * @brief variant_add Track a variant just stored, it becomes the most
+ * recently used one.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the variant.
+ * @param size The length of it.
+ */
+void variant_add(const char *md5, const char *name, uint64_t size)
+{
+    char key[VOLUME_KEY_MAX];
+    variant_t *v;
+
+    if(!var_started || !is_variant(name))
+        return;
+    snprintf(key, sizeof(key), "%s/%s", md5, name);
+    pthread_mutex_lock(&var_lock);
+    if((v = var_find(key)) != NULL)
+    {
+        var_bytes = var_bytes - v->size + size;
+        v->size = size;
+        lru_unlink(v);
+        lru_push(v, true);
+    }
+    else
+        var_insert(key, size, true);
+    if(var_bytes > var_budget)
+        pthread_cond_signal(&var_cond);
+    pthread_mutex_unlock(&var_lock);
+}
+
+/**
+ * @brief variant_touch Mark a variant used, called when it is read from disk.
+ *
+ * @param md5 The md5 of the image.
+ * @param name The name of the variant.
+ */
+void variant_touch(const char *md5, const char *name)
+{
+    char key[VOLUME_KEY_MAX];
+    variant_t *v;
+
+    if(!var_started || !is_variant(name))
+        return;
+    snprintf(key, sizeof(key), "%s/%s", md5, name);
+    pthread_mutex_lock(&var_lock);
+    if((v = var_find(key)) != NULL && v != lru_head)
+    {
+        lru_unlink(v);
+        lru_push(v, true);
+    }
+    pthread_mutex_unlock(&var_lock);
+}
+
+static int list_add(variant_list_t *l, const char *key, uint64_t size, uint64_t stamp)
+{
+    if(l->n == l->cap)
+    {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        variant_found_t *items = (variant_found_t *)realloc(l->items, cap * sizeof(variant_found_t));
+        if(items == NULL)
+            return ZIMG_ERR;
+        l->items = items;
+        l->cap = cap;
+    }
+    if((l->items[l->n].key = strdup(key)) == NULL)
+        return ZIMG_ERR;
+    l->items[l->n].size = size;
+    l->items[l->n].stamp = stamp;
+    l->n++;
+    return ZIMG_OK;
+}
+
+/* the newest first */
+static int found_cmp(const void *a, const void *b)
+{
+    uint64_t sa = ((const variant_found_t *)a)->stamp;
+    uint64_t sb = ((const variant_found_t *)b)->stamp;
+    return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+/**
+ * @brief load_found Add the variants found on disk behind the tracked ones,
+ * the oldest at the tail. The lock is released between batches, so requests
+ * are not blocked by a large loading.
+ *
+ * @param l The variants found, it is freed.
+ */
+static void load_found(variant_list_t *l)
+{
+    size_t i;
+
+    if(l->n == 0)
+        return;
+    qsort(l->items, l->n, sizeof(variant_found_t), found_cmp);
+    pthread_mutex_lock(&var_lock);
+    for(i = 0; i < l->n; i++)
+    {
+        if(i % VARIANT_LOAD_BATCH == 0)
+        {
+            pthread_mutex_unlock(&var_lock);
+            pthread_mutex_lock(&var_lock);
+        }
+        if(var_find(l->items[i].key) == NULL)
+            var_insert(l->items[i].key, l->items[i].size, false);
+        free(l->items[i].key);
+    }
+    pthread_mutex_unlock(&var_lock);
+    free(l->items);
+    memset(l, 0, sizeof(variant_list_t));
+}
+
+/* records appended later are newer */
+static void scan_vol_cb(const char *key, uint32_t vol, uint64_t off, uint64_t len, void *arg)
+{
+    const char *name = strchr(key, '/');
+    if(name != NULL && is_variant(name + 1))
+        list_add((variant_list_t *)arg, key, sizeof(vol_rec_t) + strlen(key) + len, ((uint64_t)vol << 40) | off);
+}
+
+/**
+ * @brief scan_dir Find the variant files under a directory of the
+ * img_path/lvl1/lvl2/md5 tree.
+ *
+ * @param fd The fd of the directory, it is closed.
+ * @param depth 0 for img_path or a disk, 3 for a md5 directory.
+ * @param md5 The md5 of the directory at depth 3.
+ * @param l It gets the variants.
+ */
+static void scan_dir(int fd, int depth, const char *md5, variant_list_t *l)
+{
+    char key[VOLUME_KEY_MAX];
+    struct dirent *ent;
+    struct stat st;
+    DIR *d;
+    int sub;
+
+    if((d = fdopendir(fd)) == NULL)
+    {
+        close(fd);
+        return;
+    }
+    while(!var_stop && (ent = readdir(d)) != NULL)
+    {
+        if(ent->d_name[0] == '.')
+            continue;
+        if(depth == 3)
+        {
+            if(!is_variant(ent->d_name) || fstatat(dirfd(d), ent->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+                continue;
+            snprintf(key, sizeof(key), "%s/%s", md5, ent->d_name);
+            list_add(l, key, st.st_size, st.st_mtime);
+        }
+        else if((depth < 2 && strspn(ent->d_name, "0123456789") == strlen(ent->d_name))
+                || (depth == 2 && strlen(ent->d_name) == 32))
+        {
+            if((sub = openat(dirfd(d), ent->d_name, O_RDONLY | O_DIRECTORY)) != -1)
+                scan_dir(sub, depth + 1, ent->d_name, l);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * @brief evict Remove the least recently used variants until they take no
+ * more than VARIANT_LOW_MARK percent of the budget. var_lock must be held, it
+ * is released while files are removed.
+ */
+static void evict(void)
+{
+    variant_t *batch[VARIANT_EVICT_BATCH];
+    uint64_t low = var_budget / 100 * VARIANT_LOW_MARK;
+    const char *name;
+    char md5[40];
+    int i, n;
+
+    while(!var_stop && var_bytes > low && lru_tail != NULL)
+    {
+        for(n = 0; n < VARIANT_EVICT_BATCH && var_bytes > low && lru_tail != NULL; n++)
+        {
+            batch[n] = lru_tail;
+            lru_unlink(batch[n]);
+            hash_remove(batch[n]);
+            var_count--;
+            var_bytes -= batch[n]->size;
+            evictions++;
+            evicted_bytes += batch[n]->size;
+        }
+        pthread_mutex_unlock(&var_lock);
+
+        for(i = 0; i < n; i++)
+        {
+            name = strchr(batch[i]->key, '/');
+            snprintf(md5, sizeof(md5), "%.*s", (int)(name - batch[i]->key), batch[i]->key);
+            if(del_img(md5, name + 1) == ZIMG_ERR)
+                LOG_PRINT(LOG_WARNING, "Variant[%s] Remove Failed!", batch[i]->key);
+            free(batch[i]->key);
+            free(batch[i]);
+        }
+        pthread_mutex_lock(&var_lock);
+    }
+    LOG_PRINT(LOG_INFO, "Variants Evicted, left: %llu bytes: %llu.",
+            (unsigned long long)var_count, (unsigned long long)var_bytes);
+}
+
+static void *variant_thread(void *arg)
+{
+    variant_list_t l;
+    struct timespec ts;
+    const char *root;
+    int fd, i;
+
+    //the variants stored before start are older than the ones added meanwhile
+    memset(&l, 0, sizeof(l));
+    if(settings.volume_on)
+    {
+        vol_foreach(scan_vol_cb, &l);
+        load_found(&l);
+    }
+    for(i = -1, root = settings.img_path; root != NULL; root = disk_path(++i))
+    {
+        if((fd = open(root, O_RDONLY | O_DIRECTORY)) != -1)
+        {
+            scan_dir(fd, 0, NULL, &l);
+            load_found(&l);
+        }
+    }
+
+    pthread_mutex_lock(&var_lock);
+    scanning = false;
+    LOG_PRINT(LOG_INFO, "Variants Loaded, count: %llu bytes: %llu.",
+            (unsigned long long)var_count, (unsigned long long)var_bytes);
+    while(!var_stop)
+    {
+        if(var_bytes > var_budget)
+            evict();
+        if(var_stop)
+            break;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += VARIANT_INTERVAL;
+        pthread_cond_timedwait(&var_cond, &var_lock, &ts);
+    }
+    pthread_mutex_unlock(&var_lock);
+    return NULL;
+}
+
+/**
+ * @brief variant_init Start tracking variants and the thread removing them.
+ * The variants already stored are loaded in the background.
+ *
+ * @param budget Bytes the variants may take on disk.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int variant_init(uint64_t budget)
+{
+    var_budget = budget;
+    var_stop = false;
+    scanning = true;
+    var_started = true;
+    if(pthread_create(&var_tid, NULL, variant_thread, NULL) != 0)
+    {
+        LOG_PRINT(LOG_ERROR, "Variant Thread Create Failed!");
+        var_started = false;
+        return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief variant_destroy Stop the thread and forget the variants.
+ */
+void variant_destroy(void)
+{
+    variant_t *v;
+
+    if(!var_started)
+        return;
+    pthread_mutex_lock(&var_lock);
+    var_stop = true;
+    pthread_cond_signal(&var_cond);
+    pthread_mutex_unlock(&var_lock);
+    pthread_join(var_tid, NULL);
+    var_started = false;
+
+    while((v = lru_head) != NULL)
+    {
+        lru_head = v->next;
+        free(v->key);
+        free(v);
+    }
+    lru_tail = NULL;
+    free(buckets);
+    buckets = NULL;
+    nbuckets = 0;
+    var_count = var_bytes = 0;
+    evictions = evicted_bytes = 0;
+}
+
+/**
+ * @brief variant_stats Get the usage of the budget.
+ *
+ * @param st It gets the stats.
+ */
+void variant_stats(variant_stats_t *st)
+{
+    pthread_mutex_lock(&var_lock);
+    st->budget = var_budget;
+    st->variants = var_count;
+    st->bytes = var_bytes;
+    st->evictions = evictions;
+    st->evicted_bytes = evicted_bytes;
+    st->scanning = scanning;
+    pthread_mutex_unlock(&var_lock);
+}
@@ -0,0 +1,48 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zvariant.h
+ * @brief Disk budget of derived image variants header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZVARIANT_H
+#define ZVARIANT_H
+
+#include <stdint.h>
+#include "zcommon.h"
+
+#define VARIANT_INTERVAL 10             /* seconds between checks of the budget */
+#define VARIANT_LOW_MARK 90             /* percent of the budget left after eviction */
+
+typedef struct variant_stats_s {
+    uint64_t budget;
+    uint64_t variants;
+    uint64_t bytes;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+    bool scanning;                      /* stored variants are still being loaded */
+} variant_stats_t;
+
+int variant_init(uint64_t budget);
+void variant_destroy(void);
+bool is_variant(const char *name);
+void variant_add(const char *md5, const char *name, uint64_t size);
+void variant_touch(const char *md5, const char *name);
+void variant_stats(variant_stats_t *st);
+
+#endif
@@ -0,0 +1,1356 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zvolume.c
+ * @brief Append-only volume storage. Images are appended to large volume
+ * files as records, an in-memory index maps their keys to the volume, offset
+ * and length of the data. Every change of the index is appended to a
+ * journal, which is replayed at start, so no volume needs to be scanned
+ * except the records written after the last journal entry.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "zvolume.h"
+#include "zaio.h"
+#include "zcommit.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define VOLUME_COPY_SIZE (64 * 1024)
+#define VOLUME_COMPACT_INTERVAL 60      /* seconds between checks of dead space */
+
+typedef struct vol_entry_s {
+    char *key;
+    uint32_t vol;
+    uint64_t off;               /* offset of the data */
+    uint64_t len;
+    struct vol_entry_s *next;
+} vol_entry_t;
+
+/* a live record copied by the compactor */
+typedef struct vol_move_s {
+    char *key;
+    uint64_t old_off;
+    uint32_t vol;
+    uint64_t off;
+    uint64_t len;
+    bool swapped;
+} vol_move_t;
+
+/* a record being written by async I/O */
+typedef struct vol_pending_s {
+    char *key;
+    char head[sizeof(vol_rec_t) + VOLUME_KEY_MAX];
+    uint32_t id;
+    uint64_t off;               /* offset of the data */
+    size_t len;
+    int left;                   /* writes not done */
+    int ret;
+    aio_cb cb;
+    void *arg;
+} vol_pending_t;
+
+typedef struct volume_s {
+    int fd;
+    uint64_t size;              /* bytes used, appending starts here */
+    uint64_t dead;              /* bytes of records deleted or replaced */
+} volume_t;
+
+static char vol_dir[512];
+static uint64_t vol_max_size;
+static volume_t *vols[VOLUME_MAX_NUM];
+static int vol_active = -1;
+static pthread_mutex_t vol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static vol_entry_t **buckets = NULL;
+static size_t nbuckets = 0;
+static size_t nentries = 0;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int jnl_fd = -1;
+static pthread_mutex_t jnl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t compact_tid;
+static bool compact_started = false;
+static volatile bool compact_stop = false;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int compact_ratio;
+static uint64_t compact_rate;
+/* progress and results of compaction, guarded by vol_lock */
+static int compact_vol = -1;
+static uint64_t compact_done = 0;
+static uint64_t compact_total = 0;
+static uint64_t compactions = 0;
+static uint64_t reclaimed = 0;
+
+static uint32_t key_hash(const char *key);
+static vol_entry_t *index_find(const char *key);
+static int index_set(const char *key, uint32_t vol, uint64_t off, uint64_t len);
+static int index_unset(const char *key, vol_entry_t *old);
+static void mark_dead(uint32_t vol, uint64_t bytes);
+static volume_t *open_volume(uint32_t id, bool create);
+static size_t journal_entry(char *buf, int op, const char *key, uint32_t vol, uint64_t off, uint64_t len);
+static int journal_append(int op, const char *key, uint32_t vol, uint64_t off, uint64_t len);
+static int journal_rewrite(void);
+static void replay_journal(uint64_t *ends);
+static void scan_volume(uint32_t id, uint64_t from);
+static void count_dead(void);
+static int reserve(size_t rec_len, uint32_t *id, uint64_t *off);
+static int write_record(const char *key, const char *buff, int src_fd, uint64_t src_off, size_t len,
+        uint32_t *id, uint64_t *off);
+static int append(const char *key, const char *buff, int src_fd, size_t len);
+static size_t record_head(char *head, const char *key, size_t len);
+static void put_done(int ret, void *arg);
+static void set_deleted(uint32_t vol, uint64_t data_off, size_t klen);
+static void throttle(const struct timespec *start, uint64_t bytes);
+static int compact_volume(uint32_t id);
+static void *compact_thread(void *arg);
+
+
+/* FNV-1a */
+static uint32_t key_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+    while(*key)
+    {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief index_find Find a key in the index, index_lock must be held.
+ */
+static vol_entry_t *index_find(const char *key)
+{
+    vol_entry_t *e;
+    if(nbuckets == 0)
+        return NULL;
+    for(e = buckets[key_hash(key) % nbuckets]; e != NULL; e = e->next)
+    {
+        if(strcmp(e->key, key) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief index_set Add or replace a key in the index, the replaced record
+ * becomes dead. index_lock must be held for writing.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int index_set(const char *key, uint32_t vol, uint64_t off, uint64_t len)
+{
+    vol_entry_t *e = index_find(key);
+    size_t i;
+
+    if(e != NULL)
+    {
+        mark_dead(e->vol, sizeof(vol_rec_t) + strlen(key) + e->len);
+        e->vol = vol;
+        e->off = off;
+        e->len = len;
+        return ZIMG_OK;
+    }
+
+    if(nentries >= nbuckets)
+    {
+        size_t n = nbuckets ? nbuckets * 2 : 1024;
+        vol_entry_t **nb = (vol_entry_t **)calloc(n, sizeof(vol_entry_t *));
+        if(nb == NULL)
+            return ZIMG_ERR;
+        for(i = 0; i < nbuckets; i++)
+        {
+            while(buckets[i])
+            {
+                e = buckets[i];
+                buckets[i] = e->next;
+                e->next = nb[key_hash(e->key) % n];
+                nb[key_hash(e->key) % n] = e;
+            }
+        }
+        free(buckets);
+        buckets = nb;
+        nbuckets = n;
+    }
+
+    e = (vol_entry_t *)malloc(sizeof(vol_entry_t));
+    if(e == NULL)
+        return ZIMG_ERR;
+    e->key = strdup(key);
+    if(e->key == NULL)
+    {
+        free(e);
+        return ZIMG_ERR;
+    }
+    e->vol = vol;
+    e->off = off;
+    e->len = len;
+    e->next = buckets[key_hash(key) % nbuckets];
+    buckets[key_hash(key) % nbuckets] = e;
+    nentries++;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief index_unset Remove a key from the index, index_lock must be held
+ * for writing.
+ *
+ * @param key The key.
+ * @param old It gets the removed entry.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found.
+ */
+static int index_unset(const char *key, vol_entry_t *old)
+{
+    vol_entry_t **pe, *e;
+    if(nbuckets == 0)
+        return ZIMG_ERR;
+    for(pe = &buckets[key_hash(key) % nbuckets]; (e = *pe) != NULL; pe = &e->next)
+    {
+        if(strcmp(e->key, key) == 0)
+        {
+            *pe = e->next;
+            *old = *e;
+            free(e->key);
+            free(e);
+            nentries--;
+            return ZIMG_OK;
+        }
+    }
+    return ZIMG_ERR;
+}
+
+static void mark_dead(uint32_t vol, uint64_t bytes)
+{
+    pthread_mutex_lock(&vol_lock);
+    if(vols[vol])
+        vols[vol]->dead += bytes;
+    pthread_mutex_unlock(&vol_lock);
+}
+
+/**
+ * @brief open_volume Open a volume file.
+ *
+ * @param id The id of the volume.
+ * @param create Create it if it does not exist.
+ *
+ * @return The volume or NULL for fail.
+ */
+static volume_t *open_volume(uint32_t id, bool create)
+{
+    char path[600];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%08u.vol", vol_dir, id);
+    volume_t *v = (volume_t *)calloc(1, sizeof(volume_t));
+    if(v == NULL)
+        return NULL;
+    v->fd = open(path, O_RDWR | (create ? O_CREAT : 0), 00644);
+    if(v->fd == -1 || fstat(v->fd, &st) == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "Volume[%s] Open Failed!", path);
+        if(v->fd != -1)
+            close(v->fd);
+        free(v);
+        return NULL;
+    }
+    v->size = st.st_size;
+    LOG_PRINT(LOG_INFO, "Volume[%s] Opened, size: %llu.", path, (unsigned long long)v->size);
+    return v;
+}
+
+/**
+ * @brief journal_entry Build an entry of the journal.
+ *
+ * @return The length of the entry.
+ */
+static size_t journal_entry(char *buf, int op, const char *key, uint32_t vol, uint64_t off, uint64_t len)
+{
+    vol_jnl_t *j = (vol_jnl_t *)buf;
+    size_t klen = strlen(key);
+
+    memset(j, 0, sizeof(vol_jnl_t));
+    j->magic = VOLUME_JNL_MAGIC;
+    j->op = op;
+    j->klen = klen;
+    j->vol = vol;
+    j->off = off;
+    j->len = len;
+    memcpy(buf + sizeof(vol_jnl_t), key, klen);
+    return sizeof(vol_jnl_t) + klen;
+}
+
+/**
+ * @brief journal_append Append a change of the index to the journal.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int journal_append(int op, const char *key, uint32_t vol, uint64_t off, uint64_t len)
+{
+    char buf[sizeof(vol_jnl_t) + VOLUME_KEY_MAX];
+    size_t n = journal_entry(buf, op, key, vol, off, len);
+    int ret;
+
+    //O_APPEND makes every entry one atomic write
+    pthread_mutex_lock(&jnl_lock);
+    ret = write_all(jnl_fd, buf, n);
+    pthread_mutex_unlock(&jnl_lock);
+    if(ret == ZIMG_ERR)
+        LOG_PRINT(LOG_ERROR, "Journal Write Failed!");
+    return ret;
+}
+
+/**
+ * @brief journal_rewrite Replace the journal by a snapshot of the index, so
+ * it does not grow forever and no entry points to a removed volume. Entries
+ * appended meanwhile wait for jnl_lock and go to the new journal.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int journal_rewrite(void)
+{
+    char path[600], tmp[600];
+    char buf[sizeof(vol_jnl_t) + VOLUME_KEY_MAX];
+    vol_entry_t *e;
+    FILE *fp;
+    size_t i, n;
+    int fd, ret = ZIMG_OK;
+
+    snprintf(path, sizeof(path), "%s/%s", vol_dir, VOLUME_JOURNAL);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    pthread_mutex_lock(&jnl_lock);
+    fd = open(tmp, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 00644);
+    if(fd == -1 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        if(fd != -1)
+            close(fd);
+        pthread_mutex_unlock(&jnl_lock);
+        LOG_PRINT(LOG_ERROR, "Journal[%s] Open Failed!", tmp);
+        return ZIMG_ERR;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    for(i = 0; i < nbuckets && ret == ZIMG_OK; i++)
+    {
+        for(e = buckets[i]; e != NULL; e = e->next)
+        {
+            n = journal_entry(buf, VOLUME_OP_PUT, e->key, e->vol, e->off, e->len);
+            if(fwrite(buf, n, 1, fp) != 1)
+            {
+                ret = ZIMG_ERR;
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if(ret == ZIMG_OK && (fflush(fp) != 0 || fsync(fd) == -1 || rename(tmp, path) == -1))
+        ret = ZIMG_ERR;
+    if(ret == ZIMG_OK)
+    {
+        close(jnl_fd);
+        jnl_fd = dup(fd);
+        if((fd = open(vol_dir, O_RDONLY)) != -1)
+        {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    else
+    {
+        LOG_PRINT(LOG_ERROR, "Journal Rewrite Failed!");
+        unlink(tmp);
+    }
+    fclose(fp);
+    pthread_mutex_unlock(&jnl_lock);
+    return ret;
+}
+
+/**
+ * @brief replay_journal Rebuild the index from the journal.
+ *
+ * @param ends It gets the end of the last journaled record of each volume.
+ */
+static void replay_journal(uint64_t *ends)
+{
+    FILE *fp = fdopen(dup(jnl_fd), "r");
+    vol_jnl_t j;
+    char key[VOLUME_KEY_MAX];
+    vol_entry_t old;
+    size_t n = 0;
+
+    if(fp == NULL)
+        return;
+    while(fread(&j, sizeof(j), 1, fp) == 1)
+    {
+        if(j.magic != VOLUME_JNL_MAGIC || j.klen == 0 || j.klen >= VOLUME_KEY_MAX
+                || fread(key, j.klen, 1, fp) != 1)
+        {
+            LOG_PRINT(LOG_WARNING, "Journal is Broken after %lu Entries.", (unsigned long)n);
+            break;
+        }
+        key[j.klen] = '\0';
+        n++;
+        if(j.op == VOLUME_OP_DEL)
+        {
+            if(index_unset(key, &old) == ZIMG_OK)
+                mark_dead(old.vol, sizeof(vol_rec_t) + j.klen + old.len);
+            continue;
+        }
+        if(j.vol >= VOLUME_MAX_NUM || vols[j.vol] == NULL || j.off + j.len > vols[j.vol]->size)
+        {
+            LOG_PRINT(LOG_WARNING, "Journal Entry of [%s] Points Out of Volumes.", key);
+            continue;
+        }
+        index_set(key, j.vol, j.off, j.len);
+        if(j.off + j.len > ends[j.vol])
+            ends[j.vol] = j.off + j.len;
+    }
+    fclose(fp);
+    LOG_PRINT(LOG_INFO, "Journal Replayed, entries: %lu keys: %lu.", (unsigned long)n, (unsigned long)nentries);
+}
+
+/**
+ * @brief scan_volume Add the records which are not in the journal to the
+ * index, such as the ones written just before a crash. The volume is cut at
+ * the first broken record.
+ *
+ * @param id The id of the volume.
+ * @param from Where to start scanning.
+ */
+static void scan_volume(uint32_t id, uint64_t from)
+{
+    volume_t *v = vols[id];
+    vol_rec_t rec;
+    char key[VOLUME_KEY_MAX];
+    uint64_t off = from;
+
+    while(off + sizeof(rec) <= v->size)
+    {
+        if(pread_all(v->fd, (char *)&rec, sizeof(rec), off) == ZIMG_ERR
+                || rec.magic != VOLUME_REC_MAGIC || rec.klen == 0 || rec.klen >= VOLUME_KEY_MAX
+                || off + sizeof(rec) + rec.klen + rec.dlen > v->size
+                || pread_all(v->fd, key, rec.klen, off + sizeof(rec)) == ZIMG_ERR)
+            break;
+        key[rec.klen] = '\0';
+        if(!(rec.flags & VOLUME_REC_DEL))
+        {
+            index_set(key, id, off + sizeof(rec) + rec.klen, rec.dlen);
+            journal_append(VOLUME_OP_PUT, key, id, off + sizeof(rec) + rec.klen, rec.dlen);
+        }
+        else
+            v->dead += sizeof(rec) + rec.klen + rec.dlen;
+        off += sizeof(rec) + rec.klen + rec.dlen;
+    }
+
+    if(off < v->size)
+    {
+        LOG_PRINT(LOG_WARNING, "Volume[%u] is Broken at %llu, Cut it.", id, (unsigned long long)off);
+        if(ftruncate(v->fd, off) == 0)
+            v->size = off;
+        else
+            v->dead += v->size - off;
+    }
+}
+
+/**
+ * @brief count_dead Count the dead bytes of each volume from the index, the
+ * journal does not remember the records replaced before it was rewritten.
+ */
+static void count_dead(void)
+{
+    vol_entry_t *e;
+    size_t i;
+
+    for(i = 0; i < VOLUME_MAX_NUM; i++)
+    {
+        if(vols[i])
+            vols[i]->dead = vols[i]->size;
+    }
+    for(i = 0; i < nbuckets; i++)
+    {
+        for(e = buckets[i]; e != NULL; e = e->next)
+            vols[e->vol]->dead -= sizeof(vol_rec_t) + strlen(e->key) + e->len;
+    }
+}
+
+/**
+ * @brief vol_init Open the volumes and load the index.
+ *
+ * @param dir The directory of volumes.
+ * @param max_size A new volume is started when the active one is full.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int vol_init(const char *dir, uint64_t max_size)
+{
+    char path[600];
+    DIR *d;
+    struct dirent *ent;
+    unsigned int id;
+    char c;
+    int i;
+
+    snprintf(vol_dir, sizeof(vol_dir), "%s", dir);
+    vol_max_size = max_size;
+    if(mk_dirs(vol_dir) == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Volume Dir[%s] Create Failed!", vol_dir);
+        return ZIMG_ERR;
+    }
+
+    if((d = opendir(vol_dir)) == NULL)
+        return ZIMG_ERR;
+    while((ent = readdir(d)) != NULL)
+    {
+        if(sscanf(ent->d_name, "%u.vo%c", &id, &c) != 2 || c != 'l' || id >= VOLUME_MAX_NUM)
+            continue;
+        if((vols[id] = open_volume(id, false)) == NULL)
+        {
+            closedir(d);
+            vol_close();
+            return ZIMG_ERR;
+        }
+        if((int)id > vol_active)
+            vol_active = id;
+    }
+    closedir(d);
+
+    if(vol_active == -1)
+    {
+        if((vols[0] = open_volume(0, true)) == NULL)
+            return ZIMG_ERR;
+        vol_active = 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", vol_dir, VOLUME_JOURNAL);
+    jnl_fd = open(path, O_RDWR | O_APPEND | O_CREAT, 00644);
+    if(jnl_fd == -1)
+    {
+        LOG_PRINT(LOG_ERROR, "Journal[%s] Open Failed!", path);
+        vol_close();
+        return ZIMG_ERR;
+    }
+
+    uint64_t *ends = (uint64_t *)calloc(VOLUME_MAX_NUM, sizeof(uint64_t));
+    if(ends == NULL)
+    {
+        vol_close();
+        return ZIMG_ERR;
+    }
+    replay_journal(ends);
+    for(i = 0; i <= vol_active; i++)
+    {
+        if(vols[i] && ends[i] < vols[i]->size)
+            scan_volume(i, ends[i]);
+    }
+    free(ends);
+    count_dead();
+
+    LOG_PRINT(LOG_INFO, "Volumes Loaded, active: %d keys: %lu.", vol_active, (unsigned long)nentries);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief vol_close Close the volumes and free the index.
+ */
+void vol_close(void)
+{
+    vol_entry_t *e;
+    size_t i;
+
+    vol_compact_stop();
+
+    for(i = 0; i < nbuckets; i++)
+    {
+        while((e = buckets[i]) != NULL)
+        {
+            buckets[i] = e->next;
+            free(e->key);
+            free(e);
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    nbuckets = nentries = 0;
+
+    for(i = 0; i < VOLUME_MAX_NUM; i++)
+    {
+        if(vols[i])
+        {
+            close(vols[i]->fd);
+            free(vols[i]);
+            vols[i] = NULL;
+        }
+    }
+    vol_active = -1;
+
+    if(jnl_fd != -1)
+    {
+        close(jnl_fd);
+        jnl_fd = -1;
+    }
+}
+
+/**
+ * @brief reserve Reserve the space of a record at the end of the active
+ * volume, so records can be written at the same time. A new volume is
+ * started when the active one is full.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int reserve(size_t rec_len, uint32_t *id, uint64_t *off)
+{
+    volume_t *v;
+
+    pthread_mutex_lock(&vol_lock);
+    v = vols[vol_active];
+    if(v->size > 0 && v->size + rec_len > vol_max_size)
+    {
+        if(vol_active + 1 >= VOLUME_MAX_NUM || (v = open_volume(vol_active + 1, true)) == NULL)
+        {
+            pthread_mutex_unlock(&vol_lock);
+            LOG_PRINT(LOG_ERROR, "New Volume Create Failed!");
+            return ZIMG_ERR;
+        }
+        vols[++vol_active] = v;
+    }
+    *id = vol_active;
+    *off = v->size;
+    v->size += rec_len;
+    pthread_mutex_unlock(&vol_lock);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief record_head Build the head of a record.
+ *
+ * @param head It gets the head, sizeof(vol_rec_t) + VOLUME_KEY_MAX bytes.
+ * @param key The key.
+ * @param len The length of the data.
+ *
+ * @return The length of the head, 0 for a bad key.
+ */
+static size_t record_head(char *head, const char *key, size_t len)
+{
+    vol_rec_t *rec = (vol_rec_t *)head;
+    size_t klen = strlen(key);
+
+    if(klen == 0 || klen >= VOLUME_KEY_MAX)
+        return 0;
+    memset(rec, 0, sizeof(vol_rec_t));
+    rec->magic = VOLUME_REC_MAGIC;
+    rec->klen = klen;
+    rec->dlen = len;
+    memcpy(head + sizeof(vol_rec_t), key, klen);
+    return sizeof(vol_rec_t) + klen;
+}
+
+/**
+ * @brief write_record Write a record at the end of the active volume.
+ *
+ * @param key The key.
+ * @param buff The data, or NULL to copy it from src_fd.
+ * @param src_fd A file of the data.
+ * @param src_off Where the data starts in src_fd.
+ * @param len The length of the data.
+ * @param id It gets the id of the volume.
+ * @param off It gets the offset of the data.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int write_record(const char *key, const char *buff, int src_fd, uint64_t src_off, size_t len,
+        uint32_t *id, uint64_t *off)
+{
+    char head[sizeof(vol_rec_t) + VOLUME_KEY_MAX];
+    size_t hlen = record_head(head, key, len);
+    int ret;
+
+    if(hlen == 0)
+        return ZIMG_ERR;
+    if(reserve(hlen + len, id, off) == ZIMG_ERR)
+        return ZIMG_ERR;
+
+    ret = pwrite_all(vols[*id]->fd, head, hlen, *off);
+    if(ret == ZIMG_OK && buff != NULL)
+    {
+        ret = pwrite_all(vols[*id]->fd, buff, len, *off + hlen);
+    }
+    else if(ret == ZIMG_OK)
+    {
+        char *tmp = (char *)malloc(VOLUME_COPY_SIZE);
+        size_t done = 0, n;
+        if(tmp == NULL)
+            ret = ZIMG_ERR;
+        while(ret == ZIMG_OK && done < len)
+        {
+            n = len - done < VOLUME_COPY_SIZE ? len - done : VOLUME_COPY_SIZE;
+            ret = pread_all(src_fd, tmp, n, src_off + done);
+            if(ret == ZIMG_OK)
+                ret = pwrite_all(vols[*id]->fd, tmp, n, *off + hlen + done);
+            done += n;
+        }
+        free(tmp);
+    }
+    if(ret == ZIMG_ERR)
+    {
+        LOG_PRINT(LOG_ERROR, "Volume[%u] Write Failed!", *id);
+        mark_dead(*id, hlen + len);
+        return ZIMG_ERR;
+    }
+    *off += hlen;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief append Append a record and add it to the index.
+ *
+ * @param key The key.
+ * @param buff The data, or NULL to copy it from src_fd.
+ * @param src_fd A file of the data, it is read from the beginning.
+ * @param len The length of the data.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+static int append(const char *key, const char *buff, int src_fd, size_t len)
+{
+    uint32_t id;
+    uint64_t off;
+    int ret;
+
+    if(write_record(key, buff, src_fd, 0, len, &id, &off) == ZIMG_ERR)
+        return ZIMG_ERR;
+
+    pthread_rwlock_wrlock(&index_lock);
+    ret = index_set(key, id, off, len);
+    pthread_rwlock_unlock(&index_lock);
+    if(ret == ZIMG_ERR)
+        return ZIMG_ERR;
+
+    journal_append(VOLUME_OP_PUT, key, id, off, len);
+    LOG_PRINT(LOG_INFO, "Key[%s] Stored in Volume[%u] at %llu.", key, id, (unsigned long long)off);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief vol_put Store a buffer, it replaces the old one of the same key.
+ *
+ * @param key The key.
+ * @param buff The buffer.
+ * @param len The length of buffer.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int vol_put(const char *key, const char *buff, size_t len)
+{
+    return append(key, buff, -1, len);
+}
+
+/**
+ * @brief vol_put_fd Store the content of a file.
+ *
+ * @param key The key.
+ * @param fd The file.
+ * @param len The length of the file.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int vol_put_fd(const char *key, int fd, size_t len)
+{
+    return append(key, NULL, fd, len);
+}
+
+/* the head and the data of a record are written */
+static void put_done(int ret, void *arg)
+{
+    vol_pending_t *p = (vol_pending_t *)arg;
+    size_t hlen = sizeof(vol_rec_t) + strlen(p->key);
+
+    if(ret == ZIMG_ERR)
+        p->ret = ZIMG_ERR;
+    if(__sync_sub_and_fetch(&p->left, 1) > 0)
+        return;
+
+    if(p->ret == ZIMG_OK)
+    {
+        pthread_rwlock_wrlock(&index_lock);
+        p->ret = index_set(p->key, p->id, p->off, p->len);
+        pthread_rwlock_unlock(&index_lock);
+    }
+    if(p->ret == ZIMG_OK)
+    {
+        journal_append(VOLUME_OP_PUT, p->key, p->id, p->off, p->len);
+        LOG_PRINT(LOG_INFO, "Key[%s] Stored in Volume[%u] at %llu.", p->key, p->id, (unsigned long long)p->off);
+    }
+    else
+    {
+        LOG_PRINT(LOG_ERROR, "Volume[%u] Write Failed!", p->id);
+        mark_dead(p->id, hlen + p->len);
+    }
+    p->cb(p->ret, p->arg);
+    free(p->key);
+    free(p);
+}
+
+/**
+ * @brief vol_put_async Store a buffer by async I/O. The head and the data of
+ * the record are submitted as one batch, the key is added to the index when
+ * both are written.
+ *
+ * @param key The key.
+ * @param buff The buffer, it must be valid until cb is called.
+ * @param len The length of buffer.
+ * @param cb It is called on an I/O thread when the buffer is stored.
+ * @param arg The argument of cb.
+ *
+ * @return ZIMG_OK for submitted and ZIMG_ERR for fail, then cb is not called.
+ */
+int vol_put_async(const char *key, const char *buff, size_t len, aio_cb cb, void *arg)
+{
+    vol_pending_t *p = (vol_pending_t *)calloc(1, sizeof(vol_pending_t));
+    aio_op_t ops[2];
+    size_t hlen;
+
+    if(p == NULL)
+        return ZIMG_ERR;
+    if((hlen = record_head(p->head, key, len)) == 0 || (p->key = strdup(key)) == NULL)
+    {
+        free(p);
+        return ZIMG_ERR;
+    }
+    if(reserve(hlen + len, &p->id, &p->off) == ZIMG_ERR)
+    {
+        free(p->key);
+        free(p);
+        return ZIMG_ERR;
+    }
+    p->len = len;
+    p->left = 2;
+    p->ret = ZIMG_OK;
+    p->cb = cb;
+    p->arg = arg;
+
+    ops[0].type = AIO_WRITE;
+    ops[0].fd = vols[p->id]->fd;
+    ops[0].buf = p->head;
+    ops[0].len = hlen;
+    ops[0].off = p->off;
+    ops[0].cb = put_done;
+    ops[0].arg = p;
+    ops[0].queue = 0;
+    ops[1] = ops[0];
+    ops[1].buf = (char *)buff;
+    ops[1].len = len;
+    ops[1].off = p->off + hlen;
+    p->off += hlen;
+    if(len == 0)
+        p->left = 1;
+    if(aio_submit(ops, p->left) == ZIMG_ERR)
+    {
+        mark_dead(p->id, hlen + len);
+        free(p->key);
+        free(p);
+        return ZIMG_ERR;
+    }
+    return ZIMG_OK;
+}
+
+/**
+ * @brief vol_exist Check a key is stored.
+ *
+ * @return 1 for stored and 0 for not.
+ */
+int vol_exist(const char *key)
+{
+    int ret;
+    pthread_rwlock_rdlock(&index_lock);
+    ret = index_find(key) != NULL;
+    pthread_rwlock_unlock(&index_lock);
+    return ret;
+}
+
+/**
+ * @brief vol_open Get where the data of a key is, so it can be sent by
+ * sendfile() without reading.
+ *
+ * @param key The key.
+ * @param fd It gets a new fd of the volume, the caller must close it.
+ * @param off It gets the offset of the data in the volume.
+ * @param len It gets the length of the data.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found or fail.
+ */
+int vol_open(const char *key, int *fd, off_t *off, size_t *len)
+{
+    vol_entry_t *e;
+    int ret = ZIMG_ERR;
+
+    pthread_rwlock_rdlock(&index_lock);
+    e = index_find(key);
+    if(e != NULL && (*fd = dup(vols[e->vol]->fd)) != -1)
+    {
+        *off = e->off;
+        *len = e->len;
+        ret = ZIMG_OK;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return ret;
+}
+
+/**
+ * @brief vol_sync Make a stored key durable by group commit, the volume of
+ * it and the journal are synced.
+ *
+ * @param key The key.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found or fail.
+ */
+int vol_sync(const char *key)
+{
+    commit_t c;
+    off_t off;
+    size_t len;
+    int ret;
+
+    memset(&c, 0, sizeof(c));
+    if(vol_open(key, &c.fd, &off, &len) == ZIMG_ERR)
+        return ZIMG_ERR;
+    pthread_mutex_lock(&jnl_lock);
+    c.dirfd = dup(jnl_fd);
+    pthread_mutex_unlock(&jnl_lock);
+    c.from = NULL;
+    ret = commit_wait(&c);
+    close(c.fd);
+    if(c.dirfd != -1)
+        close(c.dirfd);
+    if(ret == ZIMG_ERR)
+        LOG_PRINT(LOG_ERROR, "Key[%s] Commit Failed!", key);
+    return ret;
+}
+
+/**
+ * @brief vol_read Read the data of a key by a single pread().
+ *
+ * @param key The key.
+ * @param buff It gets a malloc()ed buffer of the data.
+ * @param len It gets the length of the data.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found or fail.
+ */
+int vol_read(const char *key, char **buff, size_t *len)
+{
+    vol_entry_t *e;
+    int ret = ZIMG_ERR;
+
+    *buff = NULL;
+    pthread_rwlock_rdlock(&index_lock);
+    e = index_find(key);
+    if(e != NULL && e->len > 0 && (*buff = (char *)malloc(e->len)) != NULL)
+    {
+        ret = pread_all(vols[e->vol]->fd, *buff, e->len, e->off);
+        *len = e->len;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if(ret == ZIMG_ERR && *buff != NULL)
+    {
+        LOG_PRINT(LOG_ERROR, "Key[%s] Read Failed!", key);
+        free(*buff);
+        *buff = NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief set_deleted Mark a record deleted in its volume.
+ *
+ * @param vol The id of the volume.
+ * @param data_off The offset of the data of the record.
+ * @param klen The length of the key of the record.
+ */
+static void set_deleted(uint32_t vol, uint64_t data_off, size_t klen)
+{
+    uint16_t flags = VOLUME_REC_DEL;
+    pwrite_all(vols[vol]->fd, (const char *)&flags, sizeof(flags),
+            data_off - klen - sizeof(vol_rec_t) + offsetof(vol_rec_t, flags));
+}
+
+/**
+ * @brief vol_del Delete a key. Its record is marked deleted in the volume,
+ * so scanning the volume does not bring it back.
+ *
+ * @param key The key.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for not found.
+ */
+int vol_del(const char *key)
+{
+    vol_entry_t old;
+    size_t klen = strlen(key);
+
+    pthread_rwlock_wrlock(&index_lock);
+    if(index_unset(key, &old) == ZIMG_ERR)
+    {
+        pthread_rwlock_unlock(&index_lock);
+        return ZIMG_ERR;
+    }
+    set_deleted(old.vol, old.off, klen);
+    mark_dead(old.vol, sizeof(vol_rec_t) + klen + old.len);
+    pthread_rwlock_unlock(&index_lock);
+
+    journal_append(VOLUME_OP_DEL, key, old.vol, old.off, old.len);
+    return ZIMG_OK;
+}
+
+/**
+ * @brief throttle Sleep to keep the I/O of compaction under compact_rate.
+ *
+ * @param start When the compaction started.
+ * @param bytes Bytes read and written since start.
+ */
+static void throttle(const struct timespec *start, uint64_t bytes)
+{
+    struct timespec now, ts;
+    double elapsed, need;
+
+    if(compact_rate == 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    need = (double)bytes / compact_rate;
+    if(need > elapsed)
+    {
+        ts.tv_sec = (time_t)(need - elapsed);
+        ts.tv_nsec = (long)((need - elapsed - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * @brief compact_volume Copy the live records of a volume to the active one,
+ * then point the index at the copies in one step and remove the volume.
+ * Records deleted or replaced while being copied are dropped. Only the
+ * compactor removes volumes, so vols[id] stays valid here.
+ *
+ * @param id The id of the volume, it must not be the active one.
+ *
+ * @return ZIMG_OK for removed and ZIMG_ERR for fail or stopped.
+ */
+static int compact_volume(uint32_t id)
+{
+    volume_t *v = vols[id];
+    vol_rec_t rec;
+    char key[VOLUME_KEY_MAX];
+    vol_entry_t *e;
+    vol_move_t *moves = NULL, *m;
+    size_t nmoves = 0, cap = 0, i;
+    uint64_t off = 0, size, data_off, io = 0, copied = 0;
+    struct timespec start;
+    bool live, complete = false;
+
+    pthread_mutex_lock(&vol_lock);
+    size = v->size;
+    compact_vol = id;
+    compact_done = 0;
+    compact_total = size;
+    pthread_mutex_unlock(&vol_lock);
+    LOG_PRINT(LOG_INFO, "Volume[%u] Compaction Started, size: %llu dead: %llu.",
+            id, (unsigned long long)size, (unsigned long long)v->dead);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!compact_stop)
+    {
+        if(off == size)
+        {
+            complete = true;
+            break;
+        }
+        if(off + sizeof(rec) > size
+                || pread_all(v->fd, (char *)&rec, sizeof(rec), off) == ZIMG_ERR
+                || rec.magic != VOLUME_REC_MAGIC || rec.klen == 0 || rec.klen >= VOLUME_KEY_MAX
+                || off + sizeof(rec) + rec.klen + rec.dlen > size
+                || pread_all(v->fd, key, rec.klen, off + sizeof(rec)) == ZIMG_ERR)
+        {
+            LOG_PRINT(LOG_ERROR, "Volume[%u] is Broken at %llu, Compaction Aborted.", id, (unsigned long long)off);
+            break;
+        }
+        key[rec.klen] = '\0';
+        data_off = off + sizeof(rec) + rec.klen;
+
+        pthread_rwlock_rdlock(&index_lock);
+        e = index_find(key);
+        live = e != NULL && e->vol == id && e->off == data_off;
+        pthread_rwlock_unlock(&index_lock);
+
+        if(live)
+        {
+            if(nmoves == cap)
+            {
+                cap = cap ? cap * 2 : 256;
+                m = (vol_move_t *)realloc(moves, cap * sizeof(vol_move_t));
+                if(m == NULL)
+                    break;
+                moves = m;
+            }
+            m = &moves[nmoves];
+            m->old_off = data_off;
+            m->len = rec.dlen;
+            if((m->key = strdup(key)) == NULL)
+                break;
+            if(write_record(key, NULL, v->fd, data_off, rec.dlen, &m->vol, &m->off) == ZIMG_ERR)
+            {
+                free(m->key);
+                break;
+            }
+            nmoves++;
+            copied += sizeof(rec) + rec.klen + rec.dlen;
+            io += sizeof(rec) + rec.klen + rec.dlen * 2;
+        }
+        off = data_off + rec.dlen;
+        io += sizeof(rec) + rec.klen;
+
+        pthread_mutex_lock(&vol_lock);
+        compact_done = off;
+        pthread_mutex_unlock(&vol_lock);
+        throttle(&start, io);
+    }
+
+    pthread_rwlock_wrlock(&index_lock);
+    for(i = 0; i < nmoves; i++)
+    {
+        m = &moves[i];
+        e = index_find(m->key);
+        m->swapped = e != NULL && e->vol == id && e->off == m->old_off;
+        if(m->swapped)
+        {
+            e->vol = m->vol;
+            e->off = m->off;
+        }
+    }
+    if(complete)
+    {
+        pthread_mutex_lock(&vol_lock);
+        vols[id] = NULL;
+        compact_vol = -1;
+        compactions++;
+        reclaimed += size - copied;
+        pthread_mutex_unlock(&vol_lock);
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    for(i = 0; i < nmoves; i++)
+    {
+        m = &moves[i];
+        if(m->swapped)
+        {
+            journal_append(VOLUME_OP_PUT, m->key, m->vol, m->off, m->len);
+            if(!complete)
+            {
+                set_deleted(id, m->old_off, strlen(m->key));
+                mark_dead(id, sizeof(vol_rec_t) + strlen(m->key) + m->len);
+            }
+        }
+        else
+        {
+            set_deleted(m->vol, m->off, strlen(m->key));
+            mark_dead(m->vol, sizeof(vol_rec_t) + strlen(m->key) + m->len);
+        }
+        free(m->key);
+    }
+    free(moves);
+
+    if(!complete)
+    {
+        pthread_mutex_lock(&vol_lock);
+        compact_vol = -1;
+        pthread_mutex_unlock(&vol_lock);
+        return ZIMG_ERR;
+    }
+
+    snprintf(key, sizeof(key), "%s/%08u.vol", vol_dir, id);
+    close(v->fd);
+    free(v);
+    if(unlink(key) == -1)
+        LOG_PRINT(LOG_WARNING, "Volume[%s] Unlink Failed!", key);
+    LOG_PRINT(LOG_INFO, "Volume[%u] Compacted, moved: %lu reclaimed: %llu.",
+            id, (unsigned long)nmoves, (unsigned long long)(size - copied));
+    return ZIMG_OK;
+}
+
+/**
+ * @brief vol_compact Compact the volumes whose dead space reaches a ratio,
+ * the one with the most dead space first. The active volume is skipped.
+ *
+ * @param ratio The percent of dead space.
+ *
+ * @return The number of volumes compacted.
+ */
+int vol_compact(int ratio)
+{
+    int i, id, n = 0;
+    double r, best;
+
+    while(!compact_stop)
+    {
+        id = -1;
+        best = -1;
+        pthread_mutex_lock(&vol_lock);
+        for(i = 0; i < vol_active; i++)
+        {
+            if(vols[i] == NULL)
+                continue;
+            r = vols[i]->size ? (double)vols[i]->dead * 100 / vols[i]->size : 100;
+            if(r >= ratio && r > best)
+            {
+                best = r;
+                id = i;
+            }
+        }
+        pthread_mutex_unlock(&vol_lock);
+
+        if(id == -1 || compact_volume(id) == ZIMG_ERR)
+            break;
+        n++;
+    }
+    if(n > 0)
+        journal_rewrite();
+    return n;
+}
+
+static void *compact_thread(void *arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&compact_lock);
+    while(!compact_stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += VOLUME_COMPACT_INTERVAL;
+        pthread_cond_timedwait(&compact_cond, &compact_lock, &ts);
+        if(compact_stop)
+            break;
+        pthread_mutex_unlock(&compact_lock);
+        vol_compact(compact_ratio);
+        pthread_mutex_lock(&compact_lock);
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+/**
+ * @brief vol_compact_start Start the thread compacting volumes in the
+ * background.
+ *
+ * @param ratio The percent of dead space which makes a volume compacted.
+ * @param rate Bytes per second read and written by compaction, 0 for no limit.
+ *
+ * @return ZIMG_OK for success and ZIMG_ERR for fail.
+ */
+int vol_compact_start(int ratio, uint64_t rate)
+{
+    compact_ratio = ratio;
+    compact_rate = rate;
+    compact_stop = false;
+    if(pthread_create(&compact_tid, NULL, compact_thread, NULL) != 0)
+    {
+        LOG_PRINT(LOG_ERROR, "Compaction Thread Create Failed!");
+        return ZIMG_ERR;
+    }
+    compact_started = true;
+    return ZIMG_OK;
+}
+
+/**
+ * @brief vol_compact_stop Stop the compaction thread, a running compaction
+ * keeps the records it has moved.
+ */
+void vol_compact_stop(void)
+{
+    if(!compact_started)
+        return;
+    pthread_mutex_lock(&compact_lock);
+    compact_stop = true;
+    pthread_cond_signal(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+    pthread_join(compact_tid, NULL);
+    compact_started = false;
+}
+
+/**
+ * @brief vol_foreach Call a function for every key stored. The index is
+ * locked meanwhile, so the function must not call vol_*() functions.
+ *
+ * @param cb The function, it gets the key and where the data is.
+ * @param arg The last argument of cb.
+ */
+void vol_foreach(void (*cb)(const char *key, uint32_t vol, uint64_t off, uint64_t len, void *arg), void *arg)
+{
+    vol_entry_t *e;
+    size_t i;
+
+    pthread_rwlock_rdlock(&index_lock);
+    for(i = 0; i < nbuckets; i++)
+    {
+        for(e = buckets[i]; e != NULL; e = e->next)
+            cb(e->key, e->vol, e->off, e->len, arg);
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+/**
+ * @brief vol_stats Get the usage of volumes and the progress of compaction.
+ *
+ * @param st It gets the stats.
+ */
+void vol_stats(vol_stats_t *st)
+{
+    int i;
+
+    memset(st, 0, sizeof(vol_stats_t));
+    pthread_mutex_lock(&vol_lock);
+    for(i = 0; i <= vol_active; i++)
+    {
+        if(vols[i] == NULL)
+            continue;
+        st->volumes++;
+        st->bytes += vols[i]->size;
+        st->dead_bytes += vols[i]->dead;
+    }
+    st->active = vol_active;
+    st->compacting = compact_vol;
+    st->compact_done = compact_done;
+    st->compact_total = compact_total;
+    st->compactions = compactions;
+    st->reclaimed_bytes = reclaimed;
+    pthread_mutex_unlock(&vol_lock);
+
+    pthread_rwlock_rdlock(&index_lock);
+    st->keys = nentries;
+    pthread_rwlock_unlock(&index_lock);
+}
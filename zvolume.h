@@ -0,0 +1,91 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zvolume.h
+ * @brief Append-only volume storage header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZVOLUME_H
+#define ZVOLUME_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "zcommon.h"
+#include "zaio.h"
+
+#define VOLUME_DIR "volumes"            /* under img_path */
+#define VOLUME_JOURNAL "index.jnl"      /* in VOLUME_DIR */
+#define VOLUME_MAX_NUM 4096
+#define VOLUME_KEY_MAX 256
+
+#define VOLUME_REC_MAGIC 0x7a766f6c     /* "zvol" */
+#define VOLUME_JNL_MAGIC 0x7a6a6e6c     /* "zjnl" */
+#define VOLUME_REC_DEL 0x1
+
+#define VOLUME_OP_PUT 1
+#define VOLUME_OP_DEL 2
+
+/* a record in a volume file, the key and the data follow it */
+typedef struct vol_rec_s {
+    uint32_t magic;
+    uint16_t klen;
+    uint16_t flags;
+    uint64_t dlen;
+} vol_rec_t;
+
+/* an entry of the journal, the key follows it */
+typedef struct vol_jnl_s {
+    uint32_t magic;
+    uint16_t op;
+    uint16_t klen;
+    uint32_t vol;
+    uint32_t pad;
+    uint64_t off;
+    uint64_t len;
+} vol_jnl_t;
+
+typedef struct vol_stats_s {
+    uint32_t volumes;
+    int active;
+    uint64_t keys;
+    uint64_t bytes;
+    uint64_t dead_bytes;
+    int compacting;                     /* id of the volume being compacted, -1 for none */
+    uint64_t compact_done;              /* bytes of it scanned */
+    uint64_t compact_total;
+    uint64_t compactions;
+    uint64_t reclaimed_bytes;
+} vol_stats_t;
+
+int vol_init(const char *dir, uint64_t max_size);
+void vol_close(void);
+int vol_put(const char *key, const char *buff, size_t len);
+int vol_put_fd(const char *key, int fd, size_t len);
+int vol_put_async(const char *key, const char *buff, size_t len, aio_cb cb, void *arg);
+int vol_exist(const char *key);
+int vol_open(const char *key, int *fd, off_t *off, size_t *len);
+int vol_sync(const char *key);
+int vol_read(const char *key, char **buff, size_t *len);
+int vol_del(const char *key);
+int vol_compact(int ratio);
+int vol_compact_start(int ratio, uint64_t rate);
+void vol_compact_stop(void);
+void vol_foreach(void (*cb)(const char *key, uint32_t vol, uint64_t off, uint64_t len, void *arg), void *arg);
+void vol_stats(vol_stats_t *st);
+
+#endif
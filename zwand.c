@@ -0,0 +1,204 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+
+/**
+ * @file zwand.c
+ * @brief Per-thread pools of reusable wands.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "zwand.h"
+
+/* Every worker thread owns one pool, so no lock is needed to use it. */
+typedef struct wand_pool_s {
+    MagickWand *magick[WAND_POOL_SIZE];
+    int nmagick;
+    PixelWand *pixel[WAND_POOL_SIZE];
+    int npixel;
+    DrawingWand *drawing[WAND_POOL_SIZE];
+    int ndrawing;
+} wand_pool_t;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void free_pool(void *arg);
+static void make_pool_key(void);
+static wand_pool_t *get_pool(void);
+
+
+/**
+ * @brief free_pool Destroy all idle wands of a pool, it runs when the owner
+ * thread exits.
+ *
+ * @param arg The pool.
+ */
+static void free_pool(void *arg)
+{
+    wand_pool_t *pool = (wand_pool_t *)arg;
+    if(pool == NULL)
+        return;
+
+    while(pool->nmagick > 0)
+        DestroyMagickWand(pool->magick[--pool->nmagick]);
+    while(pool->npixel > 0)
+        DestroyPixelWand(pool->pixel[--pool->npixel]);
+    while(pool->ndrawing > 0)
+        DestroyDrawingWand(pool->drawing[--pool->ndrawing]);
+    free(pool);
+}
+
+static void make_pool_key(void)
+{
+    pthread_key_create(&pool_key, free_pool);
+}
+
+/**
+ * @brief get_pool Get the pool of the calling thread, create it at the first
+ * time.
+ *
+ * @return The pool or NULL if malloc failed.
+ */
+static wand_pool_t *get_pool(void)
+{
+    pthread_once(&pool_key_once, make_pool_key);
+
+    wand_pool_t *pool = (wand_pool_t *)pthread_getspecific(pool_key);
+    if(pool == NULL)
+    {
+        pool = (wand_pool_t *)calloc(1, sizeof(wand_pool_t));
+        if(pool == NULL)
+            return NULL;
+        pthread_setspecific(pool_key, pool);
+    }
+    return pool;
+}
+
+/**
+ * @brief get_magick_wand Get a blank MagickWand from the pool of this thread.
+ *
+ * @return The wand, give it back by put_magick_wand().
+ */
+MagickWand *get_magick_wand(void)
+{
+    wand_pool_t *pool = get_pool();
+    if(pool != NULL && pool->nmagick > 0)
+        return pool->magick[--pool->nmagick];
+    return NewMagickWand();
+}
+
+/**
+ * @brief put_magick_wand Clear a MagickWand and keep it for the next request.
+ *
+ * @param wand The wand got by get_magick_wand().
+ */
+void put_magick_wand(MagickWand *wand)
+{
+    if(wand == NULL)
+        return;
+
+    wand_pool_t *pool = get_pool();
+    if(pool != NULL && pool->nmagick < WAND_POOL_SIZE)
+    {
+        ClearMagickWand(wand);
+        pool->magick[pool->nmagick++] = wand;
+    }
+    else
+        DestroyMagickWand(wand);
+}
+
+/**
+ * @brief get_pixel_wand Get a blank PixelWand from the pool of this thread.
+ *
+ * @return The wand, give it back by put_pixel_wand().
+ */
+PixelWand *get_pixel_wand(void)
+{
+    wand_pool_t *pool = get_pool();
+    if(pool != NULL && pool->npixel > 0)
+        return pool->pixel[--pool->npixel];
+    return NewPixelWand();
+}
+
+/**
+ * @brief put_pixel_wand Clear a PixelWand and keep it for the next request.
+ *
+ * @param wand The wand got by get_pixel_wand().
+ */
+void put_pixel_wand(PixelWand *wand)
+{
+    if(wand == NULL)
+        return;
+
+    wand_pool_t *pool = get_pool();
+    if(pool != NULL && pool->npixel < WAND_POOL_SIZE)
+    {
+        ClearPixelWand(wand);
+        pool->pixel[pool->npixel++] = wand;
+    }
+    else
+        DestroyPixelWand(wand);
+}
+
+/**
+ * @brief get_drawing_wand Get a blank DrawingWand from the pool of this thread.
+ *
+ * @return The wand, give it back by put_drawing_wand().
+ */
+DrawingWand *get_drawing_wand(void)
+{
+    wand_pool_t *pool = get_pool();
+    if(pool != NULL && pool->ndrawing > 0)
+        return pool->drawing[--pool->ndrawing];
+    return NewDrawingWand();
+}
+
+/**
+ * @brief put_drawing_wand Clear a DrawingWand and keep it for the next request.
+ *
+ * @param wand The wand got by get_drawing_wand().
+ */
+void put_drawing_wand(DrawingWand *wand)
+{
+    if(wand == NULL)
+        return;
+
+    wand_pool_t *pool = get_pool();
+    if(pool != NULL && pool->ndrawing < WAND_POOL_SIZE)
+    {
+        ClearDrawingWand(wand);
+        pool->drawing[pool->ndrawing++] = wand;
+    }
+    else
+        DestroyDrawingWand(wand);
+}
+
+/**
+ * @brief wand_pool_destroy Destroy the pool of the calling thread. Call it
+ * before MagickWandTerminus() in the thread which will not exit by itself.
+ */
+void wand_pool_destroy(void)
+{
+    pthread_once(&pool_key_once, make_pool_key);
+
+    wand_pool_t *pool = (wand_pool_t *)pthread_getspecific(pool_key);
+    if(pool != NULL)
+    {
+        pthread_setspecific(pool_key, NULL);
+        free_pool(pool);
+    }
+}
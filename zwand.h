@@ -0,0 +1,38 @@
+/*   
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us 
+ *   
+ *   Copyright (c) 2013, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *   
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ * 
+ */
+
+/**
+ * @file zwand.h
+ * @brief Per-thread pools of reusable wands header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 1.0
+ * @date 2026-10-19
+ */
+
+
+#ifndef ZWAND_H
+#define ZWAND_H
+
+#include <wand/MagickWand.h>
+
+/* Max number of idle wands of each kind kept by one thread. */
+#define WAND_POOL_SIZE 4
+
+MagickWand *get_magick_wand(void);
+void put_magick_wand(MagickWand *wand);
+PixelWand *get_pixel_wand(void);
+void put_pixel_wand(PixelWand *wand);
+DrawingWand *get_drawing_wand(void);
+void put_drawing_wand(DrawingWand *wand);
+void wand_pool_destroy(void);
+
+#endif